@@ -22,8 +22,21 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "instrumentation.h"
 
@@ -52,6 +65,10 @@ struct image {
   int height;
   int maxval;    // maximum gray value (pixels with maxval are pure WHITE)
   uint8* pixel;  // pixel data (a raster scan)
+  void* map;     // memory mapping containing the pixel data (NULL if none)
+  size_t maplen; // length of the memory mapping
+  struct block* data;  // block that owns the pixel data (shared by clones)
+  int shared;    // pixel data may be shared with a clone (checked on writes)
 };
 
 // This module follows "design-by-contract" principles.
@@ -73,11 +90,11 @@ struct image {
 //
 // Additional information:  man 3 errno;  man 3 error;
 
-// Variable to preserve errno temporarily
-static int errsave = 0;
+// Variable to preserve errno temporarily (per thread, like errno)
+static _Thread_local int errsave = 0;
 
-// Error cause
-static char* errCause;
+// Error cause (per thread, like errno)
+static _Thread_local char* errCause;
 
 /// Error cause.
 /// After some other module function fails (and returns an error code),
@@ -87,6 +104,8 @@ static char* errCause;
 ///
 /// After a successful operation, the result is not garanteed (it might be
 /// the previous error cause).  It is not meant to be used in that situation!
+/// Like errno, the error cause is per thread: it is the cause of the last
+/// failure in the calling thread.
 char* ImageErrMsg() {  ///
   return errCause;
 }
@@ -137,6 +156,298 @@ static int check(int condition, const char* failmsg) {
   errCause = (char*)(condition ? "" : failmsg);
   return condition;
 }
+
+// Memory accounting
+//
+// All heap memory of the module is allocated with memAlloc (or blockGet,
+// below) and released with memFree (or blockPut), which keep the statistics
+// returned by ImageMemGet.
+// (Atomic, so that images may be created and destroyed in several threads.)
+
+static _Atomic size_t memCurrent = 0;
+static _Atomic size_t memPeak = 0;
+static _Atomic size_t memLargest = 0;
+static _Atomic unsigned long memCount = 0;
+static _Atomic size_t memLimit = 0;
+
+// Set *var to value, if value is larger.
+static void atomicMax(_Atomic size_t* var, size_t value) {
+  size_t old = atomic_load(var);
+  while (value > old && !atomic_compare_exchange_weak(var, &old, value)) {
+  }
+}
+
+// Account for the allocation of size bytes.
+// If limited and the allocation would exceed the memory limit, it fails.
+// Returns nonzero on success; on failure, returns 0, with errno set to ENOMEM
+// and errCause set.
+static int memReserve(size_t size, int limited) {
+  size_t current = atomic_fetch_add(&memCurrent, size) + size;
+  size_t limit = atomic_load(&memLimit);
+  if (limited && limit > 0 && current > limit) {
+    atomic_fetch_sub(&memCurrent, size);
+    errno = ENOMEM;
+    errCause = "Memory limit exceeded";
+    return 0;
+  }
+  atomic_fetch_add(&memCount, 1);
+  atomicMax(&memPeak, current);
+  atomicMax(&memLargest, size);
+  return 1;
+}
+
+// Account for the release of size bytes.
+static void memRelease(size_t size) {
+  atomic_fetch_sub(&memCurrent, size);
+}
+
+// Allocate size bytes (zeroed, if zero is nonzero).
+// If limited and the allocation would exceed the memory limit, it fails.
+// Returns NULL on failure, with errno set to ENOMEM and errCause set to
+// failmsg (or to a message about the limit).
+static void* memAlloc(size_t size, int zero, int limited, const char* failmsg) {
+  if (!memReserve(size, limited)) return NULL;
+  void* p = zero ? calloc(size, 1) : malloc(size);
+  if (p == NULL) {
+    memRelease(size);
+    errno = ENOMEM;
+    errCause = (char*)failmsg;
+  }
+  return p;
+}
+
+// Resize p, allocated by memAlloc with size bytes, to newsize bytes (which
+// is not limited).  Returns the new pointer, or NULL on failure, with errno
+// set to ENOMEM and errCause set to failmsg (and p left unchanged).
+static void* memRealloc(void* p, size_t size, size_t newsize,
+                        const char* failmsg) {
+  if (newsize > size && !memReserve(newsize - size, 0)) return NULL;
+  void* q = realloc(p, newsize);
+  if (q == NULL) {
+    if (newsize > size) memRelease(newsize - size);
+    errno = ENOMEM;
+    errCause = (char*)failmsg;
+  } else if (newsize < size) {
+    memRelease(size - newsize);
+  }
+  return q;
+}
+
+// Release p, which was allocated by memAlloc with size bytes.
+static void memFree(void* p, size_t size) {
+  if (p == NULL) return;
+  free(p);
+  memRelease(size);
+}
+
+/// Get memory statistics.
+void ImageMemGet(ImageMemInfo* info) {  ///
+  assert(info != NULL);
+  info->current = atomic_load(&memCurrent);
+  info->peak = atomic_load(&memPeak);
+  info->count = atomic_load(&memCount);
+  info->largest = atomic_load(&memLargest);
+  info->limit = atomic_load(&memLimit);
+}
+
+/// Reset memory statistics.
+void ImageMemReset(void) {  ///
+  atomic_store(&memPeak, atomic_load(&memCurrent));
+  atomic_store(&memCount, 0);
+  atomic_store(&memLargest, 0);
+}
+
+/// Set the memory limit (0 for unlimited).
+void ImageMemSetLimit(size_t limit) {  ///
+  atomic_store(&memLimit, limit);
+}
+
+// Raster pool
+//
+// Each image structure is allocated in a block, followed by its pixels, so
+// creating an image takes a single allocation.  Block capacities come in
+// size classes (4 per power of two, so at most 25% is wasted), and the
+// blocks of destroyed images are kept in a free list per class (the pool),
+// to be reused by later images of the same class without calling malloc and
+// free, and without faulting in fresh pages.
+// The pool keeps at most poolCapacity bytes of free blocks.
+// Blocks in use are accounted for (see memReserve); free blocks are not.
+//
+// The pixels of a block may be shared by several images (see ImageClone):
+// each image refers to the block that owns its pixels (img->data), which
+// counts its users (images whose data is that block) and its references
+// (its users, plus 1 while its own image is alive).  A block returns to the
+// pool when it has no references left.
+
+// A block: an image structure followed by the capacity for its pixels
+typedef struct block {
+  struct image img;     // the image structure (must be first)
+  struct block* next;   // next free block of the class (in the pool)
+  size_t capacity;      // bytes available for pixels
+  int cls;              // size class (-1 if too large to be pooled)
+  atomic_int refs;      // references to the block (users + own image)
+  atomic_int users;     // images whose pixels are in this block
+  uint8 pixel[];        // the pixels
+} Block;
+
+// Classes: 0 for capacity MINBLOCK, then 4 classes for each power of two
+// up to MAXBLOCK (larger blocks are not pooled)
+#define MINLOG 6
+#define MAXLOG 30
+#define MINBLOCK ((size_t)1 << MINLOG)
+#define MAXBLOCK ((size_t)1 << MAXLOG)
+#define NUMCLASSES (1 + 4 * (MAXLOG - MINLOG))
+
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+static Block* poolFree[NUMCLASSES];   // free lists
+static size_t poolBytes = 0;          // bytes in free blocks
+static size_t poolCapacity = (size_t)64 << 20;
+static unsigned long poolHits = 0;    // blocks reused from the pool
+static unsigned long poolMisses = 0;  // blocks allocated
+
+// Size class for blocks with bytes of pixels; sets *capacity.
+// Returns -1 if blocks of that size are not pooled.
+static int sizeClass(size_t bytes, size_t* capacity) {
+  if (bytes <= MINBLOCK) {
+    *capacity = MINBLOCK;
+    return 0;
+  }
+  if (bytes > MAXBLOCK) {
+    *capacity = bytes;
+    return -1;
+  }
+  // 2^k < bytes <= 2^(k+1), em passos de 2^k/4
+  int k = MINLOG;
+  while (((size_t)2 << k) < bytes) k++;
+  size_t step = ((size_t)1 << k) / 4;
+  size_t sub = (bytes - ((size_t)1 << k) + step - 1) / step;  // 1..4
+  *capacity = ((size_t)1 << k) + sub * step;
+  return 1 + 4 * (k - MINLOG) + (int)(sub - 1);
+}
+
+// Get a block for bytes of pixels (zeroed, if zero), from the pool if
+// possible.
+// If limited, fails when exceeding the memory limit.
+// Returns NULL on failure, with errno/errCause set.
+static Block* blockGet(size_t bytes, int zero, int limited) {
+  size_t capacity;
+  int cls = sizeClass(bytes, &capacity);
+  if (!memReserve(sizeof(Block) + capacity, limited)) return NULL;
+  Block* b = NULL;
+  if (cls >= 0) {
+    pthread_mutex_lock(&poolLock);
+    b = poolFree[cls];
+    if (b != NULL) {
+      poolFree[cls] = b->next;
+      poolBytes -= sizeof(Block) + capacity;
+      poolHits++;
+    } else {
+      poolMisses++;
+    }
+    pthread_mutex_unlock(&poolLock);
+  }
+  if (b != NULL) {
+    if (zero) memset(b->pixel, 0, bytes);
+  } else {
+    // calloc de blocos grandes obtém páginas novas, já a zeros
+    b = calloc(1, sizeof(Block) + capacity);
+    if (b == NULL) {
+      memRelease(sizeof(Block) + capacity);
+      errno = ENOMEM;
+      errCause = "Falhou a alocação de memória para a imagem";
+      return NULL;
+    }
+    b->capacity = capacity;
+    b->cls = cls;
+  }
+  return b;
+}
+
+// Return block b to the pool (or free it, if the pool is full).
+static void blockPut(Block* b) {
+  size_t size = sizeof(Block) + b->capacity;
+  memRelease(size);
+  if (b->cls >= 0) {
+    pthread_mutex_lock(&poolLock);
+    if (poolBytes + size <= poolCapacity) {
+      b->next = poolFree[b->cls];
+      poolFree[b->cls] = b;
+      poolBytes += size;
+      b = NULL;
+    }
+    pthread_mutex_unlock(&poolLock);
+  }
+  free(b);
+}
+
+// Drop a reference to block b, returning it to the pool if it was the last.
+// The mapping of its image (if any) holds the pixels, so it is removed too.
+static void blockUnref(Block* b) {
+  if (atomic_fetch_sub(&b->refs, 1) == 1) {
+    if (b->img.map != NULL) munmap(b->img.map, b->img.maplen);
+    blockPut(b);
+  }
+}
+
+/// Pre-allocate count free blocks for width x height images in the pool.
+int ImagePoolPrewarm(int width, int height, int count) {  ///
+  assert(width >= 0 && height >= 0 && count >= 0);
+  size_t capacity;
+  int cls = sizeClass((size_t)width * height, &capacity);
+  if (cls < 0) return 1;  // not pooled: nothing to do
+  size_t size = sizeof(Block) + capacity;
+  for (int i = 0; i < count; i++) {
+    Block* b = malloc(size);
+    if (!check(b != NULL, "Falhou a alocação de memória para a imagem")) {
+      return 0;
+    }
+    memset(b, 0, size);  // fault in the pages now
+    b->capacity = capacity;
+    b->cls = cls;
+    pthread_mutex_lock(&poolLock);
+    b->next = poolFree[cls];
+    poolFree[cls] = b;
+    poolBytes += size;
+    if (poolBytes > poolCapacity) poolCapacity = poolBytes;
+    pthread_mutex_unlock(&poolLock);
+  }
+  return 1;
+}
+
+/// Release free blocks of the pool, until at most keep bytes are left.
+void ImagePoolTrim(size_t keep) {  ///
+  pthread_mutex_lock(&poolLock);
+  // Libertar primeiro os blocos maiores
+  for (int cls = NUMCLASSES - 1; cls >= 0 && poolBytes > keep; cls--) {
+    while (poolFree[cls] != NULL && poolBytes > keep) {
+      Block* b = poolFree[cls];
+      poolFree[cls] = b->next;
+      poolBytes -= sizeof(Block) + b->capacity;
+      free(b);
+    }
+  }
+  pthread_mutex_unlock(&poolLock);
+}
+
+/// Set the maximum bytes of free blocks kept in the pool.
+void ImagePoolSetCapacity(size_t capacity) {  ///
+  pthread_mutex_lock(&poolLock);
+  poolCapacity = capacity;
+  pthread_mutex_unlock(&poolLock);
+  ImagePoolTrim(capacity);
+}
+
+/// Get pool statistics.
+void ImagePoolGet(ImagePoolInfo* info) {  ///
+  assert(info != NULL);
+  pthread_mutex_lock(&poolLock);
+  info->bytes = poolBytes;
+  info->capacity = poolCapacity;
+  info->hits = poolHits;
+  info->misses = poolMisses;
+  pthread_mutex_unlock(&poolLock);
+}
+
 // Funções auxiliares criadas:
 //Calcular o tamanho de uma imagem
 static int GetSize(Image img){
@@ -152,69 +463,80 @@ int min(double a, double b) {
 }
 
 
+// Indices of the instrumentation counters (registered by ImageInit)
+static int pixmemCounter, compsCounter, somasCounter, divsCounter;
+
 /// Init Image library.  (Call once!)
-/// Currently, simply calibrate instrumentation and set names of counters.
+/// Currently, simply calibrate instrumentation and register the counters.
 void ImageInit(void) {  ///
+  INSTR_SCOPE("ImageInit");
   InstrCalibrate();
-  InstrName[0] = "pixmem";  // InstrCount[0] will count pixel array acesses
-  // Name other counters here...
-  InstrName[1] = "comparações"; 
-  InstrName[2] = "somas";
-  InstrName[3] = "divisões";  
-}
-
-// Macros to simplify accessing instrumentation counters:
-#define PIXMEM InstrCount[0]
-#define comps InstrCount[1]
-#define somas InstrCount[2]
-#define divs InstrCount[3]
+  pixmemCounter = InstrRegister("pixmem");  // counts pixel array acesses
+  // Register other counters here...
+  compsCounter = InstrRegister("comparações");
+  somasCounter = InstrRegister("somas");
+  divsCounter = InstrRegister("divisões");
+  // (Há NUMCOUNTERS contadores: só falha se outros módulos os esgotarem)
+  assert(pixmemCounter >= 0 && compsCounter >= 0 && somasCounter >= 0 &&
+         divsCounter >= 0);
+}
+
+// Macros to simplify counting with the instrumentation counters
+// (they compile to nothing with -DNO_INSTR, see INSTR_ADD):
+#define PIXMEM(n) INSTR_ADD(pixmemCounter, n)
+#define COMPS(n) INSTR_ADD(compsCounter, n)
+#define SOMAS(n) INSTR_ADD(somasCounter, n)
+#define DIVS(n) INSTR_ADD(divsCounter, n)
 // Add more macros here...
 
-// TIP: Search for PIXMEM or InstrCount to see where it is incremented!
+// TIP: Search for PIXMEM or INSTR_ADD to see where it is incremented!
 
 /// Image management functions
 
-/// Create a new black image.
-///   width, height : the dimensions of the new image.
-///   maxval: the maximum gray level (corresponding to white).
-/// Requires: width and height must be non-negative, maxval > 0.
-///
-/// On success, a new image is returned.
-/// (The caller is responsible for destroying the returned image!)
-/// On failure, returns NULL and errno/errCause are set accordingly.
-Image ImageCreate(int width, int height, uint8 maxval) {  ///
+// Create a new image, with pixels set to 0 if zero is nonzero, or left
+// undefined otherwise (for images whose pixels are all going to be set).
+// Requires, success and failure as in ImageCreate.
+static Image newImage(int width, int height, uint8 maxval, int zero) {
   assert(width >= 0);
   assert(height >= 0);
   assert(0 < maxval && maxval <= PixMax);
-  // Insert your code here!
 
-  // Alocar memória para o array pixel
-  uint8_t* pixel = malloc(width * height * sizeof(uint8_t));
-  if (pixel == NULL) {
-    errCause = "Falhou a alocação de memória para o pixel";
-    return NULL;
-  }
-
-  // Alocar memória para o struct Image
-  Image img = malloc(sizeof(struct image));
-
-  if (img == NULL) {
-    errCause = "Falhou a alocação de memória para a struct Image";
-    free(pixel);
-    // Dar free ao pixel porque não foi atribuido ao img
-    // no caso de erro
+  // Obter um bloco com o struct Image e o array pixel
+  Block* b = blockGet((size_t)width * height, zero, 1);
+  if (b == NULL) {
     return NULL;
   }
+  Image img = &b->img;
 
   // Definir as propriedades da imagem
   img->width = width;
   img->height = height;
   img->maxval = maxval;
-  img->pixel = pixel;
+  img->pixel = b->pixel;
+  img->map = NULL;
+  img->maplen = 0;
+  img->data = b;
+  img->shared = 0;
+  atomic_init(&b->refs, 2);  // a imagem e o utilizador dos pixels
+  atomic_init(&b->users, 1);
 
   return img;
 }
 
+/// Create a new black image.
+///   width, height : the dimensions of the new image.
+///   maxval: the maximum gray level (corresponding to white).
+/// Requires: width and height must be non-negative, maxval > 0.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageCreate(int width, int height, uint8 maxval) {  ///
+  INSTR_SCOPE("ImageCreate");
+  // Insert your code here!
+  return newImage(width, height, maxval, 1);  // a zeros (preto)
+}
+
 /// Destroy the image pointed to by (*imgp).
 ///   imgp : address of an Image variable.
 /// If (*imgp)==NULL, no operation is performed.
@@ -223,13 +545,81 @@ Image ImageCreate(int width, int height, uint8 maxval) {  ///
 void ImageDestroy(Image* imgp) {  ///
   assert(imgp != NULL);
   // Insert your code here!
-  // Libertar memória do array e da imagem
-  free((*imgp)->pixel);
-  free(*imgp);
+  if (*imgp == NULL) return;
+  // Deixar de usar os pixels e libertar o bloco da imagem: cada bloco
+  // (e o mapeamento, se houver) volta ao pool quando já ninguém o usa
+  Block* data = (*imgp)->data;
+  atomic_fetch_sub(&data->users, 1);
+  blockUnref(data);
+  blockUnref((Block*)*imgp);
   // Dar set ao valor do pointer como NULL
   *imgp = NULL;
 }
 
+/// Create a clone of image img, sharing its pixels.
+/// The pixels are copied only when either image is first modified
+/// (copy-on-write), so cloning costs the same for any image size.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageClone(Image img) {  ///
+  assert(img != NULL);
+  INSTR_SCOPE("ImageClone");
+  // Um bloco só com o struct Image, a apontar para os mesmos pixels
+  Block* b = blockGet(0, 0, 1);
+  if (b == NULL) return NULL;
+  Image clone = &b->img;
+  clone->width = img->width;
+  clone->height = img->height;
+  clone->maxval = img->maxval;
+  clone->pixel = img->pixel;
+  clone->map = NULL;
+  clone->maplen = 0;
+  clone->data = img->data;
+  clone->shared = 1;
+  img->shared = 1;
+  atomic_init(&b->refs, 1);
+  atomic_init(&b->users, 0);
+  atomic_fetch_add(&img->data->users, 1);
+  atomic_fetch_add(&img->data->refs, 1);
+  return clone;
+}
+
+/// Give img its own copy of its pixels, if they are shared with a clone.
+/// The operations that modify an image do this first, as needed.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set accordingly
+/// (and img still shares its pixels).
+int ImageUnshare(Image img) {  ///
+  assert(img != NULL);
+  Block* data = img->data;
+  if (atomic_load(&data->users) == 1) {  // os clones já desapareceram
+    img->shared = 0;
+    return 1;
+  }
+  size_t size = (size_t)img->width * img->height;
+  Block* b = blockGet(size, 0, 1);
+  if (b == NULL) return 0;
+  memcpy(b->pixel, img->pixel, size);
+  PIXMEM(2 * (unsigned long)size);  // uma leitura e uma escrita por pixel
+  // O novo bloco só tem os pixels (não tem imagem própria)
+  b->img.map = NULL;
+  atomic_init(&b->refs, 1);
+  atomic_init(&b->users, 1);
+  img->pixel = b->pixel;
+  img->data = b;
+  img->shared = 0;
+  atomic_fetch_sub(&data->users, 1);
+  blockUnref(data);
+  return 1;
+}
+
+// Make sure img has its own pixels, before modifying them.
+// Returns nonzero on success, 0 on failure (with errno/errCause set).
+static inline int writable(Image img) {
+  return !img->shared || ImageUnshare(img);
+}
+
 /// PGM file operations
 
 // See also:
@@ -247,37 +637,45 @@ static int skipComments(FILE* f) {
   return i;
 }
 
+// Parse a raw PGM header from file f, leaving f at the first pixel.
+// On success, returns nonzero and sets (*w, *h, *maxval).
+// On failure, returns 0 and errno/errCause are set accordingly.
+static int readHeader(FILE* f, int* w, int* h, int* maxval) {
+  char c;
+  return check(fscanf(f, "P%c ", &c) == 1 && c == '5', "Invalid file format") &&
+         skipComments(f) >= 0 &&
+         check(fscanf(f, "%d ", w) == 1 && *w >= 0, "Invalid width") &&
+         skipComments(f) >= 0 &&
+         check(fscanf(f, "%d ", h) == 1 && *h >= 0, "Invalid height") &&
+         skipComments(f) >= 0 &&
+         check(fscanf(f, "%d", maxval) == 1 && 0 < *maxval &&
+                   *maxval <= (int)PixMax,
+               "Invalid maxval") &&
+         check(fscanf(f, "%c", &c) == 1 && isspace(c), "Whitespace expected");
+}
+
 /// Load a raw PGM file.
 /// Only 8 bit PGM files are accepted.
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageLoad(const char* filename) {  ///
+  INSTR_SCOPE("ImageLoad");
   int w, h;
   int maxval;
-  char c;
   FILE* f = NULL;
   Image img = NULL;
 
   int success =
       check((f = fopen(filename, "rb")) != NULL, "Open failed") &&
       // Parse PGM header
-      check(fscanf(f, "P%c ", &c) == 1 && c == '5', "Invalid file format") &&
-      skipComments(f) >= 0 &&
-      check(fscanf(f, "%d ", &w) == 1 && w >= 0, "Invalid width") &&
-      skipComments(f) >= 0 &&
-      check(fscanf(f, "%d ", &h) == 1 && h >= 0, "Invalid height") &&
-      skipComments(f) >= 0 &&
-      check(
-          fscanf(f, "%d", &maxval) == 1 && 0 < maxval && maxval <= (int)PixMax,
-          "Invalid maxval") &&
-      check(fscanf(f, "%c", &c) == 1 && isspace(c), "Whitespace expected") &&
+      readHeader(f, &w, &h, &maxval) &&
       // Allocate image
-      (img = ImageCreate(w, h, (uint8)maxval)) != NULL &&
+      (img = newImage(w, h, (uint8)maxval, 0)) != NULL &&
       // Read pixels
       check(fread(img->pixel, sizeof(uint8), w * h, f) == w * h,
             "Reading pixels");
-  PIXMEM += (unsigned long)(w * h);  // count pixel memory accesses
+  PIXMEM((unsigned long)(w * h));  // count pixel memory accesses
 
   // Cleanup
   if (!success) {
@@ -289,29 +687,948 @@ Image ImageLoad(const char* filename) {  ///
   return img;
 }
 
+/// Load a raw PGM file by mapping it into memory.
+/// Only 8 bit PGM files are accepted.
+/// Pixels are not read now, but paged in from the file when first accessed,
+/// so loading is immediate and pixels that are never accessed cost no memory.
+/// The mapping is private: modifying the image does not modify the file.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageLoadMapped(const char* filename) {  ///
+  INSTR_SCOPE("ImageLoadMapped");
+  int w, h;
+  int maxval;
+  long offset;
+  struct stat st;
+  FILE* f = NULL;
+  void* map = MAP_FAILED;
+  Image img = NULL;
+
+  int success =
+      check((f = fopen(filename, "rb")) != NULL, "Open failed") &&
+      readHeader(f, &w, &h, &maxval) &&
+      check((offset = ftell(f)) >= 0, "Reading header") &&
+      check(fstat(fileno(f), &st) == 0, "Stat failed") &&
+      check(st.st_size - offset >= (off_t)w * h, "Reading pixels") &&
+      // Mapear o ficheiro todo (o cabeçalho tem tamanho variável)
+      check((map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                        fileno(f), 0)) != MAP_FAILED,
+            "Mapping file failed") &&
+      (img = (Image)blockGet(0, 0, 1)) != NULL;
+
+  if (success) {
+    img->width = w;
+    img->height = h;
+    img->maxval = maxval;
+    img->pixel = (uint8*)map + offset;
+    img->map = map;
+    img->maplen = st.st_size;
+    img->data = (Block*)img;
+    img->shared = 0;
+    atomic_init(&img->data->refs, 2);
+    atomic_init(&img->data->users, 1);
+  } else {
+    errsave = errno;
+    if (map != MAP_FAILED) munmap(map, st.st_size);
+    errno = errsave;
+  }
+  if (f != NULL) fclose(f);
+  return img;
+}
+
+// Atomic saves
+//
+// Files are saved atomically: they are written to a temporary file in the
+// same directory (so, in the same file system), which is renamed to the
+// destination only when complete.  So, readers of the destination find
+// either the old file or the new one, never a partial file.
+// The replaced file keeps its mode (and owner, when allowed); a symbolic
+// link keeps pointing to the new file; devices and FIFOs (e.g. /dev/null,
+// /dev/stdout) are written in place.
+// Unless disabled with ImageSetSync(0), the data is also flushed to the
+// disk (fsync) before renaming, and the directory after, so that the new
+// file survives a crash.
+
+static _Atomic int saveSync = 1;
+
+/// Set whether saving a file waits for its data to reach the disk.
+void ImageSetSync(int sync) {  ///
+  atomic_store(&saveSync, sync != 0);
+}
+
+// Where a save is written: a temporary file, to be renamed over dest, or,
+// for special files (devices, FIFOs), dest itself.
+typedef struct {
+  char* dest;  // destination, links resolved (allocated; NULL if in place)
+  char* tmp;   // temporary file name (allocated; NULL if in place)
+  size_t len;  // allocated size of tmp
+} SaveFile;
+
+// Open the file to save filename: a new temporary file in the directory of
+// the destination if it is a regular file or does not exist (keeping the
+// mode and owner of the existing file), or the destination itself if it is
+// a device, FIFO or dangling link.  Symbolic links are followed (the link
+// is kept, pointing to the new file).
+// On success, returns the file, open for writing, and fills (*sf).
+// On failure, returns NULL and errno/errCause are set accordingly.
+static FILE* openTemp(const char* filename, SaveFile* sf) {
+  static atomic_uint serial = 0;
+  struct stat st;
+  struct stat lst;
+  sf->dest = NULL;
+  sf->tmp = NULL;
+  int exists = stat(filename, &st) == 0;
+  if (!check(exists || errno == ENOENT, "Open failed")) return NULL;
+  int link = lstat(filename, &lst) == 0 && S_ISLNK(lst.st_mode);
+  FILE* f = NULL;
+  if (exists ? !S_ISREG(st.st_mode) : link) {
+    // Dispositivo, FIFO ou ligação sem destino: escrever no próprio ficheiro
+    check((f = fopen(filename, "wb")) != NULL, "Open failed");
+    return f;
+  }
+  // Seguir ligações simbólicas: substitui-se o ficheiro, não a ligação
+  char* real = link ? realpath(filename, NULL) : NULL;
+  if (link && !check(real != NULL, "Open failed")) return NULL;
+  if (real != NULL) filename = real;
+  size_t dlen = strlen(filename) + 1;
+  sf->len = dlen + 32;
+  if ((sf->dest = memAlloc(dlen, 0, 0, "Name allocation failed")) != NULL) {
+    memcpy(sf->dest, filename, dlen);
+    sf->tmp = memAlloc(sf->len, 0, 0, "Name allocation failed");
+  }
+  free(real);
+  if (sf->tmp == NULL) {
+    memFree(sf->dest, dlen);
+    return NULL;
+  }
+
+  int fd = -1;
+  // Nome único: pid e número de série (O_EXCL garante que é novo)
+  for (int tries = 0; fd < 0 && tries < 100; tries++) {
+    snprintf(sf->tmp, sf->len, "%s.%d.%u.tmp", sf->dest, (int)getpid(),
+             atomic_fetch_add(&serial, 1));
+    fd = open(sf->tmp, O_WRONLY | O_CREAT | O_EXCL, 0666);
+    if (fd < 0 && errno != EEXIST) break;
+  }
+  if (fd >= 0 && exists) {
+    // Manter as permissões e, se possível, o dono do ficheiro substituído
+    fchmod(fd, st.st_mode & 07777);
+    if ((st.st_uid != geteuid() || st.st_gid != getegid()) &&
+        fchown(fd, st.st_uid, st.st_gid) != 0) {
+      fchmod(fd, st.st_mode & 0777);  // sem setuid/setgid de outro dono
+    }
+  }
+  if (!check(fd >= 0 && (f = fdopen(fd, "wb")) != NULL, "Open failed")) {
+    errsave = errno;
+    if (fd >= 0) {
+      close(fd);
+      unlink(sf->tmp);
+    }
+    memFree(sf->tmp, sf->len);
+    memFree(sf->dest, strlen(sf->dest) + 1);
+    errno = errsave;
+    return NULL;
+  }
+  return f;
+}
+
+// Flush the directory of filename to the disk (best effort: some file
+// systems do not support it).
+static void syncDirectory(const char* filename) {
+  const char* slash = strrchr(filename, '/');
+  size_t len = slash == NULL ? 1 : (size_t)(slash - filename) + 1;
+  char dir[len + 1];
+  if (slash == NULL) {
+    strcpy(dir, ".");
+  } else {
+    memcpy(dir, filename, len);  // inclui a barra (para a raiz, "/")
+    dir[len] = '\0';
+  }
+  int fd = open(dir, O_RDONLY | O_DIRECTORY);
+  if (fd >= 0) {
+    fsync(fd);
+    close(fd);
+  }
+}
+
+// Finish writing the file f, opened by openTemp into (*sf).
+// For a temporary file: if success, rename it to the destination (after
+// flushing it to the disk, if enabled); otherwise, remove it.
+// Closes f and frees the names in (*sf).
+// Returns nonzero if the file was saved, 0 on failure (with errno/errCause
+// set, or kept from the previous failure).
+static int closeTemp(FILE* f, SaveFile* sf, int success) {
+  int sync = atomic_load(&saveSync) && sf->tmp != NULL;
+  success = success && check(fflush(f) == 0, "Writing failed") &&
+            check(!sync || fsync(fileno(f)) == 0, "Sync failed");
+  errsave = errno;
+  int closed = fclose(f) == 0;
+  if (success) {
+    success = check(closed, "Writing failed");
+  } else {
+    errno = errsave;  // manter a causa da falha anterior
+  }
+  if (sf->tmp != NULL) {
+    success =
+        success && check(rename(sf->tmp, sf->dest) == 0, "Rename failed");
+    if (success) {
+      if (sync) syncDirectory(sf->dest);
+    } else {
+      errsave = errno;
+      unlink(sf->tmp);
+      errno = errsave;
+    }
+    memFree(sf->tmp, sf->len);
+    memFree(sf->dest, strlen(sf->dest) + 1);
+  }
+  return success;
+}
+
+// Write all the data of the iovcnt buffers in iov to file descriptor fd,
+// with as few system calls as possible (one, usually).  Modifies iov.
+// Returns nonzero on success, 0 on failure (with errno set).
+static int writeAll(int fd, struct iovec* iov, int iovcnt) {
+  while (iovcnt > 0) {
+    ssize_t n = writev(fd, iov, iovcnt);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return 0;
+    }
+    // Escrita parcial: avançar nos buffers
+    while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char*)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  return 1;
+}
+
 /// Save image to PGM file.
+/// The file is saved atomically (see ImageSetSync).
 /// On success, returns nonzero.
 /// On failure, returns 0, errno/errCause are set appropriately, and
-/// a partial and invalid file may be left in the system.
+/// the file is left unchanged.
 int ImageSave(Image img, const char* filename) {  ///
+  INSTR_SCOPE("ImageSave");
   assert(img != NULL);
   int w = img->width;
   int h = img->height;
   uint8 maxval = img->maxval;
   FILE* f = NULL;
+  SaveFile sf;
+
+  // O cabeçalho e os pixels são escritos juntos, numa chamada (sem stdio)
+  char header[64];
+  int len = snprintf(header, sizeof(header), "P5\n%d %d\n%u\n", w, h, maxval);
+  struct iovec iov[2] = {
+    {header, (size_t)len},
+    {img->pixel, (size_t)w * h},
+  };
+  int success = (f = openTemp(filename, &sf)) != NULL &&
+                check(writeAll(fileno(f), iov, 2), "Writing pixels failed");
+  PIXMEM((unsigned long)w * h);  // count pixel memory accesses
 
-  int success = check((f = fopen(filename, "wb")) != NULL, "Open failed") &&
-                check(fprintf(f, "P5\n%d %d\n%u\n", w, h, maxval) > 0,
-                      "Writing header failed") &&
-                check(fwrite(img->pixel, sizeof(uint8), w * h, f) == w * h,
-                      "Writing pixels failed");
-  PIXMEM += (unsigned long)(w * h);  // count pixel memory accesses
+  // Cleanup
+  if (f != NULL) success = closeTemp(f, &sf, success);
+  return success;
+}
+
+/// PGM streams
+
+/// Read the next image (frame) from a stream of raw PGM images in file f.
+/// If (*imgp) is an image of the same size, its pixels are reused (the
+/// frame is read into them); otherwise, (*imgp) is destroyed (if not NULL)
+/// and replaced by a new image.
+/// Returns 1 if a frame was read into (*imgp), or 0 at the end of the
+/// stream ((*imgp) is left unchanged).
+/// On failure, returns -1, (*imgp) is destroyed, and errno/errCause are set
+/// accordingly.
+int ImageReadFrame(FILE* f, Image* imgp) {  ///
+  INSTR_SCOPE("ImageReadFrame");
+  assert(f != NULL);
+  assert(imgp != NULL);
+  int w, h;
+  int maxval;
+  Image img = *imgp;
+
+  // Fim da stream: só espaços até ao EOF
+  int c;
+  while ((c = getc(f)) != EOF && isspace(c)) {
+  }
+  if (c == EOF) {
+    if (!check(!ferror(f), "Reading frame failed")) {
+      ImageDestroy(imgp);
+      return -1;
+    }
+    return 0;
+  }
+  ungetc(c, f);
+
+  int success = readHeader(f, &w, &h, &maxval);
+  if (success && !(img != NULL && img->width == w && img->height == h &&
+                   writable(img))) {
+    ImageDestroy(&img);
+    success = (img = newImage(w, h, (uint8)maxval, 0)) != NULL;
+  }
+  success = success &&
+            check(fread(img->pixel, sizeof(uint8), (size_t)w * h, f) ==
+                      (size_t)w * h,
+                  "Reading pixels");
+
+  if (!success) {
+    errsave = errno;
+    ImageDestroy(&img);
+    errno = errsave;
+    *imgp = NULL;
+    return -1;
+  }
+  PIXMEM((unsigned long)w * h);  // count pixel memory accesses
+  img->maxval = (uint8)maxval;
+  *imgp = img;
+  return 1;
+}
+
+/// Write image img as the next frame of a stream of raw PGM images in f.
+/// The stream is not flushed.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImageWriteFrame(Image img, FILE* f) {  ///
+  INSTR_SCOPE("ImageWriteFrame");
+  assert(img != NULL);
+  assert(f != NULL);
+  size_t size = (size_t)img->width * img->height;
+  int success =
+      check(fprintf(f, "P5\n%d %d\n%u\n", img->width, img->height,
+                    img->maxval) > 0,
+            "Writing header failed") &&
+      check(fwrite(img->pixel, sizeof(uint8), size, f) == size,
+            "Writing pixels failed");
+  PIXMEM((unsigned long)size);  // count pixel memory accesses
+  return success;
+}
+
+/// Tiled image files
+
+// A tiled image file starts with a text header
+//   IMT1 <width> <height> <maxval> <tile width> <tile height>\n
+// followed by the tile index and the tiles.  Tiles cover the image in
+// raster order (those on the right and bottom edges may be smaller), and
+// the index has an entry of TILEENTRY bytes for each tile: its offset in
+// the file (8 bytes) and its length (4 bytes), little-endian.
+// A tile is stored as a raster scan of its pixels or, if that is shorter,
+// compressed with a run-length encoding: each control byte c is followed
+// by c+1 literal pixels (if c < 128), or by one pixel repeated c-125 times.
+// The entries of the index for a row of tiles are contiguous, so a region
+// is loaded with one read of the index and one read per tile, for each
+// row of tiles it intersects.
+
+#define TILEENTRY 12
+
+// Store the bytes least significant bytes of v at p, little-endian.
+static void putLE(uint8* p, uint64_t v, int bytes) {
+  for (int i = 0; i < bytes; i++) {
+    p[i] = (uint8)(v >> (8 * i));
+  }
+}
+
+// Get a little-endian number with the given bytes at p.
+static uint64_t getLE(const uint8* p, int bytes) {
+  uint64_t v = 0;
+  for (int i = bytes - 1; i >= 0; i--) {
+    v = (v << 8) | p[i];
+  }
+  return v;
+}
+
+// Compress n pixels from src into dst, which must have room for
+// n + n/128 + 1 bytes.  Returns the compressed length.
+static size_t rleEncode(const uint8* src, size_t n, uint8* dst) {
+  size_t i = 0, o = 0;
+  while (i < n) {
+    // Comprimento da sequência de pixels iguais a começar em i
+    size_t run = 1;
+    while (i + run < n && run < 130 && src[i + run] == src[i]) run++;
+    if (run >= 3) {
+      dst[o++] = (uint8)(run + 125);
+      dst[o++] = src[i];
+      i += run;
+    } else {
+      // Literais até à próxima sequência de 3 ou mais (no máximo 128)
+      size_t start = i;
+      while (i < n && i - start < 128 &&
+             !(i + 2 < n && src[i] == src[i + 1] && src[i] == src[i + 2])) {
+        i++;
+      }
+      dst[o++] = (uint8)(i - start - 1);
+      memcpy(dst + o, src + start, i - start);
+      o += i - start;
+    }
+  }
+  return o;
+}
+
+// Decompress len bytes from src into n pixels at dst.
+// Returns nonzero on success, 0 if the data is invalid.
+static int rleDecode(const uint8* src, size_t len, uint8* dst, size_t n) {
+  size_t i = 0, o = 0;
+  while (i < len) {
+    uint8 c = src[i++];
+    if (c < 128) {
+      size_t k = (size_t)c + 1;
+      if (i + k > len || o + k > n) return 0;
+      memcpy(dst + o, src + i, k);
+      i += k;
+      o += k;
+    } else {
+      size_t k = (size_t)c - 125;
+      if (i >= len || o + k > n) return 0;
+      memset(dst + o, src[i++], k);
+      o += k;
+    }
+  }
+  return o == n;
+}
+
+/// Save image to a tiled image file, with tiles of tile x tile pixels.
+/// If compress is nonzero, tiles are compressed, where that saves space.
+/// The file is saved atomically (see ImageSetSync).
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// the file is left unchanged.
+int ImageSaveTiled(Image img, const char* filename, int tile,
+                   int compress) {  ///
+  INSTR_SCOPE("ImageSaveTiled");
+  assert(img != NULL);
+  assert(tile > 0);
+  int w = img->width;
+  int h = img->height;
+  int cols = (w + tile - 1) / tile;
+  int rows = (h + tile - 1) / tile;
+  size_t indexlen = (size_t)cols * rows * TILEENTRY + 1;
+  // (Os tiles não excedem a imagem; 1 byte, pelo menos, se estiver vazia)
+  size_t tilemax = (size_t)max(min(tile, w), 1) * max(min(tile, h), 1);
+  size_t outmax = tilemax + tilemax / 128 + 1;
+  long start = 0;
+  FILE* f = NULL;
+  SaveFile sf;
+  uint8* index = NULL;
+  uint8* buf = NULL;
+  uint8* out = NULL;
+
+  int success =
+      (f = openTemp(filename, &sf)) != NULL &&
+      check(fprintf(f, "IMT1 %d %d %d %d %d\n", w, h, img->maxval, tile,
+                    tile) > 0,
+            "Writing header failed") &&
+      check((start = ftell(f)) >= 0, "Writing header failed") &&
+      (index = memAlloc(indexlen, 1, 0, "Index allocation failed")) != NULL &&
+      (buf = memAlloc(tilemax, 0, 0, "Tile allocation failed")) != NULL &&
+      (out = memAlloc(outmax, 0, 0, "Tile allocation failed")) != NULL &&
+      // Reservar o espaço do índice, que só é escrito no fim
+      check(fwrite(index, 1, indexlen - 1, f) == indexlen - 1,
+            "Writing index failed");
+
+  uint64_t offset = (uint64_t)start + indexlen - 1;
+  for (int r = 0; success && r < rows; r++) {
+    for (int c = 0; success && c < cols; c++) {
+      int tx = c * tile, ty = r * tile;
+      int tw = min(tile, w - tx), th = min(tile, h - ty);
+      size_t n = (size_t)tw * th;
+      for (int i = 0; i < th; i++) {
+        memcpy(buf + (size_t)i * tw, img->pixel + (size_t)(ty + i) * w + tx,
+               tw);
+      }
+      const uint8* data = buf;
+      size_t len = n;
+      if (compress) {
+        size_t clen = rleEncode(buf, n, out);
+        if (clen < n) {
+          data = out;
+          len = clen;
+        }
+      }
+      success = check(fwrite(data, 1, len, f) == len, "Writing pixels failed");
+      uint8* e = index + ((size_t)r * cols + c) * TILEENTRY;
+      putLE(e, offset, 8);
+      putLE(e + 8, len, 4);
+      offset += len;
+    }
+  }
+  success = success &&
+            check(fseek(f, start, SEEK_SET) == 0 &&
+                      fwrite(index, 1, indexlen - 1, f) == indexlen - 1,
+                  "Writing index failed");
+  PIXMEM((unsigned long)w * h);  // count pixel memory accesses
+
+  // Cleanup
+  memFree(out, outmax);
+  memFree(buf, tilemax);
+  memFree(index, indexlen);
+  if (f != NULL) success = closeTemp(f, &sf, success);
+  return success;
+}
+
+// Parse the header of a tiled image file f, leaving f at the index.
+// On success, returns nonzero and sets (*w, *h, *maxval, *tw, *th).
+// On failure, returns 0 and errno/errCause are set accordingly.
+static int readTiledHeader(FILE* f, int* w, int* h, int* maxval, int* tw,
+                           int* th) {
+  return check(fscanf(f, "IMT1 %d %d %d %d %d", w, h, maxval, tw, th) == 5 &&
+                   fgetc(f) == '\n',
+               "Invalid file format") &&
+         check(*w >= 0 && *h >= 0, "Invalid size") &&
+         check(0 < *maxval && *maxval <= (int)PixMax, "Invalid maxval") &&
+         check(*tw > 0 && *th > 0, "Invalid tile size");
+}
+
+// Load region (x, y, w, h) of a tiled image file, or the whole image, if
+// whole is nonzero.  As ImageLoadRegion.
+static Image loadTiled(const char* filename, int whole, int x, int y, int w,
+                       int h) {
+  int W = 0, H = 0;
+  int maxval, tw = 1, th = 1;
+  long start = 0;
+  FILE* f = NULL;
+  Image img = NULL;
+  uint8* index = NULL;
+  uint8* buf = NULL;
+  uint8* tilebuf = NULL;
+  size_t indexlen = 0, tilemax = 0;
+
+  int success =
+      check((f = fopen(filename, "rb")) != NULL, "Open failed") &&
+      readTiledHeader(f, &W, &H, &maxval, &tw, &th) &&
+      check((start = ftell(f)) >= 0, "Reading header");
+  if (success && whole) {
+    x = y = 0;
+    w = W;
+    h = H;
+  }
+  success = success &&
+            check(x >= 0 && y >= 0 && w >= 0 && h >= 0 &&
+                      (long)x + w <= W && (long)y + h <= H,
+                  "Invalid region") &&
+            (img = newImage(w, h, (uint8)maxval, 0)) != NULL;
+
+  // Tiles que intersetam a região: colunas c0..c1, linhas r0..r1
+  int cols = (W + tw - 1) / tw;
+  int c0 = x / tw, c1 = (x + w - 1) / tw;
+  int r0 = y / th, r1 = (y + h - 1) / th;
+  if (success && w > 0 && h > 0) {
+    indexlen = (size_t)(c1 - c0 + 1) * TILEENTRY;
+    tilemax = (size_t)min(tw, W) * min(th, H);  // tiles dentro da imagem
+    success =
+        (index = memAlloc(indexlen, 0, 0, "Index allocation failed")) != NULL &&
+        (buf = memAlloc(tilemax, 0, 0, "Tile allocation failed")) != NULL &&
+        (tilebuf = memAlloc(tilemax, 0, 0, "Tile allocation failed")) != NULL;
+  } else {
+    r1 = r0 - 1;  // nothing to read
+  }
+  int fd = f != NULL ? fileno(f) : -1;
+  for (int r = r0; success && r <= r1; r++) {
+    off_t pos = start + ((off_t)r * cols + c0) * TILEENTRY;
+    success = check(pread(fd, index, indexlen, pos) == (ssize_t)indexlen,
+                    "Reading index");
+    for (int c = c0; success && c <= c1; c++) {
+      const uint8* e = index + (size_t)(c - c0) * TILEENTRY;
+      off_t offset = (off_t)getLE(e, 8);
+      size_t len = (size_t)getLE(e + 8, 4);
+      int tx = c * tw, ty = r * th;
+      int cw = min(tw, W - tx), ch = min(th, H - ty);
+      size_t n = (size_t)cw * ch;
+      // Tiles não comprimidos são lidos diretamente para tilebuf
+      success = check(len <= n, "Invalid tile") &&
+                check(pread(fd, len == n ? tilebuf : buf, len, offset) ==
+                          (ssize_t)len,
+                      "Reading pixels") &&
+                check(len == n || rleDecode(buf, len, tilebuf, n),
+                      "Invalid tile");
+      // Copiar a parte do tile que está dentro da região
+      int ax = max(x, tx), bx = min(x + w, tx + cw);
+      int ay = max(y, ty), by = min(y + h, ty + ch);
+      for (int i = ay; success && i < by; i++) {
+        memcpy(img->pixel + (size_t)(i - y) * w + (ax - x),
+               tilebuf + (size_t)(i - ty) * cw + (ax - tx), bx - ax);
+      }
+    }
+  }
+  PIXMEM((unsigned long)w * h);  // count pixel memory accesses
 
   // Cleanup
+  memFree(tilebuf, tilemax);
+  memFree(buf, tilemax);
+  memFree(index, indexlen);
+  if (!success) {
+    errsave = errno;
+    ImageDestroy(&img);
+    errno = errsave;
+  }
   if (f != NULL) fclose(f);
+  return img;
+}
+
+/// Load a tiled image file.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageLoadTiled(const char* filename) {  ///
+  INSTR_SCOPE("ImageLoadTiled");
+  return loadTiled(filename, 1, 0, 0, 0, 0);
+}
+
+/// Load rectangle (x, y, w, h) of the image in a tiled image file.
+/// Only the tiles that intersect the rectangle are read, so this costs
+/// in proportion to the rectangle, not to the whole image.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure (including a rectangle not inside the image), returns NULL
+/// and errno/errCause are set accordingly.
+Image ImageLoadRegion(const char* filename, int x, int y, int w,
+                      int h) {  ///
+  INSTR_SCOPE("ImageLoadRegion");
+  return loadTiled(filename, 0, x, y, w, h);
+}
+
+/// Compressed image files
+
+// A compressed image file starts with a text header
+//   IMZ1 <width> <height> <maxval>\n
+// followed by a bit stream with the pixels, in raster order.
+// Each pixel is predicted from its neighbours a (left), b (up) and c
+// (up-left) with the median edge detector of LOCO-I (JPEG-LS), and the
+// prediction error, modulo 256, is folded to u in 0..255 (errors 0, -1, 1,
+// -2, ... give u = 0, 1, 2, 3, ...).  Outside the image, b and c repeat a
+// on the first row (and a is 0 for the first pixel), and a and c repeat b
+// on the first column.
+// Each row is split in blocks of ZBLOCK pixels.  A block starts with a
+// Rice parameter k (3 bits), chosen by the encoder to minimize the size of
+// the block, followed by the code of each u: the quotient u >> k in unary
+// (ones, ended by a zero), then the k low bits of u.  Quotients of ZQMAX or
+// more are coded as ZQMAX ones followed by u in 8 bits.
+// Bits are packed from the most significant bit of each byte.
+// (With a fixed k per block, and no adaptive state, decoding a pixel only
+// depends on the previous one through the prediction, so it is fast.)
+
+#define ZQMAX 16
+#define ZBLOCK 32
+#define ZBUFSIZE 65536
+
+// Median edge detector prediction of a pixel with neighbours a, b, c:
+// a + b - c, clamped to [min(a,b), max(a,b)].
+// (Written with selections, not branches, which would be unpredictable.)
+static inline int zPredict(int a, int b, int c) {
+  int lo = a < b ? a : b, hi = a < b ? b : a;
+  int p = a + b - c;
+  p = p < lo ? lo : p;
+  p = p > hi ? hi : p;
+  return p;
+}
+
+// Number of bits of the code of u with parameter k.
+static inline int zCodeBits(unsigned u, int k) {
+  unsigned q = u >> k;
+  return q < ZQMAX ? (int)q + 1 + k : ZQMAX + 8;
+}
+
+// Rice parameter (0..7) that codes the n values u[] with fewest bits.
+// The best k is near log2 of the mean of u: only k0-1..k0+1 are tried,
+// where k0 is the least k with n*2^k >= sum of u.
+static int zBestParam(const uint8* u, int n) {
+  int sum = 0;
+  for (int i = 0; i < n; i++) sum += u[i];
+  int k0 = 0;
+  while ((n << k0) < sum && k0 < 7) k0++;
+  int best = 0, bestBits = INT_MAX;
+  for (int k = max(k0 - 1, 0); k <= min(k0 + 1, 7); k++) {
+    int bits = 0;
+    for (int i = 0; i < n; i++) bits += zCodeBits(u[i], k);
+    if (bits < bestBits) {
+      best = k;
+      bestBits = bits;
+    }
+  }
+  return best;
+}
+
+// Bit writer, to a file, through a buffer
+typedef struct {
+  FILE* f;
+  uint8* buf;
+  size_t len;     // bytes in buf
+  uint64_t acc;   // pending bits (the low bits)
+  int bits;       // number of pending bits (< 8 between calls)
+  int ok;         // no write failed?
+} ZWriter;
+
+// Write the n low bits of v (n <= 24).
+// This takes no branches (except to empty the buffer): the pending bits
+// are always stored as 8 bytes at the end of the buffer, and the whole
+// bytes are kept.  (The last, partial, byte is stored again next time.)
+static inline void zPut(ZWriter* w, uint32_t v, int n) {
+  w->acc = (w->acc << n) | v;
+  w->bits += n;
+  uint64_t word = w->acc << (64 - w->bits);
+  uint8* p = w->buf + w->len;
+  p[0] = (uint8)(word >> 56);
+  p[1] = (uint8)(word >> 48);
+  p[2] = (uint8)(word >> 40);
+  p[3] = (uint8)(word >> 32);
+  p[4] = (uint8)(word >> 24);
+  p[5] = (uint8)(word >> 16);
+  p[6] = (uint8)(word >> 8);
+  p[7] = (uint8)word;
+  w->len += w->bits >> 3;
+  w->bits &= 7;
+  if (w->len > ZBUFSIZE - 16) {
+    w->ok = w->ok && fwrite(w->buf, 1, w->len, w->f) == w->len;
+    w->buf[0] = w->buf[w->len];  // o byte parcial
+    w->len = 0;
+  }
+}
+
+// Write the code of u with parameter k.
+static inline void zPutCode(ZWriter* w, unsigned u, int k) {
+  unsigned q = u >> k;
+  if (q < ZQMAX) {
+    // q uns, um zero, e os k bits de ordem inferior
+    zPut(w, ((((1u << q) - 1) << 1) << k) | (u & ((1u << k) - 1)), q + 1 + k);
+  } else {
+    zPut(w, (1u << ZQMAX) - 1, ZQMAX);
+    zPut(w, u, 8);
+  }
+}
+
+// Write the pending bits (padded with zeros) and the buffer.
+static int zFlush(ZWriter* w) {
+  if (w->bits > 0) w->len++;  // o byte parcial, já com zeros no fim
+  w->bits = 0;
+  w->ok = w->ok && fwrite(w->buf, 1, w->len, w->f) == w->len;
+  w->len = 0;
+  return w->ok;
+}
+
+/// Save image to a compressed image file (lossless).
+/// The file is saved atomically (see ImageSetSync).
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// the file is left unchanged.
+int ImageSaveCompressed(Image img, const char* filename) {  ///
+  INSTR_SCOPE("ImageSaveCompressed");
+  assert(img != NULL);
+  int w = img->width;
+  int h = img->height;
+  ZWriter zw = {NULL, NULL, 0, 0, 0, 1};
+  SaveFile sf;
+
+  int success =
+      (zw.f = openTemp(filename, &sf)) != NULL &&
+      check(fprintf(zw.f, "IMZ1 %d %d %d\n", w, h, img->maxval) > 0,
+            "Writing header failed") &&
+      (zw.buf = memAlloc(ZBUFSIZE, 0, 0, "Buffer allocation failed")) != NULL;
+
+  for (int y = 0; success && y < h; y++) {
+    const uint8* row = img->pixel + (size_t)y * w;
+    const uint8* prev = y > 0 ? row - w : NULL;
+    int a = prev != NULL && w > 0 ? prev[0] : 0;
+    int c = a;
+    for (int x0 = 0; x0 < w; x0 += ZBLOCK) {
+      int n = min(ZBLOCK, w - x0);
+      uint8 u[ZBLOCK];
+      for (int i = 0; i < n; i++) {
+        int b = prev != NULL ? prev[x0 + i] : a;
+        if (prev == NULL) c = a;
+        int8_t e = (int8_t)(uint8)(row[x0 + i] - zPredict(a, b, c));
+        u[i] = (uint8)((unsigned)e << 1) ^ (e >> 7);  // 0, -1, 1, -2, ...
+        a = row[x0 + i];
+        c = b;
+      }
+      int k = zBestParam(u, n);
+      zPut(&zw, k, 3);
+      for (int i = 0; i < n; i++) zPutCode(&zw, u[i], k);
+    }
+    success = check(zw.ok, "Writing pixels failed");
+  }
+  success = success && check(zFlush(&zw), "Writing pixels failed");
+  PIXMEM((unsigned long)w * h);  // count pixel memory accesses
+
+  // Cleanup
+  memFree(zw.buf, ZBUFSIZE);
+  if (zw.f != NULL) success = closeTemp(zw.f, &sf, success);
   return success;
 }
 
+// Bit reader, from a buffer with 8 bytes of zeros after the data
+typedef struct {
+  const uint8* p;     // next byte to read
+  const uint8* end;   // end of the buffer (including the 8 bytes)
+  uint64_t acc;       // bits to read, from the most significant
+  int bits;           // number of bits in acc
+} ZReader;
+
+// Big-endian 64-bit number at p.
+static inline uint64_t zLoad64(const uint8* p) {
+  return (uint64_t)p[0] << 56 | (uint64_t)p[1] << 48 | (uint64_t)p[2] << 40 |
+         (uint64_t)p[3] << 32 | (uint64_t)p[4] << 24 | (uint64_t)p[5] << 16 |
+         (uint64_t)p[6] << 8 | (uint64_t)p[7];
+}
+
+// Make sure there are at least 56 bits in r (or the buffer is over).
+// Away from the end, this takes no branches (which would be unpredictable,
+// as codes have variable lengths): the bytes from p are added after the
+// bits in acc, and p advances over the whole bytes that fit.  (Bits
+// already in acc are added again, unchanged.)
+static inline void zRefill(ZReader* r) {
+  if (r->p + 8 <= r->end) {
+    r->acc |= zLoad64(r->p) >> r->bits;
+    r->p += (63 - r->bits) >> 3;
+    r->bits |= 56;
+  } else {
+    while (r->bits <= 56 && r->p < r->end) {
+      r->acc |= (uint64_t)*r->p++ << (56 - r->bits);
+      r->bits += 8;
+    }
+  }
+}
+
+// Read the code of a value with parameter k (at most 24 bits).
+static inline unsigned zGetCode(ZReader* r, int k) {
+  // Número de uns no início (o código unário do quociente)
+  int q = __builtin_clzll(~r->acc | 1);
+  unsigned u;
+  if (q < ZQMAX) {
+    // Os k bits a seguir ao zero (nenhum, se k == 0)
+    u = ((unsigned)q << k) | (unsigned)((r->acc << q << 1) >> 1 >> (63 - k));
+    r->acc <<= q + 1 + k;
+    r->bits -= q + 1 + k;
+  } else {
+    u = (unsigned)(r->acc >> (64 - ZQMAX - 8)) & 0xFF;
+    r->acc <<= ZQMAX + 8;
+    r->bits -= ZQMAX + 8;
+  }
+  return u;
+}
+
+// Reconstruct pixel x of row, in place, from its folded prediction error,
+// given the previous row (NULL for the first row).  (*a) and (*c) are the
+// left and up-left neighbours of x, and become those of x + 1.
+static inline void zPixel(uint8* row, const uint8* prev, int x, int* a,
+                          int* c) {
+  int b = prev != NULL ? prev[x] : *a;
+  if (prev == NULL) *c = *a;
+  unsigned u = row[x];
+  int e = (int)(u >> 1) ^ -(int)(u & 1);
+  *a = (uint8)(zPredict(*a, b, *c) + e);
+  row[x] = (uint8)*a;
+  *c = b;
+}
+
+// Decode the codes of the n values of a row from r into u, and, at the
+// same time, reconstruct in place the previous row, last (if not NULL),
+// from its folded prediction errors, given the row before it, prev (NULL
+// for the first row).
+// (Reading the bits and predicting the pixels are two long chains of
+// dependent operations; interleaved, the processor overlaps them.)
+static void zDecodeRow(ZReader* r, uint8* u, uint8* last, const uint8* prev,
+                       int n) {
+  ZReader rd = *r;  // cópia local: as escritas em u poderiam alterar (*r)
+  int a = prev != NULL && n > 0 ? prev[0] : 0;
+  int c = a;
+  for (int x0 = 0; x0 < n; x0 += ZBLOCK) {
+    int end = min(x0 + ZBLOCK, n);
+    zRefill(&rd);
+    int k = (int)(rd.acc >> 61);
+    rd.acc <<= 3;
+    rd.bits -= 3;
+    int x = x0;
+    for (; x + 1 < end; x += 2) {
+      // Dois códigos (até 24 bits cada) por recarga (pelo menos 56 bits)
+      zRefill(&rd);
+      u[x] = (uint8)zGetCode(&rd, k);
+      u[x + 1] = (uint8)zGetCode(&rd, k);
+      if (last != NULL) {
+        zPixel(last, prev, x, &a, &c);
+        zPixel(last, prev, x + 1, &a, &c);
+      }
+    }
+    if (x < end) {
+      zRefill(&rd);
+      u[x] = (uint8)zGetCode(&rd, k);
+      if (last != NULL) zPixel(last, prev, x, &a, &c);
+    }
+  }
+  *r = rd;
+}
+
+/// Load a compressed image file.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageLoadCompressed(const char* filename) {  ///
+  INSTR_SCOPE("ImageLoadCompressed");
+  int w, h;
+  int maxval;
+  long offset;
+  struct stat st;
+  size_t len = 0;
+  FILE* f = NULL;
+  uint8* data = NULL;
+  Image img = NULL;
+
+  int success =
+      check((f = fopen(filename, "rb")) != NULL, "Open failed") &&
+      check(fscanf(f, "IMZ1 %d %d %d", &w, &h, &maxval) == 3 &&
+                fgetc(f) == '\n',
+            "Invalid file format") &&
+      check(w >= 0 && h >= 0, "Invalid size") &&
+      check(0 < maxval && maxval <= (int)PixMax, "Invalid maxval") &&
+      check((offset = ftell(f)) >= 0, "Reading header") &&
+      check(fstat(fileno(f), &st) == 0, "Stat failed") &&
+      check(st.st_size >= offset, "Reading pixels") &&
+      // Ler os dados todos de uma vez, com 8 bytes de folga a zeros
+      (data = memAlloc((len = st.st_size - offset) + 8, 1, 0,
+                       "Buffer allocation failed")) != NULL &&
+      check(fread(data, 1, len, f) == len, "Reading pixels") &&
+      (img = newImage(w, h, (uint8)maxval, 0)) != NULL;
+
+  if (success) {
+    ZReader r = {data, data + len + 8, 0, 0};
+    // Os códigos de cada linha são descodificados enquanto se reconstrói
+    // a linha anterior (a última é reconstruída no fim)
+    for (int y = 0; y < h; y++) {
+      uint8* row = img->pixel + (size_t)y * w;
+      zDecodeRow(&r, row, y > 0 ? row - w : NULL, y > 1 ? row - 2 * w : NULL,
+                 w);
+    }
+    if (h > 0) {
+      uint8* row = img->pixel + (size_t)(h - 1) * w;
+      const uint8* prev = h > 1 ? row - w : NULL;
+      int a = prev != NULL && w > 0 ? prev[0] : 0;
+      int c = a;
+      for (int x = 0; x < w; x++) zPixel(row, prev, x, &a, &c);
+    }
+    // Os códigos não podem ter usado a folga
+    success = check(r.bits >= 0 && (r.p - data) * 8 - r.bits <= (long)len * 8,
+                    "Invalid compressed data");
+  }
+  PIXMEM((unsigned long)w * h);  // count pixel memory accesses
+
+  // Cleanup
+  memFree(data, len + 8);
+  if (!success) {
+    errsave = errno;
+    ImageDestroy(&img);
+    errno = errsave;
+  }
+  if (f != NULL) fclose(f);
+  return img;
+}
+
 /// Information queries
 
 /// These functions do not modify the image and never fail.
@@ -340,6 +1657,7 @@ int ImageMaxval(Image img) {  ///
 /// *min is set to the minimum gray level in the image,
 /// *max is set to the maximum.
 void ImageStats(Image img, uint8* min, uint8* max) {  ///
+  INSTR_SCOPE("ImageStats");
   assert(img != NULL);
   // Insert your code here!
   // Iterar pela imagem e mudar o valor do minimo e 
@@ -364,9 +1682,9 @@ int ImageValidPos(Image img, int x, int y) {  ///
 int ImageValidRect(Image img, int x, int y, int w, int h) {  ///
   assert(img != NULL);
   // Insert your code here!
-  //Verificar se os cantos do retângulo pertencem à imagem
-  return ImageValidPos(img, x, y) && ImageValidPos(img, x + w, y + h);
-  
+  //Verificar se o retângulo (que pode tocar nas bordas) cabe na imagem
+  return 0 <= x && 0 <= y && 0 <= w && 0 <= h &&
+         x + w <= img->width && y + h <= img->height;
 }
 
 /// Pixel get & set operations
@@ -396,7 +1714,7 @@ static inline int G(Image img, int x, int y) {
 uint8 ImageGetPixel(Image img, int x, int y) {  ///
   assert(img != NULL);
   assert(ImageValidPos(img, x, y));
-  PIXMEM += 1;  // count one pixel access (read)
+  PIXMEM(1);  // count one pixel access (read)
   return img->pixel[G(img, x, y)];
 }
 
@@ -404,22 +1722,87 @@ uint8 ImageGetPixel(Image img, int x, int y) {  ///
 void ImageSetPixel(Image img, int x, int y, uint8 level) {  ///
   assert(img != NULL);
   assert(ImageValidPos(img, x, y));
-  PIXMEM += 1;  // count one pixel access (store)
+  if (!writable(img)) return;
+  PIXMEM(1);  // count one pixel access (store)
   img->pixel[G(img, x, y)] = level;
 }
 
+/// Bulk pixel access
+
+// Pointer to pixel (x, y), without the per-pixel checks of G.
+static inline uint8* PixelPtr(Image img, int x, int y) {
+  return img->pixel + (size_t)y * img->width + x;
+}
+
+/// Copy row y of img into buf.
+void ImageGetRow(Image img, int y, uint8* buf) {  ///
+  assert(img != NULL);
+  assert(buf != NULL);
+  assert(0 <= y && y < img->height);
+  PIXMEM((unsigned long)img->width);
+  memcpy(buf, PixelPtr(img, 0, y), img->width);
+}
+
+/// Set row y of img from buf.
+void ImageSetRow(Image img, int y, const uint8* buf) {  ///
+  assert(img != NULL);
+  assert(buf != NULL);
+  assert(0 <= y && y < img->height);
+  if (!writable(img)) return;
+  PIXMEM((unsigned long)img->width);
+  memcpy(PixelPtr(img, 0, y), buf, img->width);
+}
+
+/// Copy rectangle (x, y, w, h) of img into buf.
+void ImageReadRect(Image img, int x, int y, int w, int h,
+                   uint8* buf, int stride) {  ///
+  assert(img != NULL);
+  assert(buf != NULL || w * h == 0);
+  assert(ImageValidRect(img, x, y, w, h));
+  assert(stride >= w);
+  PIXMEM((unsigned long)w * h);
+  for (int i = 0; i < h; i++) {
+    memcpy(buf + (size_t)i * stride, PixelPtr(img, x, y + i), w);
+  }
+}
+
+/// Copy buf into rectangle (x, y, w, h) of img.
+void ImageWriteRect(Image img, int x, int y, int w, int h,
+                    const uint8* buf, int stride) {  ///
+  assert(img != NULL);
+  assert(buf != NULL || w * h == 0);
+  assert(ImageValidRect(img, x, y, w, h));
+  assert(stride >= w);
+  if (!writable(img)) return;
+  PIXMEM((unsigned long)w * h);
+  for (int i = 0; i < h; i++) {
+    memcpy(PixelPtr(img, x, y + i), buf + (size_t)i * stride, w);
+  }
+}
+
+/// Read-only pointer to the pixels of row y.
+const uint8* ImageRowPtr(Image img, int y) {  ///
+  assert(img != NULL);
+  assert(0 <= y && y < img->height);
+  return PixelPtr(img, 0, y);
+}
+
 /// Pixel transformations
 
 /// These functions modify the pixel levels in an image, but do not change
 /// pixel positions or image geometry in any way.
-/// All of these functions modify the image in-place: no allocation involved.
-/// They never fail.
+/// All of these functions modify the image in-place: no allocation involved,
+/// except to unshare pixels shared with a clone (see ImageClone).
+/// They never fail, except if unsharing fails (then the image is left
+/// unchanged; call ImageUnshare first to detect that).
 
 /// Transform image to negative image.
 /// This transforms dark pixels to light pixels and vice-versa,
 /// resulting in a "photographic negative" effect.
 void ImageNegative(Image img) {  ///
+  INSTR_SCOPE("ImageNegative");
   assert(img != NULL);
+  if (!writable(img)) return;
   // Insert your code here!
   int size = GetSize(img);
   //Para cada pixel, fazemos com que o seu valor
@@ -428,13 +1811,16 @@ void ImageNegative(Image img) {  ///
   for (int i = 0; i < size; i++) {
     img->pixel[i] = img->maxval - img->pixel[i];
   }
+  PIXMEM(2 * (unsigned long)size);  // uma leitura e uma escrita por pixel
 }
 
 /// Apply threshold to image.
 /// Transform all pixels with level<thr to black (0) and
 /// all pixels with level>=thr to white (maxval).
 void ImageThreshold(Image img, uint8 thr) {  ///
+  INSTR_SCOPE("ImageThreshold");
   assert(img != NULL);
+  if (!writable(img)) return;
   // Insert your code here!
   int size = GetSize(img);
   for (int i = 0; i < size; i++) {
@@ -444,6 +1830,17 @@ void ImageThreshold(Image img, uint8 thr) {  ///
       img->pixel[i] = img->maxval;
     }
   }
+  PIXMEM(2 * (unsigned long)size);
+}
+
+// Nível de um pixel com nível v multiplicado por factor, saturado em maxval.
+// Usada por ImageBrighten e ImageLevelsBrighten, para garantir que ambas
+// produzem exatamente os mesmos níveis.
+static inline uint8 Brighten(uint8 v, double factor, int maxval) {
+  // Adicionamos +0.5 para contornar erros de arredondamento
+  double level = v * factor + 0.5;
+  // Caso o valor do pixel supere o maxval, igualamo-lo ao mesmo
+  return level > maxval ? maxval : (uint8)level;
 }
 
 /// Brighten image by a factor.
@@ -451,20 +1848,232 @@ void ImageThreshold(Image img, uint8 thr) {  ///
 /// This will brighten the image if factor>1.0 and
 /// darken the image if factor<1.0.
 void ImageBrighten(Image img, double factor) {  ///
+  INSTR_SCOPE("ImageBrighten");
   assert(img != NULL);
   assert(factor >= 0.0);
+  if (!writable(img)) return;
   // Insert your code here!
   int size = GetSize(img);
   for (int i = 0; i < size; i++) {
-    img->pixel[i] = img->pixel[i] * factor + 0.5;
-    // Adicionamos +0.5 para contornar erros 
-    // de arredondamento
-    // Caso o valor do pixel supere o maxval,
-    // igualamo-lo ao mesmo
-    if (img->pixel[i] > img->maxval) {
-      img->pixel[i] = img->maxval;
+    img->pixel[i] = Brighten(img->pixel[i], factor, img->maxval);
+  }
+  PIXMEM(2 * (unsigned long)size);
+}
+
+/// Level maps
+
+// Cada função ImageLevels* aplica a transformação a cada entrada do mapa
+// (map[v] = f(map[v])), ou seja, compõe f depois das transformações que já
+// estavam no mapa.
+
+/// Set map to the identity mapping (map[v] == v).
+void ImageLevelsIdentity(uint8 map[]) {  ///
+  assert(map != NULL);
+  for (int v = 0; v < NUMLEVELS; v++) {
+    map[v] = v;
+  }
+}
+
+/// Compose the negative transformation (see ImageNegative) after map.
+void ImageLevelsNegative(uint8 map[], int maxval) {  ///
+  assert(map != NULL);
+  assert(0 < maxval && maxval <= PixMax);
+  for (int v = 0; v < NUMLEVELS; v++) {
+    map[v] = maxval - map[v];
+  }
+}
+
+/// Compose the threshold transformation (see ImageThreshold) after map.
+void ImageLevelsThreshold(uint8 map[], int maxval, uint8 thr) {  ///
+  assert(map != NULL);
+  assert(0 < maxval && maxval <= PixMax);
+  for (int v = 0; v < NUMLEVELS; v++) {
+    map[v] = map[v] < thr ? 0 : maxval;
+  }
+}
+
+/// Compose the brighten transformation (see ImageBrighten) after map.
+/// Requires: factor >= 0.0.
+void ImageLevelsBrighten(uint8 map[], int maxval, double factor) {  ///
+  assert(map != NULL);
+  assert(0 < maxval && maxval <= PixMax);
+  assert(factor >= 0.0);
+  for (int v = 0; v < NUMLEVELS; v++) {
+    map[v] = Brighten(map[v], factor, maxval);
+  }
+}
+
+/// Apply level map to image.
+/// Each pixel level v is replaced by map[v], in-place.
+void ImageMapLevels(Image img, const uint8 map[]) {  ///
+  INSTR_SCOPE("ImageMapLevels");
+  assert(img != NULL);
+  assert(map != NULL);
+  if (!writable(img)) return;
+  int size = GetSize(img);
+  for (int i = 0; i < size; i++) {
+    img->pixel[i] = map[img->pixel[i]];
+  }
+  PIXMEM(2 * (unsigned long)size);
+}
+
+/// Histograms
+
+/// Compute the histogram of img: hist[v] is set to the number of pixels
+/// with level v (for all v < NUMLEVELS).
+void ImageHistogram(Image img, unsigned long hist[]) {  ///
+  INSTR_SCOPE("ImageHistogram");
+  assert(img != NULL);
+  assert(hist != NULL);
+  // 4 histogramas parciais: pixels seguidos com o mesmo nível não
+  // incrementam o mesmo contador, que teria de esperar pelo anterior
+  uint32_t part[4][NUMLEVELS] = {{0}};
+  const uint8* p = img->pixel;
+  int size = GetSize(img);
+  int i = 0;
+  for (; i + 4 <= size; i += 4) {
+    part[0][p[i]]++;
+    part[1][p[i + 1]]++;
+    part[2][p[i + 2]]++;
+    part[3][p[i + 3]]++;
+  }
+  for (; i < size; i++) part[0][p[i]]++;
+  for (int v = 0; v < NUMLEVELS; v++) {
+    hist[v] = (unsigned long)part[0][v] + part[1][v] + part[2][v] + part[3][v];
+  }
+  PIXMEM((unsigned long)size);
+}
+
+/// Compose histogram equalization after map: each level v goes to maxval
+/// times the fraction of the pixels with levels above the lowest one and
+/// up to v, so that the levels are spread evenly over [0, maxval].
+/// If all pixels have the same level, nothing changes.
+void ImageLevelsEqualize(uint8 map[], int maxval,
+                         const unsigned long hist[]) {  ///
+  assert(map != NULL);
+  assert(0 < maxval && maxval <= PixMax);
+  assert(hist != NULL);
+  uint64_t total = 0, low = 0;
+  for (int v = 0; v < NUMLEVELS; v++) {
+    if (low == 0) low = hist[v];  // pixels do nível mais baixo
+    total += hist[v];
+  }
+  if (total == low) return;  // um só nível (ou nenhum)
+  uint8 f[NUMLEVELS];
+  uint64_t cdf = 0, range = total - low;
+  for (int v = 0; v < NUMLEVELS; v++) {
+    cdf += hist[v];
+    f[v] = cdf <= low ? 0 : (uint8)(((cdf - low) * maxval + range / 2) / range);
+  }
+  for (int v = 0; v < NUMLEVELS; v++) {
+    map[v] = f[map[v]];
+  }
+}
+
+/// Compose a contrast stretch after map: the levels in [lo, hi] are
+/// stretched linearly to [0, maxval], where lo and hi are the lowest and
+/// highest levels once pct% of the pixels are discarded on each end (those
+/// outside saturate).  If lo >= hi, nothing changes.
+/// Requires: 0.0 <= pct < 50.0.
+void ImageLevelsStretch(uint8 map[], int maxval, const unsigned long hist[],
+                        double pct) {  ///
+  assert(map != NULL);
+  assert(0 < maxval && maxval <= PixMax);
+  assert(hist != NULL);
+  assert(0.0 <= pct && pct < 50.0);
+  double total = 0.0;
+  for (int v = 0; v < NUMLEVELS; v++) total += hist[v];
+  double cut = total * pct / 100.0;
+  // Descartar até cut pixels em cada extremo
+  int lo = 0, hi = NUMLEVELS - 1;
+  double below = 0.0, above = 0.0;
+  while (lo < NUMLEVELS - 1 && below + hist[lo] <= cut) below += hist[lo++];
+  while (hi > 0 && above + hist[hi] <= cut) above += hist[hi--];
+  if (lo >= hi) return;
+  uint8 f[NUMLEVELS];
+  for (int v = 0; v < NUMLEVELS; v++) {
+    f[v] = v <= lo ? 0 : v >= hi ? maxval :
+           (uint8)(((v - lo) * maxval + (hi - lo) / 2) / (hi - lo));
+  }
+  for (int v = 0; v < NUMLEVELS; v++) {
+    map[v] = f[map[v]];
+  }
+}
+
+/// The threshold that best separates the levels of histogram hist into two
+/// classes (Otsu's method: maximum variance between the classes below and
+/// at or above it), to use with ImageThreshold.
+/// If all pixels have the same level, returns that level.
+uint8 ImageOtsuLevel(const unsigned long hist[]) {  ///
+  assert(hist != NULL);
+  double total = 0.0, sum = 0.0;
+  for (int v = 0; v < NUMLEVELS; v++) {
+    total += hist[v];
+    sum += (double)v * hist[v];
+  }
+  // Classes: níveis < t (peso w0, soma sum0) e >= t
+  double w0 = 0.0, sum0 = 0.0, best = -1.0;
+  int thr = 0;
+  for (int t = 1; t < NUMLEVELS; t++) {
+    w0 += hist[t - 1];
+    sum0 += (double)(t - 1) * hist[t - 1];
+    double w1 = total - w0;
+    if (w0 == 0.0 || w1 == 0.0) continue;
+    double d = sum0 / w0 - (sum - sum0) / w1;
+    double var = w0 * w1 * d * d;
+    if (var > best) {
+      best = var;
+      thr = t;
     }
   }
+  if (best < 0.0) {
+    // Um só nível (ou nenhum): esse nível
+    while (thr < NUMLEVELS - 1 && hist[thr] == 0) thr++;
+    if (hist[thr] == 0) thr = 0;
+  }
+  return (uint8)thr;
+}
+
+/// Equalize the histogram of img (see ImageLevelsEqualize).
+void ImageEqualize(Image img) {  ///
+  INSTR_SCOPE("ImageEqualize");
+  assert(img != NULL);
+  unsigned long hist[NUMLEVELS];
+  uint8 map[NUMLEVELS];
+  ImageHistogram(img, hist);
+  ImageLevelsIdentity(map);
+  ImageLevelsEqualize(map, img->maxval, hist);
+  ImageMapLevels(img, map);
+}
+
+/// Apply threshold to image, at the level chosen by ImageOtsuLevel.
+/// Returns that level.
+uint8 ImageAutoThreshold(Image img) {  ///
+  INSTR_SCOPE("ImageAutoThreshold");
+  assert(img != NULL);
+  unsigned long hist[NUMLEVELS];
+  ImageHistogram(img, hist);
+  uint8 thr = ImageOtsuLevel(hist);
+  uint8 map[NUMLEVELS];
+  ImageLevelsIdentity(map);
+  ImageLevelsThreshold(map, img->maxval, thr);
+  ImageMapLevels(img, map);
+  return thr;
+}
+
+/// Stretch the contrast of img, ignoring pct% of the pixels at each end
+/// (see ImageLevelsStretch).
+/// Requires: 0.0 <= pct < 50.0.
+void ImageAutoContrast(Image img, double pct) {  ///
+  INSTR_SCOPE("ImageAutoContrast");
+  assert(img != NULL);
+  assert(0.0 <= pct && pct < 50.0);
+  unsigned long hist[NUMLEVELS];
+  uint8 map[NUMLEVELS];
+  ImageHistogram(img, hist);
+  ImageLevelsIdentity(map);
+  ImageLevelsStretch(map, img->maxval, hist, pct);
+  ImageMapLevels(img, map);
 }
 
 /// Geometric transformations
@@ -489,15 +2098,17 @@ void ImageBrighten(Image img, double factor) {  ///
 /// (The caller is responsible for destroying the returned image!)
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageRotate(Image img) {
+  INSTR_SCOPE("ImageRotate");
   assert(img != NULL);
   // Insert code here!
-  Image new_img = ImageCreate(img->height, img->width, img->maxval);
-  assert(new_img != NULL);
+  Image new_img = newImage(img->height, img->width, img->maxval, 0);
+  if (new_img == NULL) return NULL;  // errno/errCause já definidos
 
-  for (int i = 0; i < img->width; i++) {
-    for (int j = 0; j < img->height; j++) {
+  // A nova imagem tem largura img->height e altura img->width
+  for (int i = 0; i < img->height; i++) {
+    for (int j = 0; j < img->width; j++) {
       //Revertemos as coordenadas x e y
-      int x = img->height - 1 - j;
+      int x = img->width - 1 - j;
       int y = i;
       // Pixel da nova imagem
       ImageSetPixel(new_img, i, j, ImageGetPixel(img, x, y));
@@ -515,16 +2126,17 @@ Image ImageRotate(Image img) {
 /// (The caller is responsible for destroying the returned image!)
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageMirror(Image img) {
+  INSTR_SCOPE("ImageMirror");
   assert(img != NULL);
   // Insert your code here
-  Image new_img = ImageCreate(img->width, img->height, img->maxval);
-  assert(new_img != NULL); 
+  Image new_img = newImage(img->width, img->height, img->maxval, 0);
+  if (new_img == NULL) return NULL;  // errno/errCause já definidos
 
   for (int i = 0; i < img->width * img->height; i++) {
     // Obter o x da imagem original
     int x = i % img->width;
     // Obter o y da imagem original
-    int y = i / img->height;
+    int y = i / img->width;
     int new_x = img->width - 1 -x;  // O x da nova imagem é o x da imagem original invertido
     ImageSetPixel(new_img, new_x, y, ImageGetPixel(img, x, y));
   }
@@ -545,11 +2157,16 @@ Image ImageMirror(Image img) {
 /// (The caller is responsible for destroying the returned image!)
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageCrop(Image img, int x, int y, int w, int h) {  ///
+  INSTR_SCOPE("ImageCrop");
   assert(img != NULL);
   assert(ImageValidRect(img, x, y, w, h));
   // Insert your code here!
-  Image new_img = ImageCreate(w, h, img->maxval);
-  assert(new_img != NULL);
+  // Recortar a imagem toda não muda nada: partilhar os pixels
+  if (x == 0 && y == 0 && w == img->width && h == img->height) {
+    return ImageClone(img);
+  }
+  Image new_img = newImage(w, h, img->maxval, 0);
+  if (new_img == NULL) return NULL;  // errno/errCause já definidos
 
   for (int i = 0; i < w * h; i++) {
     // Obter o x do retângulo
@@ -564,6 +2181,496 @@ Image ImageCrop(Image img, int x, int y, int w, int h) {  ///
   return new_img;
 }
 
+// Resizing
+//
+// The bilinear and area modes are separable: a horizontal pass resamples
+// each source row that is needed into a row of w intermediate values, and
+// a vertical pass combines those rows into each output row.  The weights
+// are fixed-point, computed once per output column and once per output
+// row, and the intermediate values are 9.7 fixed-point (level * 128), in
+// int16, so that the vertical pass (and the exact 2x reduction) can use
+// SSE2 to process 8 (or 16) pixels per instruction, where available.
+// The scalar code computes exactly the same results.
+
+// Fractional bits of the weights of the bilinear and area modes
+#define BILBITS 12
+#define AREABITS 14
+
+// Taps of the bilinear mode: pixel centres are aligned, so output i maps
+// to source coordinate (i + 0.5) * n / m - 0.5 (clamped to the image).
+// For m outputs from n inputs, sets first[i], the source pixel to the left
+// of that coordinate, and frac[i], the weight of the next one (in units of
+// 1 / (1 << BILBITS)).
+static void bilinearTaps(int m, int n, int* first, uint16_t* frac) {
+  for (int i = 0; i < m; i++) {
+    // s = coordenada * 2^BILBITS, arredondada, calculada só com inteiros
+    long long num = (2LL * i + 1) * n - m;  // coordenada * 2m
+    long long s = num < 0 ? 0 : (num * (1 << BILBITS) + m) / (2LL * m);
+    int k = (int)(s >> BILBITS);
+    int f = (int)(s & ((1 << BILBITS) - 1));
+    if (k >= n - 1) {
+      k = n - 1;
+      f = 0;
+    }
+    first[i] = k;
+    frac[i] = (uint16_t)f;
+  }
+}
+
+// Weights of the area mode: output i covers source interval
+// [i * n / m, (i+1) * n / m), and each source pixel is weighted by the
+// part of it that is covered.  For m outputs from n inputs, sets first[i]
+// and count[i] (the source pixels covered), and their weights, which sum to
+// exactly 1 << AREABITS for each output, in weight[i * stride ...].
+static void areaTaps(int m, int n, int* first, int* count, uint16_t* weight,
+                     int stride) {
+  for (int i = 0; i < m; i++) {
+    // Em unidades de 1/m de pixel da fonte: [i n, (i+1) n)
+    long long a = (long long)i * n, b = (long long)(i + 1) * n;
+    int k0 = (int)(a / m), k1 = (int)((b - 1) / m);
+    first[i] = k0;
+    count[i] = k1 - k0 + 1;
+    assert(count[i] <= stride);
+    // Pesos cumulativos arredondados, para que a soma seja exata
+    long long prev = 0;
+    for (int k = k0; k <= k1; k++) {
+      long long end = (long long)(k + 1) * m;
+      if (end > b) end = b;
+      long long cum = ((end - a) * (1 << AREABITS) + n / 2) / n;
+      weight[i * stride + (k - k0)] = (uint16_t)(cum - prev);
+      prev = cum;
+    }
+  }
+}
+
+// Vertical pass of the bilinear mode: blend n intermediate values of rows
+// t0 and t1, with weights f0 and f1 (f0 + f1 == 1 << BILBITS), into d.
+static void blendRows(const int16_t* t0, const int16_t* t1, int f0, int f1,
+                      uint8* d, int n) {
+  int x = 0;
+#ifdef __SSE2__
+  __m128i f = _mm_set1_epi32((f1 << 16) | f0);  // pares (f0, f1)
+  __m128i r = _mm_set1_epi32(1 << (BILBITS + 6));
+  for (; x + 8 <= n; x += 8) {
+    __m128i a = _mm_loadu_si128((const __m128i*)(t0 + x));
+    __m128i b = _mm_loadu_si128((const __m128i*)(t1 + x));
+    // t0 * f0 + t1 * f1, em 32 bits
+    __m128i lo = _mm_madd_epi16(_mm_unpacklo_epi16(a, b), f);
+    __m128i hi = _mm_madd_epi16(_mm_unpackhi_epi16(a, b), f);
+    lo = _mm_srai_epi32(_mm_add_epi32(lo, r), BILBITS + 7);
+    hi = _mm_srai_epi32(_mm_add_epi32(hi, r), BILBITS + 7);
+    __m128i v = _mm_packs_epi32(lo, hi);
+    _mm_storel_epi64((__m128i*)(d + x), _mm_packus_epi16(v, v));
+  }
+#endif
+  for (; x < n; x++) {
+    d[x] = (uint8)((t0[x] * f0 + t1[x] * f1 + (1 << (BILBITS + 6))) >>
+                   (BILBITS + 7));
+  }
+}
+
+// Vertical pass of the area mode: sum n intermediate values of rows
+// t + i * stride, for i < rows, with weights f[i] (adding up to
+// 1 << AREABITS), into d.
+static void sumRows(const int16_t* t, size_t stride, const uint16_t* f,
+                    int rows, uint8* d, int n) {
+  int x = 0;
+#ifdef __SSE2__
+  __m128i r = _mm_set1_epi32(1 << (AREABITS + 6));
+  for (; x + 8 <= n; x += 8) {
+    __m128i lo = r, hi = r;
+    // Duas linhas de cada vez (a última com peso 0, se forem ímpares)
+    for (int i = 0; i < rows; i += 2) {
+      const int16_t* p = t + i * stride + x;
+      int two = i + 1 < rows;
+      __m128i a = _mm_loadu_si128((const __m128i*)p);
+      __m128i b = two ? _mm_loadu_si128((const __m128i*)(p + stride)) : a;
+      __m128i fi = _mm_set1_epi32(((two ? f[i + 1] : 0) << 16) | f[i]);
+      lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), fi));
+      hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), fi));
+    }
+    lo = _mm_srai_epi32(lo, AREABITS + 7);
+    hi = _mm_srai_epi32(hi, AREABITS + 7);
+    __m128i v = _mm_packs_epi32(lo, hi);
+    _mm_storel_epi64((__m128i*)(d + x), _mm_packus_epi16(v, v));
+  }
+#endif
+  for (; x < n; x++) {
+    int32_t sum = 1 << (AREABITS + 6);
+    for (int i = 0; i < rows; i++) sum += t[i * stride + x] * f[i];
+    d[x] = (uint8)(sum >> (AREABITS + 7));
+  }
+}
+
+// Downsample img by an integer factor f (2 or 4), averaging each f x f
+// block, rounded.  (The same result as the area mode, faster.)
+static void boxDownsample(Image img, Image res, int f) {
+  int w = res->width, h = res->height, W = img->width;
+  for (int y = 0; y < h; y++) {
+    const uint8* s = img->pixel + (size_t)y * f * W;
+    uint8* d = res->pixel + (size_t)y * w;
+    int x = 0;
+    if (f == 2) {
+      const uint8* s1 = s + W;
+#ifdef __SSE2__
+      __m128i even = _mm_set1_epi16(0x00FF);
+      __m128i two = _mm_set1_epi16(2);
+      for (; x + 8 <= w; x += 8) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(s + 2 * x));
+        __m128i b = _mm_loadu_si128((const __m128i*)(s1 + 2 * x));
+        // Somas dos pares de pixels, em 16 bits
+        __m128i sum = _mm_add_epi16(
+            _mm_add_epi16(_mm_and_si128(a, even), _mm_srli_epi16(a, 8)),
+            _mm_add_epi16(_mm_and_si128(b, even), _mm_srli_epi16(b, 8)));
+        sum = _mm_srli_epi16(_mm_add_epi16(sum, two), 2);
+        _mm_storel_epi64((__m128i*)(d + x), _mm_packus_epi16(sum, sum));
+      }
+#endif
+      for (; x < w; x++) {
+        d[x] = (uint8)((s[2 * x] + s[2 * x + 1] + s1[2 * x] + s1[2 * x + 1] +
+                        2) >> 2);
+      }
+    } else {
+      for (; x < w; x++) {
+        unsigned sum = 8;
+        for (int j = 0; j < 4; j++) {
+          const uint8* p = s + (size_t)j * W + 4 * x;
+          sum += p[0] + p[1] + p[2] + p[3];
+        }
+        d[x] = (uint8)(sum >> 4);
+      }
+    }
+  }
+}
+
+/// Resize an image to w x h pixels, with the given interpolation mode.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageResize(Image img, int w, int h, Interp mode) {  ///
+  INSTR_SCOPE("ImageResize");
+  assert(img != NULL);
+  assert(w >= 0 && h >= 0);
+  assert(mode == InterpNearest || mode == InterpBilinear ||
+         mode == InterpArea);
+  int W = img->width, H = img->height;
+  assert((W > 0 && H > 0) || w == 0 || h == 0);
+  // O mesmo tamanho não muda nada: partilhar os pixels
+  if (w == W && h == H) return ImageClone(img);
+  Image res = newImage(w, h, img->maxval, 0);
+  if (res == NULL || w == 0 || h == 0) return res;
+
+  // Redução exata por 2 ou 4: média de blocos (igual ao modo area, e ao
+  // bilinear, para 2)
+  for (int f = 2; f <= 4; f += 2) {
+    if (W == f * w && H == f * h &&
+        (mode == InterpArea || (mode == InterpBilinear && f == 2))) {
+      boxDownsample(img, res, f);
+      PIXMEM((unsigned long)W * H + (unsigned long)w * h);
+      return res;
+    }
+  }
+
+  if (mode == InterpNearest) {
+    size_t size = (size_t)(w + h) * (sizeof(int) + sizeof(uint16_t));
+    int* xfirst = memAlloc(size, 0, 0, "Resize allocation failed");
+    if (xfirst == NULL) {
+      ImageDestroy(&res);
+      return NULL;
+    }
+    int* yfirst = xfirst + w;
+    uint16_t* frac = (uint16_t*)(yfirst + h);
+    // O pixel mais próximo: arredondar a coordenada bilinear
+    bilinearTaps(w, W, xfirst, frac);
+    for (int x = 0; x < w; x++) xfirst[x] += frac[x] >= 1 << (BILBITS - 1);
+    bilinearTaps(h, H, yfirst, frac);
+    for (int y = 0; y < h; y++) yfirst[y] += frac[y] >= 1 << (BILBITS - 1);
+    for (int y = 0; y < h; y++) {
+      const uint8* s = img->pixel + (size_t)yfirst[y] * W;
+      uint8* d = res->pixel + (size_t)y * w;
+      for (int x = 0; x < w; x++) d[x] = s[xfirst[x]];
+    }
+    PIXMEM(2 * (unsigned long)w * h);  // count pixel memory accesses
+    memFree(xfirst, size);
+    return res;
+  }
+
+  // Taps por coluna (x) e por linha (y)
+  int maxx = mode == InterpArea ? (W + w - 1) / w + 1 : 1;
+  int maxy = mode == InterpArea ? (H + h - 1) / h + 1 : 1;
+  size_t xsize = (size_t)w * (2 * sizeof(int) + maxx * sizeof(uint16_t));
+  size_t ysize = (size_t)h * (2 * sizeof(int) + maxy * sizeof(uint16_t));
+  size_t tmpsize = (size_t)w * H * sizeof(int16_t);
+  char* xtaps = memAlloc(xsize, 0, 0, "Resize allocation failed");
+  char* ytaps = memAlloc(ysize, 0, 0, "Resize allocation failed");
+  // Linhas intermédias: calculadas só as necessárias, quando necessárias
+  int16_t* tmp = memAlloc(tmpsize, 0, 0, "Resize allocation failed");
+  uint8* ready = memAlloc(H, 1, 0, "Resize allocation failed");
+  if (xtaps == NULL || ytaps == NULL || tmp == NULL || ready == NULL) {
+    errsave = errno;
+    memFree(ready, H);
+    memFree(tmp, tmpsize);
+    memFree(ytaps, ysize);
+    memFree(xtaps, xsize);
+    ImageDestroy(&res);
+    errno = errsave;
+    return NULL;
+  }
+  int* xfirst = (int*)xtaps;
+  int* xcount = xfirst + w;
+  uint16_t* xweight = (uint16_t*)(xcount + w);
+  int* yfirst = (int*)ytaps;
+  int* ycount = yfirst + h;
+  uint16_t* yweight = (uint16_t*)(ycount + h);
+  if (mode == InterpArea) {
+    areaTaps(w, W, xfirst, xcount, xweight, maxx);
+    areaTaps(h, H, yfirst, ycount, yweight, maxy);
+  } else {
+    bilinearTaps(w, W, xfirst, xweight);
+    bilinearTaps(h, H, yfirst, yweight);
+  }
+
+  unsigned long reads = 0;
+  for (int y = 0; y < h; y++) {
+    // Fontes desta linha: as linhas yfirst[y] .. yfirst[y] + rows - 1
+    int rows = mode == InterpArea ? ycount[y] : yweight[y] > 0 ? 2 : 1;
+    for (int j = yfirst[y]; j < yfirst[y] + rows; j++) {
+      if (ready[j]) continue;
+      // Passo horizontal da linha j
+      const uint8* s = img->pixel + (size_t)j * W;
+      int16_t* t = tmp + (size_t)j * w;
+      if (mode == InterpBilinear) {
+        for (int x = 0; x < w; x++) {
+          // (Se f == 0, k pode ser o último pixel: não ler o seguinte)
+          int k = xfirst[x], f = xweight[x];
+          int v = s[k] * ((1 << BILBITS) - f) + s[k + (f > 0)] * f;
+          t[x] = (int16_t)((v + (1 << (BILBITS - 8))) >> (BILBITS - 7));
+        }
+        reads += 2 * (unsigned long)w;
+      } else {
+        for (int x = 0; x < w; x++) {
+          const uint16_t* wt = xweight + x * maxx;
+          const uint8* p = s + xfirst[x];
+          uint32_t sum = 0;
+          for (int i = 0; i < xcount[x]; i++) sum += p[i] * wt[i];
+          t[x] = (int16_t)((sum + (1 << (AREABITS - 8))) >> (AREABITS - 7));
+          reads += xcount[x];
+        }
+      }
+      ready[j] = 1;
+    }
+
+    // Passo vertical
+    uint8* d = res->pixel + (size_t)y * w;
+    const int16_t* t0 = tmp + (size_t)yfirst[y] * w;
+    if (mode == InterpBilinear) {
+      int f1 = rows == 2 ? yweight[y] : 0;
+      blendRows(t0, rows == 2 ? t0 + w : t0, (1 << BILBITS) - f1, f1, d, w);
+    } else {
+      sumRows(t0, w, yweight + y * maxy, rows, d, w);
+    }
+  }
+  PIXMEM(reads + (unsigned long)w * h);  // count pixel memory accesses
+
+  memFree(ready, H);
+  memFree(tmp, tmpsize);
+  memFree(ytaps, ysize);
+  memFree(xtaps, xsize);
+  return res;
+}
+
+// Affine warps
+//
+// Source coordinates are 32.32 fixed-point: along each row of a tile they
+// are advanced by adding the constant steps (m[0], m[3]), instead of
+// multiplying by the matrix at each pixel.  Each row of each tile starts
+// from the exact product, so rounding errors do not accumulate.  The output
+// is produced in WARPTILE x WARPTILE tiles, so that the source pixels read
+// (along slanted lines, in a rotation) are still cached for the next row.
+
+#define WARPBITS 32
+#define WARPTILE 64
+
+// The fixed-point value of v
+static int64_t warpFixed(double v) {
+  return llround(ldexp(v, WARPBITS));
+}
+
+// Fill n pixels of d from img by nearest interpolation, starting at source
+// coordinates (sx, sy) and stepping by (dx, dy).  Pixels outside are black.
+// Returns the number of pixels read.
+static long warpNearest(Image img, int64_t sx, int64_t sy, int64_t dx,
+                        int64_t dy, uint8* d, int n) {
+  int64_t half = (int64_t)1 << (WARPBITS - 1);
+  uint64_t W = img->width, H = img->height;
+  long reads = 0;
+  for (int x = 0; x < n; x++, sx += dx, sy += dy) {
+    // Comparações sem sinal: as coordenadas negativas ficam enormes
+    uint64_t kx = (uint64_t)((sx + half) >> WARPBITS);
+    uint64_t ky = (uint64_t)((sy + half) >> WARPBITS);
+    if (kx < W && ky < H) {
+      d[x] = img->pixel[ky * W + kx];
+      reads++;
+    } else {
+      d[x] = 0;
+    }
+  }
+  return reads;
+}
+
+// Bilinear taps of fixed-point coordinate s in [-0.5, n - 0.5]: the pixel k
+// and the weight f of pixel k + 1 (0 if there is none).
+// Returns 0 if s is outside.
+static int warpTaps(int64_t s, int n, int* k, int* f) {
+  int64_t half = (int64_t)1 << (WARPBITS - 1);
+  if (s < -half || s > ((int64_t)n << WARPBITS) - half) return 0;
+  if (s < 0) {
+    *k = 0;
+    *f = 0;
+  } else {
+    *k = (int)(s >> WARPBITS);
+    *f = (int)(s >> (WARPBITS - BILBITS)) & ((1 << BILBITS) - 1);
+    if (*k >= n - 1) {
+      *k = n - 1;
+      *f = 0;
+    }
+  }
+  return 1;
+}
+
+// Fill n pixels of d from img by bilinear interpolation, starting at source
+// coordinates (sx, sy) and stepping by (dx, dy).  Pixels within half a pixel
+// of the border replicate it; farther out, they are black.
+// Returns the number of pixels read.
+static long warpBilinear(Image img, int64_t sx, int64_t sy, int64_t dx,
+                         int64_t dy, uint8* d, int n) {
+  int W = img->width, H = img->height;
+  int mask = (1 << BILBITS) - 1;
+  long reads = 0;
+  if (W == 0 || H == 0) {  // imagem vazia: tudo fora
+    memset(d, 0, (size_t)n);
+    return 0;
+  }
+  for (int x = 0; x < n; x++, sx += dx, sy += dy) {
+    int kx = (int)(sx >> WARPBITS), ky = (int)(sy >> WARPBITS);
+    int fx, fy;
+    const uint8* p;
+    uint32_t top, bottom;
+    if (kx >= 0 && kx < W - 1 && ky >= 0 && ky < H - 1) {
+      // Caso comum: os 4 vizinhos estão dentro da imagem
+      fx = (int)(sx >> (WARPBITS - BILBITS)) & mask;
+      fy = (int)(sy >> (WARPBITS - BILBITS)) & mask;
+      p = img->pixel + (size_t)ky * W + kx;
+      top = p[0] * (uint32_t)((1 << BILBITS) - fx) + p[1] * (uint32_t)fx;
+      bottom = p[W] * (uint32_t)((1 << BILBITS) - fx) + p[W + 1] * (uint32_t)fx;
+      reads += 4;
+    } else if (warpTaps(sx, W, &kx, &fx) && warpTaps(sy, H, &ky, &fy)) {
+      // Junto à borda: replicar a borda
+      p = img->pixel + (size_t)ky * W + kx;
+      const uint8* q = fy > 0 ? p + W : p;
+      top = p[0] * (uint32_t)((1 << BILBITS) - fx) + p[fx > 0] * (uint32_t)fx;
+      bottom = q[0] * (uint32_t)((1 << BILBITS) - fx) + q[fx > 0] * (uint32_t)fx;
+      reads += 4;
+    } else {
+      d[x] = 0;
+      continue;
+    }
+    // (< 2^32, porque top, bottom <= 255 * 2^BILBITS)
+    d[x] = (uint8)((top * (uint32_t)((1 << BILBITS) - fy) + bottom * (uint32_t)fy +
+                    (1u << (2 * BILBITS - 1))) >> (2 * BILBITS));
+  }
+  return reads;
+}
+
+/// Apply an affine transform to an image, producing a w x h image.
+/// matrix maps each output pixel (x, y) to source coordinates
+///   sx = m[0]*x + m[1]*y + m[2],  sy = m[3]*x + m[4]*y + m[5]
+/// (the inverse of the transform of the image), with pixel centres at
+/// integer coordinates.  Source pixels are interpolated according to mode:
+/// InterpNearest or InterpBilinear.  Output pixels that map outside img
+/// are black (0).
+/// Requires: w >= 0, h >= 0, and all source coordinates must be within
+/// +-2^30.
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageAffine(Image img, const double matrix[6], int w, int h,
+                  Interp mode) {  ///
+  INSTR_SCOPE("ImageAffine");
+  assert(img != NULL);
+  assert(matrix != NULL);
+  assert(w >= 0 && h >= 0);
+  assert(mode == InterpNearest || mode == InterpBilinear);
+  const double* m = matrix;
+  // Transformação afim: os extremos estão nos cantos
+  for (int c = 0; c < 4; c++) {
+    double x = c & 1 ? w : 0, y = c & 2 ? h : 0;
+    assert(fabs(m[0] * x + m[1] * y + m[2]) <= 1 << 30);
+    assert(fabs(m[3] * x + m[4] * y + m[5]) <= 1 << 30);
+    (void)x, (void)y;
+  }
+  Image res = newImage(w, h, img->maxval, 0);
+  if (res == NULL) return NULL;  // errno/errCause já definidos
+
+  int64_t dx = warpFixed(m[0]), dy = warpFixed(m[3]);
+  unsigned long reads = 0;
+  for (int ty = 0; ty < h; ty += WARPTILE) {
+    int th = h - ty < WARPTILE ? h - ty : WARPTILE;
+    for (int tx = 0; tx < w; tx += WARPTILE) {
+      int tw = w - tx < WARPTILE ? w - tx : WARPTILE;
+      for (int y = ty; y < ty + th; y++) {
+        int64_t sx = warpFixed(m[0] * tx + m[1] * y + m[2]);
+        int64_t sy = warpFixed(m[3] * tx + m[4] * y + m[5]);
+        uint8* d = res->pixel + (size_t)y * w + tx;
+        if (mode == InterpNearest) {
+          reads += warpNearest(img, sx, sy, dx, dy, d, tw);
+        } else {
+          reads += warpBilinear(img, sx, sy, dx, dy, d, tw);
+        }
+      }
+    }
+  }
+  PIXMEM(reads + (unsigned long)w * h);  // count pixel memory accesses
+  return res;
+}
+
+/// Rotate an image by an arbitrary angle, in degrees, anti-clockwise,
+/// about its centre.  The result is just large enough to contain the whole
+/// rotated image; the corners outside it are black (0).
+/// mode is InterpNearest or InterpBilinear (see ImageAffine).
+/// Multiples of 90 degrees are exact (but ImageRotate is faster).
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageRotateAngle(Image img, double degrees, Interp mode) {  ///
+  INSTR_SCOPE("ImageRotateAngle");
+  assert(img != NULL);
+  assert(isfinite(degrees));
+  assert(mode == InterpNearest || mode == InterpBilinear);
+  double a = degrees * (M_PI / 180.0);
+  double c = cos(a), s = sin(a);
+  // Múltiplos de 90 graus: senos e cossenos exatos
+  if (fmod(degrees, 90.0) == 0.0) {
+    c = round(c);
+    s = round(s);
+  }
+  int W = img->width, H = img->height;
+  // Caixa envolvente (com tolerância para os erros de arredondamento)
+  int w = (int)ceil(W * fabs(c) + H * fabs(s) - 1e-6);
+  int h = (int)ceil(W * fabs(s) + H * fabs(c) - 1e-6);
+  // Centros: (ox, oy) no resultado, (cx, cy) na imagem.  Com y para baixo,
+  // a rotação inversa é sx = c u - s v + cx, sy = s u + c v + cy, em que
+  // (u, v) = (x - ox, y - oy).
+  double ox = (w - 1) / 2.0, oy = (h - 1) / 2.0;
+  double cx = (W - 1) / 2.0, cy = (H - 1) / 2.0;
+  double m[6] = {c, -s, cx - c * ox + s * oy, s, c, cy - s * ox - c * oy};
+  return ImageAffine(img, m, w, h, mode);
+}
+
 /// Operations on two images
 
 /// Paste an image into a larger image.
@@ -571,10 +2678,12 @@ Image ImageCrop(Image img, int x, int y, int w, int h) {  ///
 /// This modifies img1 in-place: no allocation involved.
 /// Requires: img2 must fit inside img1 at position (x, y).
 void ImagePaste(Image img1, int x, int y, Image img2) {  ///
+  INSTR_SCOPE("ImagePaste");
   assert(img1 != NULL);
   assert(img2 != NULL);
   //Verificar se a img2 cabe na img1 na posição x,y
   assert(ImageValidRect(img1, x, y, img2->width, img2->height));
+  if (!writable(img1)) return;
   // Insert your code here!
   for (int i = 0; i < img2->width * img2->height; i++) {
     int new_x = i % img2->width;
@@ -592,9 +2701,11 @@ void ImagePaste(Image img1, int x, int y, Image img2) {  ///
 /// alpha usually is in [0.0, 1.0], but values outside that interval
 /// may provide interesting effects.  Over/underflows should saturate.
 void ImageBlend(Image img1, int x, int y, Image img2, double alpha) {
+  INSTR_SCOPE("ImageBlend");
   assert(img1 != NULL);
   assert(img2 != NULL);
   assert(ImageValidRect(img1, x, y, img2->width, img2->height));
+  if (!writable(img1)) return;
   // Insert your code here!
   for (int j = 0; j < img2->width; j++) {
     for (int i = 0; i < img2->height; i++) {
@@ -622,7 +2733,7 @@ int ImageMatchSubImage(Image img1, int x, int y, Image img2) {  ///
   // Insert your code here!
   for (int i = 0; i < img2->height; i++) {
     for (int j = 0; j < img2->width; j++) {
-      comps+=1;
+      COMPS(1);
       // verificamos se os pixeis a partir de (x,y) da imagem1 
       // correspondem à imagem2, parando a execução no caso 
       // de se encontrar uma diferença
@@ -639,6 +2750,7 @@ int ImageMatchSubImage(Image img1, int x, int y, Image img2) {  ///
 /// If a match is found, returns 1 and matching position is set in vars (*px,
 /// *py). If no match is found, returns 0 and (*px, *py) are left untouched.
 int ImageLocateSubImage(Image img1, int* px, int* py, Image img2) {  ///
+  INSTR_SCOPE("ImageLocateSubImage");
   assert(img1 != NULL);
   assert(img2 != NULL);
   // Insert your code here!
@@ -664,12 +2776,16 @@ int ImageLocateSubImage(Image img1, int* px, int* py, Image img2) {  ///
 /// The image is changed in-place.
 
 void ImageBlur(Image img, int dx, int dy) {
+  INSTR_SCOPE("ImageBlur");
   assert(img != NULL);
   assert(dx >= 0);
   assert(dy >= 0);
+  if (!writable(img)) return;
 
  // Criação do array que vai guardar os valores das somas cumulativas
-  double *sums = malloc(GetSize(img) * sizeof(double)); 
+  // (memória auxiliar: contabilizada, mas não sujeita ao limite)
+  size_t sumsSize = (size_t)GetSize(img) * sizeof(double);
+  double *sums = memAlloc(sumsSize, 0, 0, "Falhou a alocação das somas");
   assert(sums != NULL);
   int index;
   // cálculo das somas cumulativas
@@ -723,7 +2839,7 @@ void ImageBlur(Image img, int dx, int dy) {
     }
   }
   // libertar a memória
-  free(sums);
+  memFree(sums, sumsSize);
 
 }
 
@@ -731,8 +2847,9 @@ void ImageBlur(Image img, int dx, int dy) {
 // ########### Versões menos eficientes da blur ####################
 // Parecida à função de cima, mas a de cima foi refeita até com nomes mais compreensiveis
 void ImageBlurNotCorrected(Image img, int dx, int dy) {
+  if (!writable(img)) return;
    // Alocar memoria para o array de somas cumulativas
-  uint8_t* cumsum = malloc(GetSize(img) * sizeof(uint8_t));
+  uint8_t* cumsum = memAlloc(GetSize(img) * sizeof(uint8_t), 0, 0, "");
 
    // Variáveis para os indices do pixel e soma cumulativa
   int index;
@@ -826,7 +2943,7 @@ void ImageBlurNotCorrected(Image img, int dx, int dy) {
    }
 
   
-   free(cumsum);
+   memFree(cumsum, GetSize(img) * sizeof(uint8_t));
 }
 
 
@@ -834,9 +2951,11 @@ void ImageBlurOld1(Image img, int dx, int dy) {
   assert(img != NULL);
   assert(dx >= 0);
   assert(dy >= 0);
+  if (!writable(img)) return;
 
   // alocar um array que vai conter os valores dos pixeis blurred
-  double* blurred_pixels = malloc(img->width * img->height * sizeof(double));
+  double* blurred_pixels =
+      memAlloc(img->width * img->height * sizeof(double), 0, 0, "");
   assert(blurred_pixels != NULL);
 
 
@@ -861,14 +2980,14 @@ void ImageBlurOld1(Image img, int dx, int dy) {
           sum += ImageGetPixel(img, x + i, y + j);
           //incrementar o count
           count++;
-          somas++;
+          SOMAS(1);
         }
       }
     }
     // calcular a media e arredondar
     // dar cast a double
     blurred_pixels[pixel] = (double)sum / count;
-    divs++;
+    DIVS(1);
 
   }
 
@@ -878,7 +2997,7 @@ void ImageBlurOld1(Image img, int dx, int dy) {
     img->pixel[pixel] = blurred_pixels[pixel] + 0.5;
     fprintf(f, "%d\n", img->pixel[pixel]);
   }
-  free(blurred_pixels);
+  memFree(blurred_pixels, img->width * img->height * sizeof(double));
 }
 
 
@@ -886,6 +3005,7 @@ void ImageBlurOld1(Image img, int dx, int dy) {
 
 
 void ImageBlurOld3(Image img, int dx, int dy) {  ///
+  if (!writable(img)) return;
   // Insert your code here!
   // Criar uma imagem nova para os pixeis que já foram blurred não influenciarem os píxeis que vão ser blurred...
     Image img2 = ImageCreate(img->width, img->height, img->maxval);
@@ -896,7 +3016,7 @@ void ImageBlurOld3(Image img, int dx, int dy) {  ///
     int sum = 0;
     int count = 0;
     int size = (2 * dx + 1) * (2 * dy + 1);
-    int* pixels = malloc(size * sizeof(int));
+    int* pixels = memAlloc(size * sizeof(int), 0, 0, "");
     for (int i = 0; i < img->height; i++) {
       for (int j = 0; j < img->width; j++) {
         for (int k = -dx; k <= dx; k++) {
@@ -915,10 +3035,11 @@ void ImageBlurOld3(Image img, int dx, int dy) {  ///
         sum = 0;
       }
     }
-      free(pixels);
+      memFree(pixels, size * sizeof(int));
 }
 
 void ImageBlurOld2(Image img, int dx, int dy) {  ///
+  if (!writable(img)) return;
   // Insert your code here!
   // Criar uma imagem nova para os pixeis que já foram blurred não influenciarem os píxeis que vão ser blurred...
     Image img2 = ImageCreate(img->width, img->height, img->maxval);
@@ -937,12 +3058,12 @@ void ImageBlurOld2(Image img, int dx, int dy) {  ///
             if (ImageValidPos(img, j + k, i + l)) {
               sum+= ImageGetPixel(img2, j + k, i + l);
               count++;
-              somas++;
+              SOMAS(1);
             }
           }
         }
         ImageSetPixel(img, j, i, (((double)sum / count) + 0.5));
-        divs++;
+        DIVS(1);
         count = 0;
         sum = 0;
       }
@@ -950,5 +3071,485 @@ void ImageBlurOld2(Image img, int dx, int dy) {  ///
   
 }
 
+/// Edge detection
+
+// Both kernels are separable: gx is a horizontal difference [-1 0 1],
+// smoothed vertically by [1 2 1] (Sobel) or [3 10 3] (Scharr), and gy is a
+// vertical difference of rows smoothed horizontally by the same weights.
+// So each row of the image is filtered horizontally only once, into a row
+// of differences and a row of smoothed levels, in a sliding window of 3
+// rows; each output row combines the 3 rows of the window.  All arithmetic
+// is in 16 bits (|gx|, |gy| <= 16 * 255), 8 pixels per instruction with
+// SSE2, where available; the scalar code computes exactly the same results.
+
+// Horizontal pass of a row of n pixels at p, where p[-1] and p[n] must be
+// valid (replicas of the borders): diff[x] = p[x+1] - p[x-1] and smooth[x]
+// = p[x-1] + 2 p[x] + p[x+1] (or 3, 10, 3, for Scharr).
+static void edgeRow(const uint8* p, int n, int scharr, int16_t* diff,
+                    int16_t* smooth) {
+  int x = 0;
+#ifdef __SSE2__
+  __m128i zero = _mm_setzero_si128();
+  __m128i three = _mm_set1_epi16(3), ten = _mm_set1_epi16(10);
+  for (; x + 8 <= n; x += 8) {
+    __m128i a = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(p + x - 1)), zero);
+    __m128i b = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(p + x)), zero);
+    __m128i c = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(p + x + 1)), zero);
+    __m128i ac = _mm_add_epi16(a, c);
+    __m128i sm = scharr ? _mm_add_epi16(_mm_mullo_epi16(ac, three),
+                                        _mm_mullo_epi16(b, ten))
+                        : _mm_add_epi16(ac, _mm_add_epi16(b, b));
+    _mm_storeu_si128((__m128i*)(diff + x), _mm_sub_epi16(c, a));
+    _mm_storeu_si128((__m128i*)(smooth + x), sm);
+  }
+#endif
+  for (; x < n; x++) {
+    int a = p[x - 1], b = p[x], c = p[x + 1];
+    diff[x] = (int16_t)(c - a);
+    smooth[x] = (int16_t)(scharr ? 3 * (a + c) + 10 * b : a + 2 * b + c);
+  }
+}
+
+// Vertical pass: combine the rows of differences (d0, d1, d2) and smoothed
+// levels (s0, s2, above and below) of the window into n gradient
+// magnitudes, saturated at maxval, in out.  If gx is not NULL, stores the
+// gradients in gx and gy.
+static void edgeCombine(const int16_t* d0, const int16_t* d1,
+                        const int16_t* d2, const int16_t* s0,
+                        const int16_t* s2, int n, int scharr, int l2,
+                        uint8 maxval, uint8* out, int16_t* gx, int16_t* gy) {
+  int x = 0;
+#ifdef __SSE2__
+  __m128i zero = _mm_setzero_si128();
+  __m128i three = _mm_set1_epi16(3), ten = _mm_set1_epi16(10);
+  __m128i top = _mm_set1_epi8((char)maxval);
+  for (; x + 8 <= n; x += 8) {
+    __m128i a = _mm_loadu_si128((const __m128i*)(d0 + x));
+    __m128i b = _mm_loadu_si128((const __m128i*)(d1 + x));
+    __m128i c = _mm_loadu_si128((const __m128i*)(d2 + x));
+    __m128i ac = _mm_add_epi16(a, c);
+    __m128i vx = scharr ? _mm_add_epi16(_mm_mullo_epi16(ac, three),
+                                        _mm_mullo_epi16(b, ten))
+                        : _mm_add_epi16(ac, _mm_add_epi16(b, b));
+    __m128i vy = _mm_sub_epi16(_mm_loadu_si128((const __m128i*)(s2 + x)),
+                               _mm_loadu_si128((const __m128i*)(s0 + x)));
+    __m128i m;
+    if (!l2) {
+      // |v| = max(v, -v) (SSE2 não tem abs)
+      __m128i ax = _mm_max_epi16(vx, _mm_sub_epi16(zero, vx));
+      __m128i ay = _mm_max_epi16(vy, _mm_sub_epi16(zero, vy));
+      m = _mm_adds_epi16(ax, ay);
+    } else {
+      // gx^2 + gy^2 dos pares (gx, gy), em 32 bits; raiz em float
+      __m128i lo = _mm_unpacklo_epi16(vx, vy), hi = _mm_unpackhi_epi16(vx, vy);
+      lo = _mm_cvtps_epi32(_mm_sqrt_ps(_mm_cvtepi32_ps(_mm_madd_epi16(lo, lo))));
+      hi = _mm_cvtps_epi32(_mm_sqrt_ps(_mm_cvtepi32_ps(_mm_madd_epi16(hi, hi))));
+      m = _mm_packs_epi32(lo, hi);
+    }
+    m = _mm_min_epu8(_mm_packus_epi16(m, m), top);
+    _mm_storel_epi64((__m128i*)(out + x), m);
+    if (gx != NULL) {
+      _mm_storeu_si128((__m128i*)(gx + x), vx);
+      _mm_storeu_si128((__m128i*)(gy + x), vy);
+    }
+  }
+#endif
+  for (; x < n; x++) {
+    int vx = scharr ? 3 * (d0[x] + d2[x]) + 10 * d1[x] : d0[x] + 2 * d1[x] + d2[x];
+    int vy = s2[x] - s0[x];
+    long m;
+    if (!l2) {
+      m = abs(vx) + abs(vy);
+    } else {
+      // (Arredondado como em SSE2: float, arredondamento par)
+      m = lrintf(sqrtf((float)(vx * vx + vy * vy)));
+    }
+    out[x] = (uint8)(m < maxval ? m : maxval);
+    if (gx != NULL) {
+      gx[x] = (int16_t)vx;
+      gy[x] = (int16_t)vy;
+    }
+  }
+}
+
+// Direction of gradient (gx, gy), in 256ths of a turn, anticlockwise from
+// the right: lrint(atan2(-gy, gx) * 128 / M_PI) & 255, without atan2.
+// The angle is folded into the first octant, where its level (0 to 32) is
+// the number of half-steps tan((k + 0.5) * M_PI / 128), given in tanHalf,
+// below the ratio of the smaller to the larger component.  (The ratio is
+// rational and the tangents are not, so there are no ties.)
+static uint8 gradientAngle(int gx, int gy, const double tanHalf[32]) {
+  int ax = abs(gx), ay = abs(gy);
+  int mn = ax < ay ? ax : ay, mx = ax < ay ? ay : ax;
+  // Pesquisa binária de mn / mx em tanHalf
+  int k = 0;
+  for (int step = 16; step > 0; step >>= 1) {
+    k += (double)mn > mx * tanHalf[k + step - 1] ? step : 0;
+  }
+  k += (double)mn > mx * tanHalf[k];
+  int a = ay <= ax ? k : 64 - k;  // 1º quadrante
+  if (gx < 0) a = 128 - a;
+  if (gy > 0) a = -a;  // (y cresce para baixo)
+  return (uint8)(a & 255);
+}
+
+// Gradient magnitude (and direction, if dir is not NULL) of img, with the
+// Sobel or Scharr kernels.  See ImageSobel.
+static Image gradient(Image img, int scharr, int l2, Image* dir) {
+  int W = img->width, H = img->height;
+  Image res = newImage(W, H, img->maxval, 0);
+  if (res == NULL) return NULL;  // errno/errCause já definidos
+  Image angle = NULL;
+  if (dir != NULL && (angle = newImage(W, H, PixMax, 0)) == NULL) {
+    ImageDestroy(&res);
+    return NULL;
+  }
+  if (W == 0 || H == 0) {
+    if (dir != NULL) *dir = angle;
+    return res;
+  }
+  // Janela de 3 linhas (diferenças e suavizadas), linha com as bordas
+  // replicadas, e gradientes da linha (para a direção)
+  size_t rowsize = (size_t)W * sizeof(int16_t);
+  size_t size = 6 * rowsize + (W + 2) + (dir != NULL ? 2 * rowsize : 0);
+  char* scratch = memAlloc(size, 0, 0, "Edge allocation failed");
+  if (scratch == NULL) {
+    errsave = errno;
+    ImageDestroy(&angle);
+    ImageDestroy(&res);
+    errno = errsave;
+    return NULL;
+  }
+  int16_t* diff[3];
+  int16_t* smooth[3];
+  for (int i = 0; i < 3; i++) {
+    diff[i] = (int16_t*)(scratch + 2 * i * rowsize);
+    smooth[i] = (int16_t*)(scratch + (2 * i + 1) * rowsize);
+  }
+  int16_t* gx = dir != NULL ? (int16_t*)(scratch + 6 * rowsize) : NULL;
+  int16_t* gy = dir != NULL ? gx + W : NULL;
+  uint8* pad = (uint8*)scratch + size - (W + 2);
+
+  double tanHalf[32];
+  for (int k = 0; k < 32; k++) tanHalf[k] = tan((k + 0.5) * M_PI / 128.0);
+
+  // A linha y fica na posição y % 3 da janela, calculada quando é precisa
+  int next = 0;
+  for (int y = 0; y < H; y++) {
+    int last = y + 1 < H ? y + 1 : H - 1;
+    for (; next <= last; next++) {
+      const uint8* p = img->pixel + (size_t)next * W;
+      memcpy(pad + 1, p, W);
+      pad[0] = p[0];
+      pad[W + 1] = p[W - 1];
+      edgeRow(pad + 1, W, scharr, diff[next % 3], smooth[next % 3]);
+    }
+    int a = (y > 0 ? y - 1 : 0) % 3, b = y % 3, c = last % 3;
+    edgeCombine(diff[a], diff[b], diff[c], smooth[a], smooth[c], W, scharr, l2,
+                img->maxval, res->pixel + (size_t)y * W, gx, gy);
+    if (angle != NULL) {
+      uint8* d = angle->pixel + (size_t)y * W;
+      for (int x = 0; x < W; x++) d[x] = gradientAngle(gx[x], gy[x], tanHalf);
+    }
+  }
+  PIXMEM((unsigned long)W * H * (angle != NULL ? 3 : 2));
+  memFree(scratch, size);
+  if (dir != NULL) *dir = angle;
+  return res;
+}
+
+/// Gradient magnitude with the Sobel kernels
+///   gx: [-1 0 1; -2 0 2; -1 0 1]   gy: [-1 -2 -1; 0 0 0; 1 2 1]
+/// (See the description of edge detection in image8bit.h.)
+Image ImageSobel(Image img, int l2, Image* dir) {  ///
+  INSTR_SCOPE("ImageSobel");
+  assert(img != NULL);
+  return gradient(img, 0, l2, dir);
+}
+
+/// Gradient magnitude with the Scharr kernels, more accurate in direction
+///   gx: [-3 0 3; -10 0 10; -3 0 3]   gy: [-3 -10 -3; 0 0 0; 3 10 3]
+/// (See the description of edge detection in image8bit.h.)
+Image ImageScharr(Image img, int l2, Image* dir) {  ///
+  INSTR_SCOPE("ImageScharr");
+  assert(img != NULL);
+  return gradient(img, 1, l2, dir);
+}
+
+/// Connected components
+
+// Blobs are labeled in two passes.  The first scans the image row by row,
+// finding its runs (maximal horizontal segments of foreground pixels), and
+// compares them only with the runs of the previous row.  A run that touches
+// some of them takes the provisional label of the first, which is united
+// with the labels of the others (union-find, with path halving); otherwise,
+// it gets a new label.  Measures are accumulated per provisional label.
+// Each root is always linked to a smaller label, so the second pass can
+// resolve the labels in order, each from its parent, with no more finds,
+// and merge their measures.
+
+// A run of foreground pixels [x0, x1), with its provisional label
+typedef struct {
+  int x0, x1;
+  int label;
+} Run;
+
+// A provisional label: its parent in the union-find forest, and the
+// measures of its runs, with integer sums (exact, and cheaper than floating
+// point).  Its runs span columns [x0, x1) and end before row y1; the first
+// row is not kept: it is the row where the label was created (the smallest
+// label of a blob is created at its first row).
+typedef struct {
+  int parent;
+  int x0, x1, y1;
+  long area;
+  long sx, sy;  // sums of the columns and of the rows of the pixels
+} Label;
+
+// Provisional labels 1 .. count
+typedef struct {
+  int count;
+  size_t cap;
+  Label* label;
+} Provisional;
+
+// Root of label l, halving the path to it.
+static int labelFind(Label* label, int l) {
+  while (label[l].parent != l) {
+    label[l].parent = label[label[l].parent].parent;
+    l = label[l].parent;
+  }
+  return l;
+}
+
+// Unite the sets of labels a and b, linking the larger root to the smaller.
+// Returns 1 if they were different sets, 0 otherwise.
+static int labelUnion(Label* label, int a, int b) {
+  a = labelFind(label, a);
+  b = labelFind(label, b);
+  if (a < b) {
+    label[b].parent = a;
+  } else if (b < a) {
+    label[a].parent = b;
+  }
+  return a != b;
+}
+
+// A new provisional label in t, for run [x0, x1) of row y.
+// Returns 0 on allocation failure.
+static int provisionalNew(Provisional* t, int x0, int x1, int y) {
+  if ((size_t)t->count + 1 == t->cap) {
+    // Duplicar a capacidade, para ter custo amortizado constante
+    // (e os rótulos têm de caber num int)
+    if (t->count == INT_MAX) {
+      errno = ENOMEM;
+      errCause = "Too many blobs";
+      return 0;
+    }
+    size_t cap = 2 * t->cap > (size_t)INT_MAX + 1 ? (size_t)INT_MAX + 1
+                                                  : 2 * t->cap;
+    Label* label = memRealloc(t->label, t->cap * sizeof(Label),
+                              cap * sizeof(Label), "Label allocation failed");
+    if (label == NULL) return 0;
+    t->label = label;
+    t->cap = cap;
+  }
+  int l = ++t->count;
+  long len = x1 - x0;
+  t->label[l] = (Label){l, x0, x1, y + 1, len,
+                        (long)(x0 + x1 - 1) * len / 2,  // soma de x0 .. x1-1
+                        (long)y * len};
+  return l;
+}
+
+// Add run [x0, x1) of row y to the measures of label *a.
+static inline void accRun(Label* a, int x0, int x1, int y) {
+  long len = x1 - x0;
+  a->x0 = min(a->x0, x0);
+  a->x1 = max(a->x1, x1);
+  a->y1 = y + 1;  // (as linhas são percorridas por ordem)
+  a->area += len;
+  a->sx += (long)(x0 + x1 - 1) * len / 2;
+  a->sy += (long)y * len;
+}
+
+// Merge the measures of label *a, created at row y, into blob *b (empty, if
+// a is the first label of the blob).  The corners of the bounding box are
+// kept in (x, y) and (w, h), and the sums of the coordinates in (cx, cy).
+static void accMerge(Blob* b, const Label* a, int y) {
+  if (b->area == 0) {
+    *b = (Blob){a->area, a->x0, y, a->x1, a->y1, (double)a->sx,
+                (double)a->sy};
+    return;
+  }
+  b->x = min(b->x, a->x0);
+  b->w = max(b->w, a->x1);
+  b->h = max(b->h, a->y1);
+  b->area += a->area;
+  b->cx += (double)a->sx;
+  b->cy += (double)a->sy;
+}
+
+// Foreground mask of n <= 64 pixels at s: bit i is set if s[i] != 0.
+static inline uint64_t foreground(const uint8* s, int n) {
+  uint64_t m = 0;
+  int i = 0;
+#ifdef __SSE2__
+  __m128i zero = _mm_setzero_si128();
+  for (; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(s + i));
+    unsigned z = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero));
+    m |= (uint64_t)(~z & 0xFFFF) << i;
+  }
+#endif
+  for (; i < n; i++) m |= (uint64_t)(s[i] != 0) << i;
+  return m;
+}
+
+// Find the runs of a row (n pixels at s), into run (with room for
+// (n + 1) / 2).  Returns the number of runs.
+// The row is scanned 64 pixels at a time: the transitions between
+// background and foreground are the bits set in mask ^ (mask << 1), and
+// are visited with no branches per pixel.
+static int rowRuns(const uint8* s, int n, Run* run) {
+  int k = 0;
+  uint64_t last = 0;  // o pixel anterior é do primeiro plano?
+  int open = 0;       // há um run por fechar?
+  for (int x = 0; x < n; x += 64) {
+    int len = n - x < 64 ? n - x : 64;
+    uint64_t m = foreground(s + x, len);
+    uint64_t t = m ^ (m << 1 | last);
+    last = m >> 63;
+    while (t != 0) {
+      int b = x + __builtin_ctzll(t);
+      t &= t - 1;
+      if (!open) {
+        run[k].x0 = b;
+      } else {
+        run[k++].x1 = b;
+      }
+      open = !open;
+    }
+  }
+  if (open) run[k++].x1 = n;
+  return k;
+}
+
+/// Label the connected components (blobs) of the foreground (nonzero)
+/// pixels of img, with connectivity 4 or 8, and measure them.
+/// Blobs are labeled from 1, in raster order of their first pixel.
+/// If labels is not NULL, it must have room for width*height ints, and is
+/// set to the label of each pixel, row by row (0 for the background).
+/// On success, returns 1 and sets *list (release it with ImageBlobsFree).
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImageBlobs(Image img, int connectivity, int* labels, BlobList* list) {  ///
+  INSTR_SCOPE("ImageBlobs");
+  assert(img != NULL);
+  assert(connectivity == 4 || connectivity == 8);
+  assert(list != NULL);
+  int W = img->width, H = img->height;
+  // Runs em contacto com a linha anterior: sobrepostos, ou em diagonal
+  int d = connectivity == 8 ? 1 : 0;
+
+  size_t rowsize = ((size_t)(W + 1) / 2 + 1) * sizeof(Run);
+  Run* prev = memAlloc(rowsize, 0, 0, "Run allocation failed");
+  Run* cur = memAlloc(rowsize, 0, 0, "Run allocation failed");
+  // first[y]: o primeiro rótulo criado na linha y (ou depois)
+  int* first = memAlloc((H + 1) * sizeof(int), 0, 0, "Label allocation failed");
+  Provisional t = {0, 1024, NULL};
+  t.label = memAlloc(t.cap * sizeof(Label), 0, 0, "Label allocation failed");
+  int ok = prev != NULL && cur != NULL && first != NULL && t.label != NULL;
+
+  // 1ª passagem: runs, rótulos provisórios e medidas
+  if (ok) prev[0] = (Run){W + 2, W + 2, 0};  // linha anterior vazia
+  int unions = 0;
+  for (int y = 0; ok && y < H; y++) {
+    first[y] = t.count + 1;
+    int ncur = rowRuns(img->pixel + (size_t)y * W, W, cur);
+    int* row = labels == NULL ? NULL : labels + (size_t)y * W;
+    if (row != NULL) memset(row, 0, W * sizeof(int));
+    // Os runs das duas linhas estão ordenados: avançam juntos
+    int j = 0;
+    for (int c = 0; c < ncur; c++) {
+      int x0 = cur[c].x0, x1 = cur[c].x1;
+      while (prev[j].x1 + d <= x0) j++;
+      int label = 0;
+      if (prev[j].x0 < x1 + d) {
+        label = prev[j].label;
+        for (int i = j + 1; prev[i].x0 < x1 + d; i++) {
+          if (prev[i].label != label) {
+            unions += labelUnion(t.label, label, prev[i].label);
+          }
+        }
+      }
+      if (label != 0) {
+        accRun(&t.label[label], x0, x1, y);
+      } else if ((label = provisionalNew(&t, x0, x1, y)) == 0) {
+        ok = 0;
+        break;
+      }
+      cur[c].label = label;
+      if (row != NULL) {
+        for (int x = x0; x < x1; x++) row[x] = label;
+      }
+    }
+    cur[ncur] = (Run){W + 2, W + 2, 0};  // sentinela
+    Run* swap = prev;
+    prev = cur;
+    cur = swap;
+  }
+  if (ok) first[H] = t.count + 1;
+  PIXMEM((unsigned long)W * H);  // count pixel memory accesses
+
+  // 2ª passagem: rótulos finais (o pai de cada rótulo já tem o seu) e
+  // medidas dos blobs, cada um a começar pelo seu menor rótulo, criado na
+  // sua primeira linha
+  Blob* blob = NULL;
+  int count = ok ? t.count - unions : 0;
+  if (count > 0) {
+    blob = memAlloc((size_t)count * sizeof(Blob), 1, 0,
+                    "Blob allocation failed");
+    ok = blob != NULL;
+  }
+  if (ok) {
+    t.label[0].parent = 0;  // o fundo
+    int n = 0;
+    int y = 0;
+    for (int l = 1; l <= t.count; l++) {
+      int p = t.label[l].parent;
+      t.label[l].parent = p == l ? ++n : t.label[p].parent;
+      while (first[y + 1] <= l) y++;
+      accMerge(&blob[t.label[l].parent - 1], &t.label[l], y);
+    }
+    assert(n == count);
+    for (int i = 0; i < count; i++) {
+      Blob* b = &blob[i];
+      b->w -= b->x;
+      b->h -= b->y;
+      b->cx /= b->area;
+      b->cy /= b->area;
+    }
+    if (labels != NULL) {
+      size_t size = (size_t)W * H;
+      for (size_t i = 0; i < size; i++) labels[i] = t.label[labels[i]].parent;
+    }
+    list->count = count;
+    list->blob = blob;
+  }
 
+  errsave = errno;
+  memFree(t.label, t.cap * sizeof(Label));
+  memFree(first, (H + 1) * sizeof(int));
+  memFree(cur, rowsize);
+  memFree(prev, rowsize);
+  errno = errsave;
+  return ok;
+}
 
+/// Release the blobs of *list, and leave it empty.
+void ImageBlobsFree(BlobList* list) {  ///
+  assert(list != NULL);
+  memFree(list->blob, (size_t)list->count * sizeof(Blob));
+  list->count = 0;
+  list->blob = NULL;
+}
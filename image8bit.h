@@ -13,6 +13,8 @@
 #define IMAGE8BIT_H
 
 #include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
 
 // Type for pixel levels
 typedef uint8_t uint8;
@@ -20,6 +22,9 @@ typedef uint8_t uint8;
 // Maximum value you can store in a pixel (maximum maxval accepted)
 extern const uint8 PixMax;
 
+// Number of distinct pixel levels (PixMax+1), the size of a level map
+#define NUMLEVELS 256
+
 // Type Image is a pointer to image objects
 typedef struct image *Image;
 
@@ -33,12 +38,71 @@ typedef struct image *Image;
 ///
 /// After a successful operation, the result is not garanteed (it might be
 /// the previous error cause).  It is not meant to be used in that situation!
+/// Like errno, the error cause is per thread: it is the cause of the last
+/// failure in the calling thread.
 char* ImageErrMsg() ;
 
 /// Init Image library.  (Call once!)
 /// Currently, simply calibrate instrumentation and set names of counters.
 void ImageInit(void) ;
 
+/// Memory accounting
+
+/// All memory allocated by this module (image blocks, with structure and
+/// pixels, and scratch buffers, like the table of sums in ImageBlur) is
+/// accounted for, while in use.  (Free blocks in the raster pool are not.)
+/// (Pixels of images loaded with ImageLoadMapped are backed by the file,
+/// and are not counted.)
+typedef struct {
+  size_t current;       // bytes currently allocated
+  size_t peak;          // maximum of current since the last reset
+  unsigned long count;  // number of allocations since the last reset
+  size_t largest;       // largest allocation since the last reset
+  size_t limit;         // memory limit (0 = unlimited)
+} ImageMemInfo;
+
+/// Get memory statistics into *info.
+void ImageMemGet(ImageMemInfo* info) ;
+
+/// Reset memory statistics: peak to current, count and largest to zero.
+void ImageMemReset(void) ;
+
+/// Set a hard memory limit, in bytes (0 for unlimited).
+/// Creating (or loading) an image that would exceed the limit fails,
+/// with errno set to ENOMEM.  Scratch buffers are not limited, as the
+/// functions that use them cannot fail.
+void ImageMemSetLimit(size_t limit) ;
+
+/// Raster pool
+
+/// Each image (structure and pixels) is allocated in a single block.
+/// Blocks come in size classes, and the blocks of destroyed images are kept
+/// in a pool, to be reused by new images of the same class, so that creating
+/// and destroying many images of similar sizes is cheap.
+typedef struct {
+  size_t bytes;          // bytes in free blocks, kept in the pool
+  size_t capacity;       // maximum bytes kept in the pool
+  unsigned long hits;    // blocks reused from the pool
+  unsigned long misses;  // blocks allocated (the pool had none)
+} ImagePoolInfo;
+
+/// Pre-allocate count blocks for width x height images, and keep them in
+/// the pool, with their pages already faulted in.
+/// The pool capacity is increased, if needed, to keep them.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImagePoolPrewarm(int width, int height, int count) ;
+
+/// Release free blocks of the pool, until at most keep bytes are left.
+void ImagePoolTrim(size_t keep) ;
+
+/// Set the maximum bytes of free blocks kept in the pool (default 64 MiB).
+/// Use 0 to disable the pool.
+void ImagePoolSetCapacity(size_t capacity) ;
+
+/// Get pool statistics into *info.
+void ImagePoolGet(ImagePoolInfo* info) ;
+
 /// Image management functions
 
 /// Create a new black image.
@@ -58,6 +122,24 @@ Image ImageCreate(int width, int height, uint8 maxval) ;
 /// Should never fail, and should preserve global errno/errCause.
 void ImageDestroy(Image* imgp) ;
 
+/// Copy-on-write clones
+
+/// Create a clone of image img, sharing its pixels.
+/// The pixels are copied only when either image is first modified
+/// (copy-on-write), so cloning costs the same for any image size, and
+/// memory grows with the distinct pixel data, not the number of images.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageClone(Image img) ;
+
+/// Give img its own copy of its pixels, if they are shared with a clone.
+/// The operations that modify an image do this first, as needed.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set accordingly
+/// (and img still shares its pixels).
+int ImageUnshare(Image img) ;
+
 /// PGM file operations
 
 /// Load a raw PGM file.
@@ -67,12 +149,107 @@ void ImageDestroy(Image* imgp) ;
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageLoad(const char* filename) ;
 
+/// Load a raw PGM file by mapping it into memory.
+/// Only 8 bit PGM files are accepted.
+/// Pixels are not read now, but paged in from the file when first accessed,
+/// so loading is immediate and pixels that are never accessed cost no memory.
+/// The mapping is private: modifying the image does not modify the file.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageLoadMapped(const char* filename) ;
+
 /// Save image to PGM file.
+/// The file is saved atomically (see ImageSetSync).
 /// On success, returns nonzero.
 /// On failure, returns 0, errno/errCause are set appropriately, and
-/// a partial and invalid file may be left in the system.
+/// the file is left unchanged.
 int ImageSave(Image img, const char* filename) ;
 
+/// Set whether saving a file waits for its data to reach the disk.
+/// Files are saved (by ImageSave, ImageSaveTiled and ImageSaveCompressed)
+/// to a temporary file in the same directory, which is then renamed to the
+/// destination, so other processes never find a partially written file.
+/// If sync is nonzero (the default), the data is also flushed to the disk
+/// (fsync) before the rename, so that a saved file survives a crash.
+/// Disable it for scratch files, where throughput matters more.
+void ImageSetSync(int sync) ;
+
+/// PGM streams
+
+/// A stream of raw PGM images (frames) back-to-back, as read from a pipe
+/// or written to one.
+
+/// Read the next image (frame) from a stream of raw PGM images in file f.
+/// If (*imgp) is an image of the same size, its pixels are reused (the
+/// frame is read into them); otherwise, (*imgp) is destroyed (if not NULL)
+/// and replaced by a new image.  So, for a stream of frames of equal size:
+///   Image frame = NULL;
+///   while (ImageReadFrame(stdin, &frame) > 0) { ...process frame... }
+///   ImageDestroy(&frame);
+/// reads every frame into the same pixels.
+/// Returns 1 if a frame was read into (*imgp), or 0 at the end of the
+/// stream ((*imgp) is left unchanged).
+/// On failure, returns -1, (*imgp) is destroyed, and errno/errCause are set
+/// accordingly.
+int ImageReadFrame(FILE* f, Image* imgp) ;
+
+/// Write image img as the next frame of a stream of raw PGM images in f.
+/// The stream is not flushed.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImageWriteFrame(Image img, FILE* f) ;
+
+/// Tiled image files
+
+/// A tiled image file (.imt) stores an image in rectangular tiles, each
+/// optionally compressed, with an index of the tiles in its header, so
+/// that a region of a large image can be loaded without reading the rest.
+
+/// Save image to a tiled image file, with tiles of tile x tile pixels.
+/// If compress is nonzero, tiles are compressed (run-length encoding),
+/// where that saves space.
+/// Requires: tile > 0.
+/// The file is saved atomically (see ImageSetSync).
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// the file is left unchanged.
+int ImageSaveTiled(Image img, const char* filename, int tile, int compress) ;
+
+/// Load a tiled image file.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageLoadTiled(const char* filename) ;
+
+/// Load rectangle (x, y, w, h) of the image in a tiled image file.
+/// Only the tiles that intersect the rectangle are read, so this costs
+/// in proportion to the rectangle, not to the whole image.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure (including a rectangle not inside the image), returns NULL
+/// and errno/errCause are set accordingly.
+Image ImageLoadRegion(const char* filename, int x, int y, int w, int h) ;
+
+/// Compressed image files
+
+/// A compressed image file (.imz) stores an image with a fast lossless
+/// codec for 8-bit grayscale: each pixel is predicted from its neighbours,
+/// and the prediction errors are Rice coded, in blocks of 32 pixels.
+
+/// Save image to a compressed image file.
+/// The file is saved atomically (see ImageSetSync).
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// the file is left unchanged.
+int ImageSaveCompressed(Image img, const char* filename) ;
+
+/// Load a compressed image file.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageLoadCompressed(const char* filename) ;
+
 /// Information queries
 
 /// These functions do not modify the image and never fail.
@@ -112,12 +289,50 @@ uint8 ImageGetPixel(Image img, int x, int y) ;
 /// Set the pixel at position (x,y) to new level.
 void ImageSetPixel(Image img, int x, int y, uint8 level) ;
 
+/// Bulk pixel access
+
+/// These copy whole rows or rectangles of pixels between an image and a
+/// buffer of the caller, checking the arguments once per call, instead of
+/// once per pixel.  They are much faster than loops of ImageGetPixel and
+/// ImageSetPixel, and should be preferred for processing many pixels.
+/// Pixels are stored row by row in the buffers.
+
+/// Copy row y of img into buf (ImageWidth(img) levels).
+/// Requires: 0 <= y < ImageHeight(img).
+void ImageGetRow(Image img, int y, uint8* buf) ;
+
+/// Set row y of img from buf (ImageWidth(img) levels).
+/// Requires: 0 <= y < ImageHeight(img).
+void ImageSetRow(Image img, int y, const uint8* buf) ;
+
+/// Copy rectangle (x, y, w, h) of img into buf.
+/// Row i of the rectangle is copied to buf[i*stride .. i*stride+w-1].
+/// Requires: the rectangle must be inside img, and stride >= w.
+void ImageReadRect(Image img, int x, int y, int w, int h,
+                   uint8* buf, int stride) ;
+
+/// Copy buf into rectangle (x, y, w, h) of img.
+/// Row i of the rectangle is copied from buf[i*stride .. i*stride+w-1].
+/// Requires: the rectangle must be inside img, and stride >= w.
+void ImageWriteRect(Image img, int x, int y, int w, int h,
+                    const uint8* buf, int stride) ;
+
+/// Get a read-only pointer to the pixels of row y (ImageWidth(img) levels).
+/// The pointer is valid only until img is next modified or destroyed: the
+/// pixels may be shared with clones (see ImageClone), and modifying img
+/// unshares them, so the pointer may then refer to a clone's pixels or to
+/// freed memory.  Accesses through it are not counted.
+/// Requires: 0 <= y < ImageHeight(img).
+const uint8* ImageRowPtr(Image img, int y) ;
+
 /// Pixel transformations
 
 /// These functions modify the pixel levels in an image, but do not change
 /// pixel positions or image geometry in any way.
-/// All of these functions modify the image in-place: no allocation involved.
-/// They never fail.
+/// All of these functions modify the image in-place: no allocation involved,
+/// except to unshare pixels shared with a clone (see ImageClone).
+/// They never fail, except if unsharing fails (then the image is left
+/// unchanged; call ImageUnshare first to detect that).
 
 /// Transform image to negative image.
 /// This transforms dark pixels to light pixels and vice-versa,
@@ -135,6 +350,77 @@ void ImageThreshold(Image img, uint8 thr) ;
 /// darken the image if factor<1.0.
 void ImageBrighten(Image img, double factor) ;
 
+/// Level maps
+
+/// A level map is an array of NUMLEVELS levels: pixels with level v are
+/// transformed to level map[v].
+/// All the pixel transformations above are level mappings, so a sequence of
+/// them may be composed into a single map and then applied to the image in a
+/// single pass (with ImageMapLevels), instead of one pass per transformation.
+/// The ImageLevels* functions compose a transformation AFTER the given map,
+/// producing exactly the same levels as the corresponding Image* function.
+
+/// Set map to the identity mapping (map[v] == v).
+void ImageLevelsIdentity(uint8 map[]) ;
+
+/// Compose the negative transformation (see ImageNegative) after map.
+void ImageLevelsNegative(uint8 map[], int maxval) ;
+
+/// Compose the threshold transformation (see ImageThreshold) after map.
+void ImageLevelsThreshold(uint8 map[], int maxval, uint8 thr) ;
+
+/// Compose the brighten transformation (see ImageBrighten) after map.
+/// Requires: factor >= 0.0.
+void ImageLevelsBrighten(uint8 map[], int maxval, double factor) ;
+
+/// Apply level map to image.
+/// Each pixel level v is replaced by map[v], in-place.
+void ImageMapLevels(Image img, const uint8 map[]) ;
+
+/// Histograms
+
+/// These functions choose a level transformation from the histogram of an
+/// image, so they cost two passes over it: one to compute the histogram,
+/// and one to apply the level map.  Like the other ImageLevels* functions,
+/// ImageLevelsEqualize and ImageLevelsStretch compose after map; hist must
+/// be the histogram of the levels that map produces.
+
+/// Compute the histogram of img: hist[v] is set to the number of pixels
+/// with level v (for all v < NUMLEVELS).
+void ImageHistogram(Image img, unsigned long hist[]) ;
+
+/// Compose histogram equalization after map: each level v goes to maxval
+/// times the fraction of the pixels with levels above the lowest one and
+/// up to v, so that the levels are spread evenly over [0, maxval].
+/// If all pixels have the same level, nothing changes.
+void ImageLevelsEqualize(uint8 map[], int maxval, const unsigned long hist[]) ;
+
+/// Compose a contrast stretch after map: the levels in [lo, hi] are
+/// stretched linearly to [0, maxval], where lo and hi are the lowest and
+/// highest levels once pct% of the pixels are discarded on each end (those
+/// outside saturate).  If lo >= hi, nothing changes.
+/// Requires: 0.0 <= pct < 50.0.
+void ImageLevelsStretch(uint8 map[], int maxval, const unsigned long hist[],
+                        double pct) ;
+
+/// The threshold that best separates the levels of histogram hist into two
+/// classes (Otsu's method: maximum variance between the classes below and
+/// at or above it), to use with ImageThreshold.
+/// If all pixels have the same level, returns that level.
+uint8 ImageOtsuLevel(const unsigned long hist[]) ;
+
+/// Equalize the histogram of img (see ImageLevelsEqualize).
+void ImageEqualize(Image img) ;
+
+/// Apply threshold to image, at the level chosen by ImageOtsuLevel.
+/// Returns that level.
+uint8 ImageAutoThreshold(Image img) ;
+
+/// Stretch the contrast of img, ignoring pct% of the pixels at each end
+/// (see ImageLevelsStretch).
+/// Requires: 0.0 <= pct < 50.0.
+void ImageAutoContrast(Image img, double pct) ;
+
 /// Geometric transformations
 
 /// These functions apply geometric transformations to an image,
@@ -172,23 +458,77 @@ Image ImageMirror(Image img) ;
 /// Ensures:
 ///   The original img is not modified.
 ///   The returned image has width w and height h.
+/// Cropping the whole image returns a clone (see ImageClone).
 /// 
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageCrop(Image img, int x, int y, int w, int h) ;
 
+/// Interpolation modes, for resampling an image
+typedef enum {
+  InterpNearest,    // the nearest pixel
+  InterpBilinear,   // linear interpolation of the 2x2 nearest pixels
+  InterpArea,       // mean of the pixels covered (only for ImageResize)
+} Interp;
+
+/// Resize an image to w x h pixels.
+/// mode is one of:
+///   InterpNearest: fastest, but blocky (and aliased when reducing).
+///   InterpBilinear: smooth, for enlarging or reducing by less than 2x.
+///   InterpArea: each output pixel is the mean of the area it covers,
+///     weighted; the best for reducing (thumbnails).  Reducing by exactly
+///     2x or 4x takes a faster path, with the same result.
+/// Requires: w >= 0, h >= 0, and img must not be empty, unless the result
+/// is.
+/// Ensures: The original img is not modified.
+/// Resizing to the same size returns a clone (see ImageClone).
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageResize(Image img, int w, int h, Interp mode) ;
+
+/// Apply an affine transform to an image, producing a w x h image.
+/// matrix maps each output pixel (x, y) to source coordinates
+///   sx = m[0]*x + m[1]*y + m[2],  sy = m[3]*x + m[4]*y + m[5]
+/// (the inverse of the transform of the image), with pixel centres at
+/// integer coordinates.  Source pixels are interpolated according to mode:
+/// InterpNearest or InterpBilinear.  Output pixels that map outside img
+/// are black (0).
+/// Requires: w >= 0, h >= 0, and all source coordinates must be within
+/// +-2^30.
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageAffine(Image img, const double matrix[6], int w, int h,
+                  Interp mode) ;
+
+/// Rotate an image by an arbitrary angle, in degrees, anti-clockwise,
+/// about its centre.  The result is just large enough to contain the whole
+/// rotated image; the corners outside it are black (0).
+/// mode is InterpNearest or InterpBilinear (see ImageAffine).
+/// Multiples of 90 degrees are exact (but ImageRotate is faster).
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageRotateAngle(Image img, double degrees, Interp mode) ;
+
 /// Operations on two images
 
 /// Paste an image into a larger image.
 /// Paste img2 into position (x, y) of img1.
-/// This modifies img1 in-place: no allocation involved.
+/// This modifies img1 in-place (see ImageUnshare).
 /// Requires: img2 must fit inside img1 at position (x, y).
 void ImagePaste(Image img1, int x, int y, Image img2) ;
 
 /// Blend an image into a larger image.
 /// Blend img2 into position (x, y) of img1.
-/// This modifies img1 in-place: no allocation involved.
+/// This modifies img1 in-place (see ImageUnshare).
 /// Requires: img2 must fit inside img1 at position (x, y).
 /// alpha usually is in [0.0, 1.0], but values outside that interval
 /// may provide interesting effects.  Over/underflows should saturate.
@@ -210,7 +550,65 @@ int ImageLocateSubImage(Image img1, int* px, int* py, Image img2) ;
 /// Blur an image by a applying a (2dx+1)x(2dy+1) mean filter.
 /// Each pixel is substituted by the mean of the pixels in the rectangle
 /// [x-dx, x+dx]x[y-dy, y+dy].
-/// The image is changed in-place.
+/// The image is changed in-place (see ImageUnshare).
 void ImageBlur(Image img, int dx, int dy) ;
 
+/// Edge detection
+
+/// These compute the gradient of img with 3x3 kernels, and return a new
+/// image with its magnitude, per pixel: |gx| + |gy| (L1, faster) if l2 is 0,
+/// or sqrt(gx^2 + gy^2) (L2) otherwise, saturated at the maxval of img.
+/// The magnitude is not normalized: for Sobel, a step of 1 level between
+/// two regions gives 4 (and up to 8, L1, at diagonal corners); for Scharr,
+/// 16.  Pixels outside the image replicate the nearest pixel (as in
+/// ImageBlur, only pixels of the image count), so borders are not edges.
+/// If dir is not NULL, *dir is set to a new image with the direction of
+/// the gradient (towards higher levels): level 0 is right, 64 up, 128 left
+/// and 192 down (and 0 where there is no gradient).
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned images!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+
+/// Gradient magnitude with the Sobel kernels
+///   gx: [-1 0 1; -2 0 2; -1 0 1]   gy: [-1 -2 -1; 0 0 0; 1 2 1]
+Image ImageSobel(Image img, int l2, Image* dir) ;
+
+/// Gradient magnitude with the Scharr kernels, more accurate in direction
+///   gx: [-3 0 3; -10 0 10; -3 0 3]   gy: [-3 -10 -3; 0 0 0; 3 10 3]
+Image ImageScharr(Image img, int l2, Image* dir) ;
+
+/// Connected components
+
+/// A connected component (blob) of the foreground pixels of an image
+typedef struct {
+  long area;        // number of pixels
+  int x, y, w, h;   // bounding box
+  double cx, cy;    // centroid
+} Blob;
+
+/// The blobs of an image: blob[i] is the blob with label i + 1
+typedef struct {
+  int count;        // number of blobs
+  Blob* blob;
+} BlobList;
+
+/// Label the connected components (blobs) of the foreground (nonzero)
+/// pixels of img, with connectivity 4 or 8, and measure them.
+/// Blobs are labeled from 1, in raster order of their first pixel.
+/// If labels is not NULL, it must have room for width*height ints, and is
+/// set to the label of each pixel, row by row (0 for the background).
+/// Time is linear in the number of pixels and of runs (horizontal segments
+/// of foreground pixels).  On one core (2.1 GHz, nothing else running), a
+/// 100 Mpixel image of shapes labels in 0.1-0.3 s.  Random noise is the
+/// worst case, with unpredictable runs and many labels: 0.6-0.8 s at 30-40%
+/// density, and more on a loaded machine or when labels is requested.
+/// On success, returns 1 and sets *list (release it with ImageBlobsFree).
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImageBlobs(Image img, int connectivity, int* labels, BlobList* list) ;
+
+/// Release the blobs of *list, and leave it empty.
+void ImageBlobsFree(BlobList* list) ;
+
 #endif
@@ -0,0 +1,779 @@
+// imageBench - Benchmark of the image8bit module.
+//
+// Times the public functions of image8bit.h on synthetic images of several
+// sizes, generated in-process (no image files needed).
+// Each function is run some warmup times, and then timed (with the monotonic
+// wall clock) a number of repetitions, to report the median and the 95th
+// percentile latency, and the throughput (MB/s of pixels processed, at the
+// median latency).
+// (Constant-time queries, like ImageWidth or ImageValidRect, are not timed
+// on their own: ImageGetPixel, ImageSetPixel and ImageValidPos are timed on
+// a sweep of all pixels.)
+//
+// With --codec DIR, it instead measures the compressed file format on the
+// PGM files in DIR: compression ratio, and encoding and decoding speed.
+//
+// Results may be saved as JSON lines, and compared against a baseline saved
+// before: functions whose best (minimum) time is slower than the baseline by
+// more than a threshold are reported as regressions, and the exit status
+// is 1.  (The minimum is much less sensitive than the median to
+// interference from other processes, which only adds time.)
+//
+// This program is part of a programming project
+// for the course AED, DETI / UA.PT
+
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include "error.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "image8bit.h"
+#include "instrumentation.h"
+
+static const char* USAGE =
+    "USAGE: imageBench [OPTION...]\n"
+    "  Time the functions of image8bit on synthetic square images.\n"
+    "\n"
+    "OPTIONS:\n"
+    "  --sizes N,...       Sides of the images (default 256,1024,4096)\n"
+    "  --reps N            Timed repetitions of each function (default 11)\n"
+    "  --warmup N          Untimed runs before timing (default 1)\n"
+    "  --only NAME         Only time functions whose name contains NAME\n"
+    "  --save FILE         Save results to FILE (JSON lines)\n"
+    "  --baseline FILE     Compare with results saved in FILE\n"
+    "  --threshold PCT     Report a regression if the best time is more than\n"
+    "                      PCT% slower than in the baseline (default 20)\n"
+    "  --codec DIR         Measure compression ratio and speed of the\n"
+    "                      compressed format on the PGM files in DIR\n"
+    ;
+
+// Images used by the benchmarks, for the current size
+static Image small;     // a subimage of the image (1/4 of each side)
+static Image patch;     // a 16x16 subimage from the bottom right corner
+static Image binary;    // the image thresholded (stripes with noisy edges)
+static char tmpname[64];  // a temporary PGM file with the image
+static char tiledname[72];  // a temporary tiled file with the image
+static char compname[72];   // a temporary compressed file with the image
+
+// Each benchmark runs one operation on img (of the current size), and
+// returns the number of pixels processed (for throughput).
+
+static long benchCreate(Image img) {
+  Image new = ImageCreate(ImageWidth(img), ImageHeight(img), PixMax);
+  if (new == NULL) error(2, errno, "ImageCreate: %s", ImageErrMsg());
+  ImageDestroy(&new);
+  return (long)ImageWidth(img) * ImageHeight(img);
+}
+
+// Churn: create, fill and destroy 64 tiles of 1/8 of each side, as a
+// pipeline of crops would (filled from the image, with ImageReadRect).
+static long benchChurn(Image img) {
+  int t = ImageWidth(img) / 8;
+  uint8* buf = malloc((size_t)t * t);
+  if (buf == NULL) error(2, errno, "Allocating buffer");
+  for (int i = 0; i < 64; i++) {
+    ImageReadRect(img, (i % 8) * t, (i / 8) * t, t, t, buf, t);
+    Image tile = ImageCreate(t, t, PixMax);
+    if (tile == NULL) error(2, errno, "ImageCreate: %s", ImageErrMsg());
+    ImageWriteRect(tile, 0, 0, t, t, buf, t);
+    ImageDestroy(&tile);
+  }
+  free(buf);
+  return (long)ImageWidth(img) * ImageHeight(img);
+}
+
+static long benchClone(Image img) {
+  Image new = ImageClone(img);
+  if (new == NULL) error(2, errno, "ImageClone: %s", ImageErrMsg());
+  ImageDestroy(&new);
+  return (long)ImageWidth(img) * ImageHeight(img);
+}
+
+// Clone and modify the clone: the pixels are copied on the first write.
+static long benchCloneWrite(Image img) {
+  Image new = ImageClone(img);
+  if (new == NULL) error(2, errno, "ImageClone: %s", ImageErrMsg());
+  ImageSetPixel(new, 0, 0, 0);
+  ImageDestroy(&new);
+  return (long)ImageWidth(img) * ImageHeight(img);
+}
+
+static long benchSave(Image img) {
+  if (!ImageSave(img, tmpname)) {
+    error(2, errno, "%s: %s", tmpname, ImageErrMsg());
+  }
+  return (long)ImageWidth(img) * ImageHeight(img);
+}
+
+static long benchLoad(Image img) {
+  Image new = ImageLoad(tmpname);
+  if (new == NULL) error(2, errno, "%s: %s", tmpname, ImageErrMsg());
+  ImageDestroy(&new);
+  return (long)ImageWidth(img) * ImageHeight(img);
+}
+
+static long benchLoadMapped(Image img) {
+  Image new = ImageLoadMapped(tmpname);
+  if (new == NULL) error(2, errno, "%s: %s", tmpname, ImageErrMsg());
+  ImageDestroy(&new);
+  return (long)ImageWidth(img) * ImageHeight(img);
+}
+
+// Read the image file as a frame into the pixels of img (same size)
+static long benchReadFrame(Image img) {
+  FILE* f = fopen(tmpname, "rb");
+  if (f == NULL || ImageReadFrame(f, &img) != 1) {
+    error(2, errno, "%s: %s", tmpname, ImageErrMsg());
+  }
+  fclose(f);
+  return (long)ImageWidth(img) * ImageHeight(img);
+}
+
+static long benchSaveTiled(Image img) {
+  if (!ImageSaveTiled(img, tiledname, 256, 1)) {
+    error(2, errno, "%s: %s", tiledname, ImageErrMsg());
+  }
+  return (long)ImageWidth(img) * ImageHeight(img);
+}
+
+static long benchLoadTiled(Image img) {
+  Image new = ImageLoadTiled(tiledname);
+  if (new == NULL) error(2, errno, "%s: %s", tiledname, ImageErrMsg());
+  ImageDestroy(&new);
+  return (long)ImageWidth(img) * ImageHeight(img);
+}
+
+// Load a 256x256 region from the middle: should take the same time for
+// any image size.
+static long benchLoadRegion(Image img) {
+  int s = ImageWidth(img) < 256 ? ImageWidth(img) : 256;
+  int x = (ImageWidth(img) - s) / 2, y = (ImageHeight(img) - s) / 2;
+  Image new = ImageLoadRegion(tiledname, x, y, s, s);
+  if (new == NULL) error(2, errno, "%s: %s", tiledname, ImageErrMsg());
+  ImageDestroy(&new);
+  return (long)s * s;
+}
+
+static long benchSaveCompressed(Image img) {
+  if (!ImageSaveCompressed(img, compname)) {
+    error(2, errno, "%s: %s", compname, ImageErrMsg());
+  }
+  return (long)ImageWidth(img) * ImageHeight(img);
+}
+
+static long benchLoadCompressed(Image img) {
+  Image new = ImageLoadCompressed(compname);
+  if (new == NULL) error(2, errno, "%s: %s", compname, ImageErrMsg());
+  ImageDestroy(&new);
+  return (long)ImageWidth(img) * ImageHeight(img);
+}
+
+static long benchStats(Image img) {
+  uint8 min = PixMax, max = 0;
+  ImageStats(img, &min, &max);
+  return (long)ImageWidth(img) * ImageHeight(img);
+}
+
+static long benchValidPos(Image img) {
+  int w = ImageWidth(img), h = ImageHeight(img);
+  volatile int valid = 0;  // volatile, to keep the loop
+  for (int y = 0; y < h; y++)
+    for (int x = 0; x < w; x++)
+      valid += ImageValidPos(img, x, y);
+  return (long)w * h;
+}
+
+static long benchGetPixel(Image img) {
+  int w = ImageWidth(img), h = ImageHeight(img);
+  volatile unsigned sum = 0;
+  for (int y = 0; y < h; y++)
+    for (int x = 0; x < w; x++)
+      sum += ImageGetPixel(img, x, y);
+  return (long)w * h;
+}
+
+static long benchSetPixel(Image img) {
+  int w = ImageWidth(img), h = ImageHeight(img);
+  for (int y = 0; y < h; y++)
+    for (int x = 0; x < w; x++)
+      ImageSetPixel(img, x, y, (uint8)(x ^ y));
+  return (long)w * h;
+}
+
+static long benchGetRow(Image img) {
+  int w = ImageWidth(img), h = ImageHeight(img);
+  uint8* row = malloc(w);
+  if (row == NULL) error(2, errno, "Allocating row");
+  for (int y = 0; y < h; y++) ImageGetRow(img, y, row);
+  free(row);
+  return (long)w * h;
+}
+
+static long benchSetRow(Image img) {
+  int w = ImageWidth(img), h = ImageHeight(img);
+  uint8* row = calloc(w, 1);
+  if (row == NULL) error(2, errno, "Allocating row");
+  for (int y = 0; y < h; y++) ImageSetRow(img, y, row);
+  free(row);
+  return (long)w * h;
+}
+
+static long benchReadRect(Image img) {
+  int w = ImageWidth(img) / 2, h = ImageHeight(img) / 2;
+  uint8* buf = malloc((size_t)w * h);
+  if (buf == NULL) error(2, errno, "Allocating buffer");
+  ImageReadRect(img, w / 2, h / 2, w, h, buf, w);
+  free(buf);
+  return (long)w * h;
+}
+
+static long benchWriteRect(Image img) {
+  int w = ImageWidth(img) / 2, h = ImageHeight(img) / 2;
+  uint8* buf = calloc((size_t)w * h, 1);
+  if (buf == NULL) error(2, errno, "Allocating buffer");
+  ImageWriteRect(img, w / 2, h / 2, w, h, buf, w);
+  free(buf);
+  return (long)w * h;
+}
+
+static long benchRowPtr(Image img) {
+  int w = ImageWidth(img), h = ImageHeight(img);
+  volatile unsigned sum = 0;
+  for (int y = 0; y < h; y++) {
+    const uint8* row = ImageRowPtr(img, y);
+    unsigned s = 0;
+    for (int x = 0; x < w; x++) s += row[x];
+    sum += s;
+  }
+  return (long)w * h;
+}
+
+static long benchNegative(Image img) {
+  ImageNegative(img);
+  return (long)ImageWidth(img) * ImageHeight(img);
+}
+
+static long benchThreshold(Image img) {
+  ImageThreshold(img, 128);
+  return (long)ImageWidth(img) * ImageHeight(img);
+}
+
+static long benchBrighten(Image img) {
+  ImageBrighten(img, 0.9);
+  return (long)ImageWidth(img) * ImageHeight(img);
+}
+
+static long benchMapLevels(Image img) {
+  uint8 map[NUMLEVELS];
+  ImageLevelsIdentity(map);
+  ImageLevelsNegative(map, ImageMaxval(img));
+  ImageLevelsBrighten(map, ImageMaxval(img), 1.1);
+  ImageMapLevels(img, map);
+  return (long)ImageWidth(img) * ImageHeight(img);
+}
+
+static long benchHistogram(Image img) {
+  unsigned long hist[NUMLEVELS];
+  ImageHistogram(img, hist);
+  return (long)ImageWidth(img) * ImageHeight(img);
+}
+
+static long benchEqualize(Image img) {
+  ImageEqualize(img);
+  return (long)ImageWidth(img) * ImageHeight(img);
+}
+
+static long benchRotate(Image img) {
+  Image new = ImageRotate(img);
+  if (new == NULL) error(2, errno, "ImageRotate: %s", ImageErrMsg());
+  ImageDestroy(&new);
+  return (long)ImageWidth(img) * ImageHeight(img);
+}
+
+static long benchMirror(Image img) {
+  Image new = ImageMirror(img);
+  if (new == NULL) error(2, errno, "ImageMirror: %s", ImageErrMsg());
+  ImageDestroy(&new);
+  return (long)ImageWidth(img) * ImageHeight(img);
+}
+
+static long benchCrop(Image img) {
+  int w = ImageWidth(img) / 2, h = ImageHeight(img) / 2;
+  Image new = ImageCrop(img, w / 2, h / 2, w, h);
+  if (new == NULL) error(2, errno, "ImageCrop: %s", ImageErrMsg());
+  ImageDestroy(&new);
+  return (long)w * h;
+}
+
+// Resize to w x h, in the given mode; returns the source pixels
+static long resize(Image img, int w, int h, Interp mode) {
+  Image new = ImageResize(img, w, h, mode);
+  if (new == NULL) error(2, errno, "ImageResize: %s", ImageErrMsg());
+  ImageDestroy(&new);
+  return (long)ImageWidth(img) * ImageHeight(img);
+}
+
+static long benchResizeHalf(Image img) {
+  return resize(img, ImageWidth(img) / 2, ImageHeight(img) / 2, InterpArea);
+}
+
+static long benchResizeArea(Image img) {
+  return resize(img, ImageWidth(img) * 3 / 10, ImageHeight(img) * 3 / 10,
+                InterpArea);
+}
+
+static long benchResizeBilinear(Image img) {
+  return resize(img, ImageWidth(img) * 3 / 4, ImageHeight(img) * 3 / 4,
+                InterpBilinear);
+}
+
+static long benchResizeNearest(Image img) {
+  return resize(img, ImageWidth(img) * 3 / 4, ImageHeight(img) * 3 / 4,
+                InterpNearest);
+}
+
+// Rotate by degrees, in the given mode; returns the source pixels
+static long rotateAngle(Image img, double degrees, Interp mode) {
+  Image new = ImageRotateAngle(img, degrees, mode);
+  if (new == NULL) error(2, errno, "ImageRotateAngle: %s", ImageErrMsg());
+  ImageDestroy(&new);
+  return (long)ImageWidth(img) * ImageHeight(img);
+}
+
+// A small angle, as when deskewing a scanned page
+static long benchRotateAngleNearest(Image img) {
+  return rotateAngle(img, 3.0, InterpNearest);
+}
+
+static long benchRotateAngleBilinear(Image img) {
+  return rotateAngle(img, 3.0, InterpBilinear);
+}
+
+// A steep angle: source rows are read almost vertically
+static long benchRotateAngleSteep(Image img) {
+  return rotateAngle(img, 80.0, InterpBilinear);
+}
+
+// Gradient magnitude (and direction, if dir) with Sobel or Scharr kernels
+static long edges(Image img, int scharr, int l2, int dir) {
+  Image angle = NULL;
+  Image new = scharr ? ImageScharr(img, l2, dir ? &angle : NULL)
+                     : ImageSobel(img, l2, dir ? &angle : NULL);
+  if (new == NULL) error(2, errno, "ImageSobel: %s", ImageErrMsg());
+  ImageDestroy(&angle);
+  ImageDestroy(&new);
+  return (long)ImageWidth(img) * ImageHeight(img);
+}
+
+static long benchSobelL1(Image img) {
+  return edges(img, 0, 0, 0);
+}
+
+static long benchSobelL2(Image img) {
+  return edges(img, 0, 1, 0);
+}
+
+static long benchSobelDir(Image img) {
+  return edges(img, 0, 1, 1);
+}
+
+static long benchScharrL2(Image img) {
+  return edges(img, 1, 1, 0);
+}
+
+static long benchBlobs(Image img) {
+  (void)img;
+  BlobList list;
+  if (!ImageBlobs(binary, 8, NULL, &list)) {
+    error(2, errno, "ImageBlobs: %s", ImageErrMsg());
+  }
+  ImageBlobsFree(&list);
+  return (long)ImageWidth(binary) * ImageHeight(binary);
+}
+
+static long benchPaste(Image img) {
+  ImagePaste(img, ImageWidth(img) / 2, ImageHeight(img) / 2, small);
+  return (long)ImageWidth(small) * ImageHeight(small);
+}
+
+static long benchBlend(Image img) {
+  ImageBlend(img, ImageWidth(img) / 2, ImageHeight(img) / 2, small, 0.5);
+  return (long)ImageWidth(small) * ImageHeight(small);
+}
+
+static long benchMatchSubImage(Image img) {
+  int x = ImageWidth(img) - ImageWidth(patch);
+  int y = ImageHeight(img) - ImageHeight(patch);
+  if (!ImageMatchSubImage(img, x, y, patch)) {
+    error(3, 0, "ImageMatchSubImage: patch not matched");
+  }
+  return (long)ImageWidth(patch) * ImageHeight(patch);
+}
+
+static long benchLocateSubImage(Image img) {
+  int x, y;
+  if (!ImageLocateSubImage(img, &x, &y, patch)) {
+    error(3, 0, "ImageLocateSubImage: patch not found");
+  }
+  return (long)ImageWidth(img) * ImageHeight(img);
+}
+
+static long benchBlur(Image img) {
+  ImageBlur(img, 3, 3);
+  return (long)ImageWidth(img) * ImageHeight(img);
+}
+
+typedef struct {
+  const char* name;
+  long (*run)(Image img);
+} Bench;
+
+static const Bench benches[] = {
+  {"ImageCreate", benchCreate},
+  {"ImageCreate/churn", benchChurn},
+  {"ImageClone", benchClone},
+  {"ImageClone/write", benchCloneWrite},
+  {"ImageSave", benchSave},
+  {"ImageLoad", benchLoad},
+  {"ImageLoadMapped", benchLoadMapped},
+  {"ImageReadFrame", benchReadFrame},
+  {"ImageSaveTiled", benchSaveTiled},
+  {"ImageLoadTiled", benchLoadTiled},
+  {"ImageLoadRegion", benchLoadRegion},
+  {"ImageSaveCompressed", benchSaveCompressed},
+  {"ImageLoadCompressed", benchLoadCompressed},
+  {"ImageStats", benchStats},
+  {"ImageValidPos", benchValidPos},
+  {"ImageGetPixel", benchGetPixel},
+  {"ImageSetPixel", benchSetPixel},
+  {"ImageGetRow", benchGetRow},
+  {"ImageSetRow", benchSetRow},
+  {"ImageReadRect", benchReadRect},
+  {"ImageWriteRect", benchWriteRect},
+  {"ImageRowPtr", benchRowPtr},
+  {"ImageNegative", benchNegative},
+  {"ImageThreshold", benchThreshold},
+  {"ImageBrighten", benchBrighten},
+  {"ImageMapLevels", benchMapLevels},
+  {"ImageHistogram", benchHistogram},
+  {"ImageEqualize", benchEqualize},
+  {"ImageRotate", benchRotate},
+  {"ImageMirror", benchMirror},
+  {"ImageCrop", benchCrop},
+  {"ImageResize/half", benchResizeHalf},
+  {"ImageResize/area", benchResizeArea},
+  {"ImageResize/bilinear", benchResizeBilinear},
+  {"ImageResize/nearest", benchResizeNearest},
+  {"ImageRotateAngle/nearest", benchRotateAngleNearest},
+  {"ImageRotateAngle/bilinear", benchRotateAngleBilinear},
+  {"ImageRotateAngle/steep", benchRotateAngleSteep},
+  {"ImagePaste", benchPaste},
+  {"ImageBlend", benchBlend},
+  {"ImageMatchSubImage", benchMatchSubImage},
+  {"ImageLocateSubImage", benchLocateSubImage},
+  {"ImageBlur", benchBlur},
+  {"ImageSobel/l1", benchSobelL1},
+  {"ImageSobel/l2", benchSobelL2},
+  {"ImageSobel/dir", benchSobelDir},
+  {"ImageScharr/l2", benchScharrL2},
+  {"ImageBlobs", benchBlobs},
+};
+
+#define NUMBENCHES (int)(sizeof(benches) / sizeof(benches[0]))
+
+// Create a synthetic image with side n: a gradient with some noise,
+// so that subimages are (almost surely) unique.
+static Image synthetic(int n) {
+  Image img = ImageCreate(n, n, PixMax);
+  if (img == NULL) error(2, errno, "ImageCreate: %s", ImageErrMsg());
+  unsigned seed = 12345;
+  for (int y = 0; y < n; y++) {
+    for (int x = 0; x < n; x++) {
+      seed = seed * 1103515245u + 12345u;
+      ImageSetPixel(img, x, y, (uint8)((x + y) / 4 + (seed >> 28)));
+    }
+  }
+  return img;
+}
+
+static int compareDoubles(const void* a, const void* b) {
+  double x = *(const double*)a, y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+// A result: the minimum, median and 95th percentile times (s), and MB/s
+typedef struct {
+  const char* name;
+  int size;
+  double min;
+  double median;
+  double p95;
+  double mbps;
+} Result;
+
+// Time benchmark b on img.
+static Result timeBench(const Bench* b, Image img, int warmup, int reps) {
+  double* t = malloc(reps * sizeof(double));
+  if (t == NULL) error(2, errno, "Allocating times");
+  long pixels = 0;
+  for (int r = 0; r < warmup; r++) b->run(img);
+  for (int r = 0; r < reps; r++) {
+    double start = wall_time();
+    pixels = b->run(img);
+    t[r] = wall_time() - start;
+  }
+  qsort(t, reps, sizeof(double), compareDoubles);
+  Result res = {b->name, ImageWidth(img), t[0], t[reps / 2], 0.0, 0.0};
+  int k = (95 * reps + 99) / 100;  // ceil(0.95*reps)
+  res.p95 = t[k - 1];
+  res.mbps = res.median > 0.0 ? pixels / res.median / 1e6 : 0.0;
+  free(t);
+  return res;
+}
+
+// Look up the minimum time of (name, size) in baseline file f.
+// Returns the time, or -1.0 if not found.
+static double baselineMin(FILE* f, const char* name, int size) {
+  char line[256];
+  rewind(f);
+  while (fgets(line, sizeof(line), f) != NULL) {
+    char bname[64];
+    int bsize;
+    double min;
+    if (sscanf(line, " {\"name\": \"%63[^\"]\", \"size\": %d, \"min\": %lf",
+               bname, &bsize, &min) == 3 &&
+        strcmp(bname, name) == 0 && bsize == size) {
+      return min;
+    }
+  }
+  return -1.0;
+}
+
+static int compareNames(const void* a, const void* b) {
+  return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// Size of file name, in bytes.
+static long fileSize(const char* name) {
+  struct stat st;
+  if (stat(name, &st) != 0) error(2, errno, "%s", name);
+  return (long)st.st_size;
+}
+
+// Measure the compressed format on each PGM file in dir: ratio of the
+// sizes, and best encoding and decoding throughput (MB/s of pixels).
+static void codecBench(const char* dir, int reps) {
+  DIR* d = opendir(dir);
+  if (d == NULL) error(2, errno, "%s", dir);
+  char** names = NULL;
+  int n = 0;
+  struct dirent* ent;
+  while ((ent = readdir(d)) != NULL) {
+    size_t len = strlen(ent->d_name);
+    if (len < 4 || strcmp(ent->d_name + len - 4, ".pgm") != 0) continue;
+    names = realloc(names, (n + 1) * sizeof(char*));
+    if (names == NULL) error(2, errno, "Allocating names");
+    names[n] = malloc(strlen(dir) + len + 2);
+    if (names[n] == NULL) error(2, errno, "Allocating names");
+    sprintf(names[n++], "%s/%s", dir, ent->d_name);
+  }
+  closedir(d);
+  if (n == 0) error(1, 0, "No PGM files in %s", dir);
+  qsort(names, n, sizeof(char*), compareNames);
+
+  printf("#%-29s\t%10s\t%10s\t%7s\t%10s\t%10s\n", "file", "pixels",
+         "bytes", "ratio", "enc MB/s", "dec MB/s");
+  long totalIn = 0, totalOut = 0;
+  double totalEnc = 0.0, totalDec = 0.0;
+  for (int i = 0; i < n; i++) {
+    Image img = ImageLoad(names[i]);
+    if (img == NULL) error(2, errno, "%s: %s", names[i], ImageErrMsg());
+    long pixels = (long)ImageWidth(img) * ImageHeight(img);
+    double enc = 1e30, dec = 1e30;
+    for (int r = 0; r < reps; r++) {
+      double start = wall_time();
+      benchSaveCompressed(img);
+      double mid = wall_time();
+      benchLoadCompressed(img);
+      double end = wall_time();
+      if (mid - start < enc) enc = mid - start;
+      if (end - mid < dec) dec = end - mid;
+    }
+    // Confirmar que a descompressão reproduz a imagem
+    Image back = ImageLoadCompressed(compname);
+    if (back == NULL) error(2, errno, "%s: %s", compname, ImageErrMsg());
+    if (ImageWidth(back) != ImageWidth(img) ||
+        ImageHeight(back) != ImageHeight(img) ||
+        (pixels > 0 && !ImageMatchSubImage(img, 0, 0, back))) {
+      error(3, 0, "%s: decoded image differs", names[i]);
+    }
+    ImageDestroy(&back);
+    long in = fileSize(names[i]), out = fileSize(compname);
+    printf("%-30s\t%10ld\t%10ld\t%7.3f\t%10.1f\t%10.1f\n", names[i], pixels,
+           out, (double)in / out, pixels / enc / 1e6, pixels / dec / 1e6);
+    fflush(stdout);
+    totalIn += in;
+    totalOut += out;
+    totalEnc += enc;
+    totalDec += dec;
+    ImageDestroy(&img);
+    free(names[i]);
+  }
+  free(names);
+  printf("# total: ratio %.3f, encoding %.1f MB/s, decoding %.1f MB/s\n",
+         (double)totalIn / totalOut, totalIn / totalEnc / 1e6,
+         totalIn / totalDec / 1e6);
+}
+
+int main(int argc, char* argv[]) {
+  program_name = argv[0];
+  char* sizes = "256,1024,4096";
+  int reps = 11;
+  int warmup = 1;
+  const char* only = NULL;
+  const char* save = NULL;
+  const char* baseline = NULL;
+  double threshold = 20.0;
+  const char* codec = NULL;
+
+  for (int k = 1; k < argc; k++) {
+    if (k + 1 >= argc) error(1, 0, "\n%s", USAGE);
+    if (strcmp(argv[k], "--sizes") == 0) {
+      sizes = argv[++k];
+    } else if (strcmp(argv[k], "--reps") == 0) {
+      if (sscanf(argv[++k], "%d", &reps) != 1 || reps < 1) {
+        error(1, 0, "Invalid repetitions: %s", argv[k]);
+      }
+    } else if (strcmp(argv[k], "--warmup") == 0) {
+      if (sscanf(argv[++k], "%d", &warmup) != 1 || warmup < 0) {
+        error(1, 0, "Invalid warmup: %s", argv[k]);
+      }
+    } else if (strcmp(argv[k], "--only") == 0) {
+      only = argv[++k];
+    } else if (strcmp(argv[k], "--save") == 0) {
+      save = argv[++k];
+    } else if (strcmp(argv[k], "--codec") == 0) {
+      codec = argv[++k];
+    } else if (strcmp(argv[k], "--baseline") == 0) {
+      baseline = argv[++k];
+    } else if (strcmp(argv[k], "--threshold") == 0) {
+      if (sscanf(argv[++k], "%lf", &threshold) != 1 || threshold < 0.0) {
+        error(1, 0, "Invalid threshold: %s", argv[k]);
+      }
+    } else {
+      error(1, 0, "\n%s", USAGE);
+    }
+  }
+
+  FILE* saveFile = NULL;
+  if (save != NULL && (saveFile = fopen(save, "w")) == NULL) {
+    error(2, errno, "%s", save);
+  }
+  FILE* baseFile = NULL;
+  if (baseline != NULL && (baseFile = fopen(baseline, "r")) == NULL) {
+    error(2, errno, "%s", baseline);
+  }
+
+  const char* tmpdir = getenv("TMPDIR");
+  if (tmpdir == NULL) tmpdir = "/tmp";
+  snprintf(tmpname, sizeof(tmpname), "%s/imageBenchXXXXXX", tmpdir);
+  int fd = mkstemp(tmpname);
+  if (fd < 0) error(2, errno, "%s", tmpname);
+  close(fd);
+  snprintf(tiledname, sizeof(tiledname), "%s.imt", tmpname);
+  snprintf(compname, sizeof(compname), "%s.imz", tmpname);
+  // Time the saves, not the disk: no fsync (see ImageSetSync)
+  ImageSetSync(0);
+
+  if (codec != NULL) {
+    codecBench(codec, reps);
+    unlink(compname);
+    unlink(tmpname);
+    return 0;
+  }
+
+  printf("#%-20s\t%6s\t%12s\t%12s\t%12s\t%10s", "function", "size",
+         "min(ms)", "median(ms)", "p95(ms)", "MB/s");
+  if (baseFile != NULL) printf("\t%10s", "vs base");
+  puts("");
+
+  int regressions = 0;
+  for (char* s = sizes; *s != '\0'; ) {
+    char* end;
+    long n = strtol(s, &end, 10);
+    if (end == s || n < 16 || n > 65536 || (*end != ',' && *end != '\0')) {
+      error(1, 0, "Invalid sizes: %s", sizes);
+    }
+    s = *end == ',' ? end + 1 : end;
+
+    Image img = synthetic((int)n);
+    small = ImageCrop(img, 0, 0, n / 4, n / 4);
+    patch = ImageCrop(img, n - 16, n - 16, 16, 16);
+    if (small == NULL || patch == NULL) {
+      error(2, errno, "ImageCrop: %s", ImageErrMsg());
+    }
+    binary = ImageClone(img);
+    if (binary == NULL) error(2, errno, "ImageClone: %s", ImageErrMsg());
+    ImageThreshold(binary, 128);
+    if (!ImageSave(img, tmpname)) {
+      error(2, errno, "%s: %s", tmpname, ImageErrMsg());
+    }
+    if (!ImageSaveTiled(img, tiledname, 256, 1)) {
+      error(2, errno, "%s: %s", tiledname, ImageErrMsg());
+    }
+    if (!ImageSaveCompressed(img, compname)) {
+      error(2, errno, "%s: %s", compname, ImageErrMsg());
+    }
+
+    for (int b = 0; b < NUMBENCHES; b++) {
+      if (only != NULL && strstr(benches[b].name, only) == NULL) continue;
+      // Operações que alteram a imagem usam uma cópia nova
+      Image copy = ImageClone(img);
+      if (copy == NULL || !ImageUnshare(copy)) {
+        error(2, errno, "ImageClone: %s", ImageErrMsg());
+      }
+      Result r = timeBench(&benches[b], copy, warmup, reps);
+      ImageDestroy(&copy);
+
+      printf("%-21s\t%6d\t%12.4f\t%12.4f\t%12.4f\t%10.1f", r.name, r.size,
+             1e3 * r.min, 1e3 * r.median, 1e3 * r.p95, r.mbps);
+      if (baseFile != NULL) {
+        double base = baselineMin(baseFile, r.name, r.size);
+        if (base > 0.0) {
+          double change = 100.0 * (r.min - base) / base;
+          int slower = change > threshold;
+          printf("\t%+9.1f%%%s", change, slower ? "  REGRESSION" : "");
+          regressions += slower;
+        } else {
+          printf("\t%10s", "-");
+        }
+      }
+      puts("");
+      fflush(stdout);
+      if (saveFile != NULL) {
+        fprintf(saveFile, "{\"name\": \"%s\", \"size\": %d, \"min\": %.9f, "
+                "\"median\": %.9f, \"p95\": %.9f, \"mbps\": %.3f}\n",
+                r.name, r.size, r.min, r.median, r.p95, r.mbps);
+      }
+    }
+
+    ImageDestroy(&binary);
+    ImageDestroy(&patch);
+    ImageDestroy(&small);
+    ImageDestroy(&img);
+  }
+
+  unlink(tmpname);
+  unlink(tiledname);
+  unlink(compname);
+  if (saveFile != NULL && fclose(saveFile) != 0) error(2, errno, "%s", save);
+  if (baseFile != NULL) {
+    fclose(baseFile);
+    printf("# %d regression(s) above %.1f%%\n", regressions, threshold);
+  }
+  return regressions > 0 ? 1 : 0;
+}
@@ -0,0 +1,43 @@
+#!/usr/bin/env python3
+# imageClient - A simple client for imageTool in server mode.
+#
+# Usage:
+#   ./imageTool --serve /tmp/imageTool.sock &
+#   ./imageClient.py /tmp/imageTool.sock "pgm/airfield-05_640x480.pgm keep A"
+#   ./imageClient.py /tmp/imageTool.sock "@A neg save neg.pgm" "@A info"
+#
+# Each argument after the socket path is sent as one request (a pipeline);
+# with no requests, they are read from stdin, one per line.
+# The reply to each request is printed: the output of its operations,
+# followed by a line "OK <latency> ms" or "ERR <message>".
+
+import socket
+import sys
+
+
+def main():
+    if len(sys.argv) < 2:
+        sys.exit("Usage: imageClient.py SOCKET [REQUEST...]")
+    requests = sys.argv[2:] or (line.strip() for line in sys.stdin)
+    sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    sock.connect(sys.argv[1])
+    replies = sock.makefile("r")
+    status = 0
+    for request in requests:
+        if not request:
+            continue
+        sock.sendall((request + "\n").encode())
+        for line in replies:
+            print(line, end="")
+            if line.startswith("OK"):
+                break
+            if line.startswith("ERR"):
+                status = 1
+                break
+    sock.sendall(b"quit\n")
+    sock.close()
+    sys.exit(status)
+
+
+if __name__ == "__main__":
+    main()
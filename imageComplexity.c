@@ -0,0 +1,273 @@
+// imageComplexity - Empirical complexity analysis of image8bit functions.
+//
+// Runs ImageBlur, ImageLocateSubImage and the geometric operations over
+// sweeps of image sizes and parameters, collecting the time and the
+// instrumentation counters of each run (see ImageInit), and fits the growth
+// exponent of each series: the slope b of the least squares line
+//   log(y) = a + b*log(x)
+// so that y ~ x^b.  For example, ImageRotate should have pixmem ~ pixels^1,
+// and ImageBlur should have exponent ~0 when only the window size varies.
+//
+// Output is CSV on stdout (one line per run), with the fits as comment lines
+// (starting with #), so it can be fed directly to a spreadsheet or plotter.
+//
+// This program is part of a programming project
+// for the course AED, DETI / UA.PT
+
+#include <assert.h>
+#include <errno.h>
+#include "error.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "image8bit.h"
+#include "instrumentation.h"
+
+static const char* USAGE =
+    "USAGE: imageComplexity [--max N] [--reps N]\n"
+    "  Sweep image8bit functions over sizes and parameters, up to side N\n"
+    "  (default 1024), and print counters, times and fitted exponents (CSV).\n"
+    "  Each run is repeated N times (default 3) and the minimum time kept.\n"
+    ;
+
+// Counters printed (indices in InstrCount, named by ImageInit)
+#define NUMCOUNT 4
+
+// Maximum number of points in a series
+#define MAXPOINTS 32
+
+// A series of runs of one operation, in one case, as x varies
+typedef struct {
+  const char* op;
+  const char* cas;
+  const char* xname;
+  int n;                                  // number of points
+  double x[MAXPOINTS];
+  double time[MAXPOINTS];
+  double count[NUMCOUNT][MAXPOINTS];
+} Series;
+
+static int reps = 3;
+
+static void beginSeries(Series* s, const char* op, const char* cas,
+                        const char* xname) {
+  s->op = op;
+  s->cas = cas;
+  s->xname = xname;
+  s->n = 0;
+}
+
+// Slope of the least squares line of log(y) on log(x), over the points with
+// y > 0.  Returns NAN if there are fewer than 2 such points (or x is const).
+static double fitExponent(int n, const double x[], const double y[]) {
+  double sx = 0.0, sy = 0.0, sxx = 0.0, sxy = 0.0;
+  int m = 0;
+  for (int i = 0; i < n; i++) {
+    if (y[i] <= 0.0) continue;
+    double lx = log(x[i]), ly = log(y[i]);
+    sx += lx;
+    sy += ly;
+    sxx += lx * lx;
+    sxy += lx * ly;
+    m++;
+  }
+  double d = m * sxx - sx * sx;
+  if (m < 2 || d <= 0.0) return NAN;
+  return (m * sxy - sx * sy) / d;
+}
+
+// Print the fitted exponents of series s.
+static void endSeries(Series* s) {
+  printf("# fit %s (%s) vs %s: time ~ x^%.2f", s->op, s->cas, s->xname,
+         fitExponent(s->n, s->x, s->time));
+  for (int c = 0; c < NUMCOUNT; c++) {
+    double b = fitExponent(s->n, s->x, s->count[c]);
+    if (!isnan(b)) printf(", %s ~ x^%.2f", InstrName[c], b);
+  }
+  printf("\n");
+  fflush(stdout);
+}
+
+// Function that runs one operation, on the images of a measurement
+typedef void (*Operation)(Image img1, Image img2, int param);
+
+// Run op (reps times) and add a point at x to series s.
+static void measure(Series* s, double x, Operation op, Image img1,
+                    Image img2, int param) {
+  assert(s->n < MAXPOINTS);
+  double best = INFINITY;
+  unsigned long count[NUMCOUNT];
+  for (int r = 0; r < reps; r++) {
+    InstrReset();
+    op(img1, img2, param);
+    double time = cpu_time() - InstrTime;
+    if (time < best) best = time;
+    for (int c = 0; c < NUMCOUNT; c++) count[c] = InstrTotal(c);
+  }
+  int i = s->n++;
+  s->x[i] = x;
+  s->time[i] = best;
+  printf("%s,%s,%d,%d,%d,%.0f,%.9f,%.9f", s->op, s->cas, ImageWidth(img1),
+         ImageHeight(img1), param, x, best, best / InstrCTU);
+  for (int c = 0; c < NUMCOUNT; c++) {
+    s->count[c][i] = (double)count[c];
+    printf(",%lu", count[c]);
+  }
+  printf("\n");
+}
+
+// Operations
+
+static void opBlur(Image img1, Image img2, int param) {
+  (void)img2;
+  ImageBlur(img1, param, param);
+}
+
+static void opLocate(Image img1, Image img2, int param) {
+  (void)param;
+  int x, y;
+  ImageLocateSubImage(img1, &x, &y, img2);
+}
+
+// Check allocation of img.
+static Image checked(Image img) {
+  if (img == NULL) error(2, errno, "%s", ImageErrMsg());
+  return img;
+}
+
+static void opRotate(Image img1, Image img2, int param) {
+  (void)img2; (void)param;
+  Image img = checked(ImageRotate(img1));
+  ImageDestroy(&img);
+}
+
+static void opMirror(Image img1, Image img2, int param) {
+  (void)img2; (void)param;
+  Image img = checked(ImageMirror(img1));
+  ImageDestroy(&img);
+}
+
+static void opCrop(Image img1, Image img2, int param) {
+  (void)img2; (void)param;
+  int w = ImageWidth(img1) / 2, h = ImageHeight(img1) / 2;
+  Image img = checked(ImageCrop(img1, w / 2, h / 2, w, h));
+  ImageDestroy(&img);
+}
+
+// Create a test image with side n: a pseudo-random texture.
+static Image texture(int n) {
+  Image img = checked(ImageCreate(n, n, PixMax));
+  unsigned seed = 2023;
+  for (int y = 0; y < n; y++) {
+    for (int x = 0; x < n; x++) {
+      seed = seed * 1103515245u + 12345u;
+      ImageSetPixel(img, x, y, (uint8)(seed >> 24));
+    }
+  }
+  return img;
+}
+
+// Sweep of sides: 64, 128, ..., max
+#define FOR_SIDES(n, min, max) for (int n = (min); n <= (max); n *= 2)
+
+int main(int argc, char* argv[]) {
+  program_name = argv[0];
+  int max = 1024;
+  for (int k = 1; k < argc; k += 2) {
+    if (k + 1 >= argc) error(1, 0, "\n%s", USAGE);
+    if (strcmp(argv[k], "--max") == 0) {
+      if (sscanf(argv[k + 1], "%d", &max) != 1 || max < 64) {
+        error(1, 0, "Invalid size: %s", argv[k + 1]);
+      }
+    } else if (strcmp(argv[k], "--reps") == 0) {
+      if (sscanf(argv[k + 1], "%d", &reps) != 1 || reps < 1) {
+        error(1, 0, "Invalid repetitions: %s", argv[k + 1]);
+      }
+    } else {
+      error(1, 0, "\n%s", USAGE);
+    }
+  }
+
+  ImageInit();
+
+  printf("op,case,width,height,param,x,time,caltime");
+  for (int c = 0; c < NUMCOUNT; c++) printf(",%s", InstrName[c]);
+  printf("\n");
+
+  Series s;
+
+  // Geometric operations: linear in the number of pixels
+  struct { const char* name; Operation op; } geom[] = {
+    {"rotate", opRotate}, {"mirror", opMirror}, {"crop", opCrop},
+  };
+  for (int g = 0; g < 3; g++) {
+    beginSeries(&s, geom[g].name, "square", "pixels");
+    FOR_SIDES(n, 64, max) {
+      Image img = texture(n);
+      measure(&s, (double)n * n, geom[g].op, img, NULL, 0);
+      ImageDestroy(&img);
+    }
+    endSeries(&s);
+  }
+
+  // Blur: linear in pixels, independent of the window size
+  beginSeries(&s, "blur", "dx=dy=3", "pixels");
+  FOR_SIDES(n, 64, max) {
+    Image img = texture(n);
+    measure(&s, (double)n * n, opBlur, img, NULL, 3);
+    ImageDestroy(&img);
+  }
+  endSeries(&s);
+
+  {
+    int n = max / 2;
+    Image img = texture(n);
+    beginSeries(&s, "blur", "side fixed", "window");
+    for (int d = 1; d <= n / 8; d *= 2) {
+      measure(&s, (double)(2 * d + 1) * (2 * d + 1), opBlur, img, NULL, d);
+    }
+    endSeries(&s);
+    ImageDestroy(&img);
+  }
+
+  // Locate, best case: the subimage is at the top left corner
+  beginSeries(&s, "locate", "best", "pixels");
+  FOR_SIDES(n, 64, max) {
+    Image img = texture(n);
+    Image sub = checked(ImageCrop(img, 0, 0, 8, 8));
+    measure(&s, (double)n * n, opLocate, img, sub, 8);
+    ImageDestroy(&sub);
+    ImageDestroy(&img);
+  }
+  endSeries(&s);
+
+  // Locate, worst case: a uniform image and a subimage that differs only in
+  // its last pixel, so every position is compared in full and fails
+  int maxWorst = max < 512 ? max : 512;
+  beginSeries(&s, "locate", "worst, sub 8x8", "pixels");
+  FOR_SIDES(n, 64, maxWorst) {
+    Image img = checked(ImageCreate(n, n, PixMax));
+    Image sub = checked(ImageCreate(8, 8, PixMax));
+    ImageSetPixel(sub, 7, 7, 1);
+    measure(&s, (double)n * n, opLocate, img, sub, 8);
+    ImageDestroy(&sub);
+    ImageDestroy(&img);
+  }
+  endSeries(&s);
+
+  {
+    Image img = checked(ImageCreate(maxWorst / 2, maxWorst / 2, PixMax));
+    beginSeries(&s, "locate", "worst, side fixed", "subpixels");
+    for (int m = 2; m <= maxWorst / 8; m *= 2) {
+      Image sub = checked(ImageCreate(m, m, PixMax));
+      ImageSetPixel(sub, m - 1, m - 1, 1);
+      measure(&s, (double)m * m, opLocate, img, sub, m);
+      ImageDestroy(&sub);
+    }
+    endSeries(&s);
+    ImageDestroy(&img);
+  }
+
+  return 0;
+}
@@ -0,0 +1,281 @@
+/// imageStore - A growable store of images with a memory budget.
+///
+/// This module is part of a programming project
+/// for the course AED, DETI / UA.PT
+///
+/// See imageStore.h for a description of the store.
+
+#include "imageStore.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// An entry of the store
+struct entry {
+  Image img;          // resident image (NULL if spilled, released or unset)
+  char* spill;        // name of spill file (NULL if not spilled)
+  size_t bytes;       // size of the pixel data
+  int refs;           // number of references
+  int pins;           // number of pins
+  unsigned long used; // time of last use (for LRU replacement)
+  int next;           // next free entry (if released)
+};
+
+// Internal structure of the store
+struct imageStore {
+  struct entry* entry;  // array of entries
+  int count;            // number of entries (alive or free)
+  int capacity;         // capacity of entry array
+  int free;             // first free (released) entry, -1 if none
+  int alive;            // number of entries alive
+  size_t budget;        // maximum resident bytes (0 = unlimited)
+  size_t resident;      // bytes of resident pixel data
+  size_t peak;          // maximum value of resident
+  unsigned long clock;  // logical clock, ticks on each use
+  int spills;           // number of images spilled
+  int reloads;          // number of images reloaded
+  const char* tmpdir;   // directory for spill files
+};
+
+/// Create a new empty store.
+ImageStore StoreCreate(size_t budget) {  ///
+  ImageStore st = malloc(sizeof(struct imageStore));
+  if (st == NULL) return NULL;
+  st->entry = NULL;
+  st->count = 0;
+  st->capacity = 0;
+  st->free = -1;
+  st->alive = 0;
+  st->budget = budget;
+  st->resident = 0;
+  st->peak = 0;
+  st->clock = 0;
+  st->spills = 0;
+  st->reloads = 0;
+  st->tmpdir = getenv("TMPDIR");
+  if (st->tmpdir == NULL) st->tmpdir = "/tmp";
+  return st;
+}
+
+// Release entry e: destroy its image and remove its spill file.
+static void release(ImageStore st, struct entry* e) {
+  if (e->img != NULL) {
+    st->resident -= e->bytes;
+    ImageDestroy(&e->img);
+  }
+  if (e->spill != NULL) {
+    unlink(e->spill);
+    free(e->spill);
+    e->spill = NULL;
+  }
+}
+
+/// Destroy the store pointed to by (*stp), with all its images.
+void StoreDestroy(ImageStore* stp) {  ///
+  assert(stp != NULL);
+  ImageStore st = *stp;
+  if (st == NULL) return;
+  for (int h = 0; h < st->count; h++) {
+    release(st, &st->entry[h]);
+  }
+  free(st->entry);
+  free(st);
+  *stp = NULL;
+}
+
+// Spill entry e to a new temporary file.
+// Returns nonzero on success, 0 on failure (e is left resident).
+static int spill(ImageStore st, struct entry* e) {
+  assert(e->img != NULL && e->spill == NULL);
+  size_t len = strlen(st->tmpdir) + sizeof("/imageStoreXXXXXX");
+  char* name = malloc(len);
+  if (name == NULL) return 0;
+  snprintf(name, len, "%s/imageStoreXXXXXX", st->tmpdir);
+  int fd = mkstemp(name);
+  FILE* f = fd < 0 ? NULL : fdopen(fd, "wb");
+  if (f == NULL) {
+    if (fd >= 0) {
+      close(fd);
+      unlink(name);
+    }
+    free(name);
+    return 0;
+  }
+  // A scratch file: written in place, without the atomic rename and fsync
+  // of ImageSave
+  int ok = ImageWriteFrame(e->img, f);
+  if (fclose(f) != 0 || !ok) {
+    unlink(name);
+    free(name);
+    return 0;
+  }
+  ImageDestroy(&e->img);
+  e->spill = name;
+  st->resident -= e->bytes;
+  st->spills++;
+  return 1;
+}
+
+// Spill least recently used unpinned entries (other than keep) until the
+// resident images fit the budget, or no more entries can be spilled.
+static void enforceBudget(ImageStore st, int keep) {
+  while (st->budget > 0 && st->resident > st->budget) {
+    struct entry* lru = NULL;
+    for (int h = 0; h < st->count; h++) {
+      struct entry* e = &st->entry[h];
+      if (h != keep && e->img != NULL && e->pins == 0 &&
+          (lru == NULL || e->used < lru->used)) {
+        lru = e;
+      }
+    }
+    if (lru == NULL || !spill(st, lru)) break;
+  }
+}
+
+// Account for a new resident image in entry h.
+static void resident(ImageStore st, int h) {
+  struct entry* e = &st->entry[h];
+  e->bytes = (size_t)ImageWidth(e->img) * ImageHeight(e->img);
+  e->used = ++st->clock;
+  st->resident += e->bytes;
+  if (st->resident > st->peak) st->peak = st->resident;
+  enforceBudget(st, h);
+}
+
+/// Set the memory budget (0 for unlimited).
+void StoreSetBudget(ImageStore st, size_t budget) {  ///
+  assert(st != NULL);
+  st->budget = budget;
+  enforceBudget(st, -1);
+}
+
+/// Number of entries alive (referenced or pinned).
+int StoreCount(ImageStore st) {  ///
+  assert(st != NULL);
+  return st->alive;
+}
+
+/// Add image img to the store (img may be NULL, to be set later).
+int StoreAdd(ImageStore st, Image img) {  ///
+  assert(st != NULL);
+  int h = st->free;
+  if (h >= 0) {
+    // Reutilizar uma entrada libertada
+    st->free = st->entry[h].next;
+  } else if (st->count == st->capacity) {
+    // Duplicar a capacidade, para ter custo amortizado constante
+    int capacity = st->capacity == 0 ? 16 : 2 * st->capacity;
+    struct entry* entry = realloc(st->entry, capacity * sizeof(struct entry));
+    if (entry == NULL) return -1;
+    st->entry = entry;
+    st->capacity = capacity;
+  }
+  if (h < 0) h = st->count++;
+  st->alive++;
+  struct entry* e = &st->entry[h];
+  e->img = NULL;
+  e->spill = NULL;
+  e->bytes = 0;
+  e->refs = 0;
+  e->pins = 1;
+  e->used = 0;
+  if (img != NULL) StoreSet(st, h, img);
+  return h;
+}
+
+/// Set the image of entry h, which must have none.
+void StoreSet(ImageStore st, int h, Image img) {  ///
+  assert(st != NULL);
+  assert(0 <= h && h < st->count);
+  assert(img != NULL);
+  struct entry* e = &st->entry[h];
+  assert(e->img == NULL && e->spill == NULL);
+  e->img = img;
+  resident(st, h);
+}
+
+/// Get the image of entry h, reloading it if it was spilled.
+Image StoreGet(ImageStore st, int h) {  ///
+  assert(st != NULL);
+  assert(0 <= h && h < st->count);
+  struct entry* e = &st->entry[h];
+  assert(e->refs > 0 || e->pins > 0);
+  if (e->img == NULL && e->spill != NULL) {
+    e->img = ImageLoadMapped(e->spill);
+    if (e->img == NULL) return NULL;
+    // O mapeamento mantém-se válido depois de apagar o ficheiro
+    unlink(e->spill);
+    free(e->spill);
+    e->spill = NULL;
+    st->reloads++;
+    resident(st, h);
+  }
+  e->used = ++st->clock;
+  return e->img;
+}
+
+// Release entry h if it has no references or pins left, and add it to the
+// free list.
+static void collect(ImageStore st, int h) {
+  struct entry* e = &st->entry[h];
+  if (e->refs == 0 && e->pins == 0) {
+    release(st, e);
+    e->next = st->free;
+    st->free = h;
+    st->alive--;
+  }
+}
+
+/// Add a reference to entry h.
+void StoreRef(ImageStore st, int h) {  ///
+  assert(st != NULL);
+  assert(0 <= h && h < st->count);
+  assert(st->entry[h].refs > 0 || st->entry[h].pins > 0);  // alive
+  st->entry[h].refs++;
+}
+
+/// Remove a reference from entry h, releasing it if no longer needed.
+void StoreUnref(ImageStore st, int h) {  ///
+  assert(st != NULL);
+  assert(0 <= h && h < st->count);
+  assert(st->entry[h].refs > 0);
+  st->entry[h].refs--;
+  collect(st, h);
+}
+
+/// Pin entry h (keep it resident).
+void StorePin(ImageStore st, int h) {  ///
+  assert(st != NULL);
+  assert(0 <= h && h < st->count);
+  assert(st->entry[h].refs > 0 || st->entry[h].pins > 0);  // alive
+  st->entry[h].pins++;
+}
+
+/// Unpin entry h, releasing it if no longer needed.
+void StoreUnpin(ImageStore st, int h) {  ///
+  assert(st != NULL);
+  assert(0 <= h && h < st->count);
+  assert(st->entry[h].pins > 0);
+  st->entry[h].pins--;
+  collect(st, h);
+}
+
+/// Get the number of images spilled and reloaded so far.
+void StoreGetCounts(ImageStore st, int* spills, int* reloads) {  ///
+  assert(st != NULL);
+  assert(spills != NULL && reloads != NULL);
+  *spills = st->spills;
+  *reloads = st->reloads;
+}
+
+/// Print statistics of store st, named name.
+void StorePrintStats(ImageStore st, const char* name) {  ///
+  assert(st != NULL);
+  printf("# Store %s: %d images, %zu bytes resident, %zu peak, "
+         "%d spills, %d reloads\n",
+         name, st->alive, st->resident, st->peak, st->spills, st->reloads);
+}
@@ -0,0 +1,86 @@
+/// imageStore - A growable store of images with a memory budget.
+///
+/// This module is part of a programming project
+/// for the course AED, DETI / UA.PT
+///
+/// The store holds any number of images, identified by a handle (a small
+/// integer: the handles of released entries are reused, so the store only
+/// grows to the maximum number of entries alive at the same time).
+/// Each entry counts references and pins:
+///   - an entry is released (and its image destroyed) as soon as it has no
+///     references and no pins left;
+///   - a pinned entry is always resident in memory;
+///   - when the resident images exceed the memory budget, the least recently
+///     used unpinned entries are spilled to a temporary raw file, and
+///     reloaded (by mapping the file into memory) when they are used again.
+///
+/// The budget is soft: if all resident entries are pinned, or if spilling
+/// fails, the images are kept in memory.
+
+#ifndef IMAGESTORE_H
+#define IMAGESTORE_H
+
+#include <stddef.h>
+
+#include "image8bit.h"
+
+// Type ImageStore is a pointer to store objects
+typedef struct imageStore *ImageStore;
+
+/// Create a new empty store.
+///   budget : maximum number of bytes of resident pixels (0 for unlimited).
+/// Spill files are created in directory $TMPDIR (or /tmp).
+/// On success, a new store is returned.
+/// (The caller is responsible for destroying the returned store!)
+/// On failure, returns NULL and errno is set accordingly.
+ImageStore StoreCreate(size_t budget) ;
+
+/// Destroy the store pointed to by (*stp), with all its images.
+/// If (*stp)==NULL, no operation is performed.
+/// Ensures: (*stp)==NULL.
+void StoreDestroy(ImageStore* stp) ;
+
+/// Set the memory budget (0 for unlimited).
+void StoreSetBudget(ImageStore st, size_t budget) ;
+
+/// Number of entries alive (referenced or pinned).
+int StoreCount(ImageStore st) ;
+
+/// Add image img to the store (img may be NULL, to be set later).
+/// The store takes ownership of img.  The new entry is pinned once.
+/// On success, returns the handle of the new entry (maybe the handle of a
+/// released entry).
+/// On failure, returns -1, errno is set and img is NOT owned by the store.
+int StoreAdd(ImageStore st, Image img) ;
+
+/// Set the image of entry h, which must have none.
+/// The store takes ownership of img.
+void StoreSet(ImageStore st, int h, Image img) ;
+
+/// Get the image of entry h, reloading it if it was spilled.
+/// Requires: entry h is alive (referenced or pinned).
+/// The image is valid until the next call that may spill it
+/// (StoreAdd, StoreSet or StoreGet), unless entry h is pinned.
+/// On failure, returns NULL and errno/ImageErrMsg() are set accordingly.
+Image StoreGet(ImageStore st, int h) ;
+
+/// Add a reference to entry h.
+void StoreRef(ImageStore st, int h) ;
+
+/// Remove a reference from entry h, releasing it if no longer needed.
+void StoreUnref(ImageStore st, int h) ;
+
+/// Pin entry h (keep it resident).
+void StorePin(ImageStore st, int h) ;
+
+/// Unpin entry h, releasing it if no longer needed.
+void StoreUnpin(ImageStore st, int h) ;
+
+/// Get the number of images spilled and reloaded so far.
+void StoreGetCounts(ImageStore st, int* spills, int* reloads) ;
+
+/// Print statistics of store st, named name (images alive, resident and
+/// peak bytes, spills, reloads).
+void StorePrintStats(ImageStore st, const char* name) ;
+
+#endif
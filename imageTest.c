@@ -15,13 +15,535 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include "image8bit.h"
+#include "imageStore.h"
 #include "instrumentation.h"
 
+// Self-checks.
+//
+// With --check, imageTest checks the library on generated images (no files
+// needed), instead of processing a file.  Each failed check is reported,
+// and the exit status is 1 if any failed.
+
+static int failures = 0;
+
+// Check that cond holds, reporting it if not.
+#define CHECK(cond) \
+  do { \
+    if (!(cond)) { \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+      failures++; \
+    } \
+  } while (0)
+
+// Create a w x h test image, with levels that depend on the position and on
+// seed (so that images with different seeds differ).
+static Image pattern(int w, int h, int seed) {
+  Image img = ImageCreate(w, h, 255);
+  if (img == NULL) error(2, errno, "Creating pattern: %s", ImageErrMsg());
+  for (int y = 0; y < h; y++) {
+    for (int x = 0; x < w; x++) {
+      ImageSetPixel(img, x, y, (uint8)(x * 7 + y * 13 + (x ^ y) + seed * 31));
+    }
+  }
+  return img;
+}
+
+// Do images img1 and img2 have the same size, maxval and pixels?
+static int sameImage(Image img1, Image img2) {
+  if (img1 == NULL || img2 == NULL) return 0;
+  if (ImageWidth(img1) != ImageWidth(img2) ||
+      ImageHeight(img1) != ImageHeight(img2) ||
+      ImageMaxval(img1) != ImageMaxval(img2)) {
+    return 0;
+  }
+  for (int y = 0; y < ImageHeight(img1); y++) {
+    for (int x = 0; x < ImageWidth(img1); x++) {
+      if (ImageGetPixel(img1, x, y) != ImageGetPixel(img2, x, y)) return 0;
+    }
+  }
+  return 1;
+}
+
+// A new temporary file name, in $TMPDIR (or /tmp).
+// (The caller must remove the file and free the name.)
+static char* tempName(void) {
+  const char* dir = getenv("TMPDIR");
+  if (dir == NULL) dir = "/tmp";
+  size_t len = strlen(dir) + sizeof("/imageTestXXXXXX");
+  char* name = malloc(len);
+  if (name == NULL) error(2, errno, "Temporary file name");
+  snprintf(name, len, "%s/imageTestXXXXXX", dir);
+  int fd = mkstemp(name);
+  if (fd < 0) error(2, errno, "Creating %s", name);
+  close(fd);
+  return name;
+}
+
+// Level maps: a composed map gives the same levels as the operations, one
+// at a time (the basis of the point operation fusion of imageTool).
+static void checkLevels(void) {
+  Image img = pattern(37, 23, 1);
+  Image ref = pattern(37, 23, 1);
+  uint8 map[NUMLEVELS];
+  ImageLevelsIdentity(map);
+  ImageLevelsNegative(map, 255);
+  ImageLevelsBrighten(map, 255, 1.3);
+  ImageLevelsThreshold(map, 255, 100);
+  ImageLevelsNegative(map, 255);
+  ImageLevelsBrighten(map, 255, 0.6);
+  ImageMapLevels(img, map);
+  ImageNegative(ref);
+  ImageBrighten(ref, 1.3);
+  ImageThreshold(ref, 100);
+  ImageNegative(ref);
+  ImageBrighten(ref, 0.6);
+  CHECK(sameImage(img, ref));
+  ImageDestroy(&img);
+  ImageDestroy(&ref);
+}
+
+// Histograms: Otsu separates two modes, equalization spreads two levels to
+// the ends, contrast stretching fills the range, and a constant image is
+// left unchanged.
+static void checkHistogram(void) {
+  enum { W = 60, H = 40 };
+  Image img = ImageCreate(W, H, 255);
+  for (int y = 0; y < H; y++) {
+    for (int x = 0; x < W; x++) {
+      ImageSetPixel(img, x, y, (uint8)(x < W / 2 ? 30 + (x + y) % 21
+                                                 : 190 + (x * y) % 21));
+    }
+  }
+  unsigned long hist[NUMLEVELS];
+  ImageHistogram(img, hist);
+  unsigned long total = 0;
+  for (int v = 0; v < NUMLEVELS; v++) total += hist[v];
+  CHECK(total == W * H);
+  uint8 thr = ImageOtsuLevel(hist);
+  CHECK(50 < thr && thr <= 190);
+
+  Image bin = ImageClone(img);
+  CHECK(ImageAutoThreshold(bin) == thr);
+  uint8 min = 255, max = 0;
+  ImageStats(bin, &min, &max);
+  CHECK(min == 0 && max == 255);
+  CHECK(ImageGetPixel(bin, 0, 0) == 0 && ImageGetPixel(bin, W - 1, 0) == 255);
+  ImageDestroy(&bin);
+
+  // Two levels go to the ends of the range
+  Image two = ImageCreate(W, H, 255);
+  for (int y = 0; y < H; y++) {
+    for (int x = 0; x < W; x++) ImageSetPixel(two, x, y, x % 2 ? 20 : 10);
+  }
+  ImageEqualize(two);
+  CHECK(ImageGetPixel(two, 0, 0) == 0 && ImageGetPixel(two, 1, 0) == 255);
+  ImageDestroy(&two);
+
+  Image stretch = ImageClone(img);
+  ImageAutoContrast(stretch, 0.0);
+  min = 255, max = 0;
+  ImageStats(stretch, &min, &max);
+  CHECK(min == 0 && max == 255);
+  ImageDestroy(&stretch);
+
+  Image flat = ImageCreate(W, H, 255);
+  for (int y = 0; y < H; y++) {
+    for (int x = 0; x < W; x++) ImageSetPixel(flat, x, y, 99);
+  }
+  ImageHistogram(flat, hist);
+  CHECK(hist[99] == W * H && ImageOtsuLevel(hist) == 99);
+  ImageEqualize(flat);
+  ImageAutoContrast(flat, 5.0);
+  min = 255, max = 0;
+  ImageStats(flat, &min, &max);
+  CHECK(min == 99 && max == 99);
+  ImageDestroy(&flat);
+  ImageDestroy(&img);
+}
+
+// Copy-on-write clones: sharing, and isolation of each image after a write.
+static void checkClone(void) {
+  enum { W = 200, H = 100 };
+  Image img = pattern(W, H, 2);
+  Image ref = pattern(W, H, 2);
+  ImageMemInfo before, after;
+  ImageMemGet(&before);
+  Image clone = ImageClone(img);
+  ImageMemGet(&after);
+  CHECK(clone != NULL);
+  if (clone == NULL) return;
+  CHECK(after.current - before.current < W * H);   // pixels are shared
+  CHECK(sameImage(clone, img));
+
+  // Writing to the clone leaves the original unchanged, and vice versa
+  ImageSetPixel(clone, 3, 4, ~ImageGetPixel(ref, 3, 4));
+  CHECK(sameImage(img, ref));
+  ImageNegative(img);
+  CHECK(ImageGetPixel(clone, 0, 0) == ImageGetPixel(ref, 0, 0));
+  CHECK(ImageGetPixel(clone, 3, 4) == (uint8)~ImageGetPixel(ref, 3, 4));
+  ImageNegative(img);
+  CHECK(sameImage(img, ref));
+
+  // Cropping the whole image gives a clone, too
+  Image crop = ImageCrop(img, 0, 0, W, H);
+  CHECK(crop != NULL && ImageUnshare(crop));
+  if (crop != NULL) ImageThreshold(crop, 128);
+  CHECK(sameImage(img, ref));
+  ImageDestroy(&crop);
+
+  // The shared pixels outlive the image they were cloned from
+  Image clone2 = ImageClone(img);
+  ImageDestroy(&img);
+  CHECK(sameImage(clone2, ref));
+  CHECK(ImageUnshare(clone2));   // not shared any longer: nothing to do
+  CHECK(sameImage(clone2, ref));
+  ImageDestroy(&clone2);
+  ImageDestroy(&clone);
+  ImageDestroy(&ref);
+}
+
+// Tiled image files: round trip, and regions equal to crops, for tiles that
+// do not divide the image, a tile larger than it, and compressed tiles.
+static void checkTiled(void) {
+  enum { W = 150, H = 97 };
+  Image img = pattern(W, H, 3);
+  Image flat = ImageCreate(W, H, 255);   // compressible
+  Image part = ImageCrop(img, 0, 0, 40, 30);
+  ImagePaste(flat, 10, 20, part);
+  ImageDestroy(&part);
+  char* name = tempName();
+  int tiles[] = {16, 64, 200};
+  for (int k = 0; k < 3; k++) {
+    for (int compress = 0; compress <= 1; compress++) {
+      Image src = compress ? flat : img;
+      CHECK(ImageSaveTiled(src, name, tiles[k], compress));
+      Image copy = ImageLoadTiled(name);
+      CHECK(sameImage(copy, src));
+      ImageDestroy(&copy);
+      int rect[][4] = {{17, 30, 70, 40}, {W - 5, H - 3, 5, 3}, {0, 0, W, H},
+                       {63, 63, 2, 2}};
+      for (int r = 0; r < 4; r++) {
+        int* q = rect[r];
+        Image region = ImageLoadRegion(name, q[0], q[1], q[2], q[3]);
+        Image crop = ImageCrop(src, q[0], q[1], q[2], q[3]);
+        CHECK(sameImage(region, crop));
+        ImageDestroy(&region);
+        ImageDestroy(&crop);
+      }
+      CHECK(ImageLoadRegion(name, W - 4, 0, 5, 1) == NULL);   // outside
+    }
+  }
+  unlink(name);
+  free(name);
+  ImageDestroy(&flat);
+  ImageDestroy(&img);
+}
+
+// Compressed image files: round trips of images that exercise the codec.
+static void checkCompressed(void) {
+  enum { N = 7 };
+  Image img[N];
+  img[0] = pattern(101, 67, 4);            // not a multiple of the blocks
+  img[1] = ImageCreate(64, 64, 255);       // constant
+  img[2] = ImageCreate(77, 51, 255);       // noise (incompressible)
+  img[3] = ImageCreate(40, 40, 255);       // largest prediction errors
+  img[4] = pattern(1, 1, 5);
+  img[5] = pattern(333, 1, 6);
+  img[6] = pattern(1, 90, 7);
+  unsigned seed = 1;
+  for (int y = 0; y < 51; y++) {
+    for (int x = 0; x < 77; x++) {
+      seed = seed * 1103515245u + 12345u;
+      ImageSetPixel(img[2], x, y, (uint8)(seed >> 24));
+    }
+  }
+  for (int y = 0; y < 40; y++) {
+    for (int x = 0; x < 40; x++) {
+      ImageSetPixel(img[3], x, y, (x + y / 3) % 2 ? 255 : 0);
+    }
+  }
+  char* name = tempName();
+  for (int i = 0; i < N; i++) {
+    CHECK(ImageSaveCompressed(img[i], name));
+    Image copy = ImageLoadCompressed(name);
+    CHECK(sameImage(copy, img[i]));
+    ImageDestroy(&copy);
+    ImageDestroy(&img[i]);
+  }
+  unlink(name);
+  free(name);
+}
+
+// PGM streams: frames read back in order, into the same image while the
+// size does not change, but never into pixels shared with a clone.
+static void checkFrames(void) {
+  FILE* f = tmpfile();
+  CHECK(f != NULL);
+  if (f == NULL) return;
+  Image p[3] = {pattern(30, 20, 1), pattern(30, 20, 2), pattern(7, 9, 3)};
+  for (int i = 0; i < 3; i++) CHECK(ImageWriteFrame(p[i], f));
+  fputs("P5\n4 4\n255\nxx", f);   // truncated frame
+  rewind(f);
+
+  Image frame = NULL;
+  CHECK(ImageReadFrame(f, &frame) == 1);
+  CHECK(sameImage(frame, p[0]));
+  Image first = frame;
+  Image clone = ImageClone(frame);
+  CHECK(ImageReadFrame(f, &frame) == 1);
+  CHECK(frame == first);   // same size: read into the same image
+  CHECK(sameImage(frame, p[1]));
+  CHECK(sameImage(clone, p[0]));
+  CHECK(ImageReadFrame(f, &frame) == 1);
+  CHECK(sameImage(frame, p[2]));
+  CHECK(ImageReadFrame(f, &frame) == -1);
+  CHECK(frame == NULL);
+  CHECK(ImageReadFrame(f, &frame) == 0);   // end of stream
+  CHECK(frame == NULL);
+  fclose(f);
+  ImageDestroy(&clone);
+  for (int i = 0; i < 3; i++) ImageDestroy(&p[i]);
+}
+
+// Resizing: nearest enlarges by replicating pixels, area reduces to the
+// rounded means (on the 2x and 4x fast paths and on the general path), and
+// a constant image stays constant.
+static void checkResize(void) {
+  Image img = pattern(37, 23, 8);
+  Image same = ImageResize(img, 37, 23, InterpBilinear);
+  CHECK(sameImage(same, img));
+  ImageDestroy(&same);
+
+  Image big = ImageResize(img, 74, 69, InterpNearest);
+  CHECK(big != NULL);
+  int ok = 1;
+  for (int y = 0; big != NULL && y < 69; y++) {
+    for (int x = 0; x < 74; x++) {
+      ok &= ImageGetPixel(big, x, y) == ImageGetPixel(img, x / 2, y / 3);
+    }
+  }
+  CHECK(ok);
+
+  // 2x and 4x: rounded means of the blocks
+  Image src = pattern(76, 68, 9);
+  for (int f = 2; f <= 4; f += 2) {
+    Image small = ImageResize(src, 76 / f, 68 / f, InterpArea);
+    CHECK(small != NULL);
+    ok = 1;
+    for (int y = 0; small != NULL && y < 68 / f; y++) {
+      for (int x = 0; x < 76 / f; x++) {
+        int sum = 0;
+        for (int j = 0; j < f; j++) {
+          for (int i = 0; i < f; i++) {
+            sum += ImageGetPixel(src, f * x + i, f * y + j);
+          }
+        }
+        ok &= ImageGetPixel(small, x, y) == (sum + f * f / 2) / (f * f);
+      }
+    }
+    CHECK(ok);
+    ImageDestroy(&small);
+  }
+  ImageDestroy(&src);
+
+  // 3x (general path), of an image with constant 3x3 blocks: the blocks
+  Image blocks = ImageResize(img, 111, 69, InterpNearest);
+  Image back = ImageResize(blocks, 37, 23, InterpArea);
+  CHECK(sameImage(back, img));
+  ImageDestroy(&back);
+  back = ImageResize(blocks, 37, 23, InterpNearest);
+  CHECK(sameImage(back, img));
+  ImageDestroy(&back);
+  ImageDestroy(&blocks);
+
+  Image flat = ImageCreate(20, 20, 255);
+  for (int y = 0; y < 20; y++) {
+    for (int x = 0; x < 20; x++) ImageSetPixel(flat, x, y, 77);
+  }
+  for (Interp mode = InterpNearest; mode <= InterpArea; mode++) {
+    Image r = ImageResize(flat, 31, 7, mode);
+    uint8 min = 255, max = 0;   // (ImageStats only lowers and raises them)
+    if (r != NULL) ImageStats(r, &min, &max);
+    CHECK(r != NULL && min == 77 && max == 77);
+    ImageDestroy(&r);
+  }
+  ImageDestroy(&flat);
+  ImageDestroy(&big);
+  ImageDestroy(&img);
+}
+
+// Affine warps: identity and integer translations copy pixels exactly (with
+// black outside), and rotations by multiples of 90 degrees are exact.
+static void checkAffine(void) {
+  enum { W = 41, H = 27 };
+  Image img = pattern(W, H, 10);
+  for (Interp mode = InterpNearest; mode <= InterpBilinear; mode++) {
+    double identity[6] = {1, 0, 0, 0, 1, 0};
+    Image res = ImageAffine(img, identity, W, H, mode);
+    CHECK(sameImage(res, img));
+    ImageDestroy(&res);
+
+    double shift[6] = {1, 0, 3, 0, 1, -2};   // (x, y) <- (x + 3, y - 2)
+    res = ImageAffine(img, shift, W, H, mode);
+    CHECK(res != NULL);
+    int ok = 1;
+    for (int y = 0; res != NULL && y < H; y++) {
+      for (int x = 0; x < W; x++) {
+        uint8 expect = ImageValidPos(img, x + 3, y - 2)
+                           ? ImageGetPixel(img, x + 3, y - 2) : 0;
+        ok &= ImageGetPixel(res, x, y) == expect;
+      }
+    }
+    CHECK(ok);
+    ImageDestroy(&res);
+
+    Image rot = ImageClone(img);
+    for (int k = 1; k <= 4; k++) {
+      Image next = ImageRotate(rot);
+      ImageDestroy(&rot);
+      rot = next;
+      res = ImageRotateAngle(img, 90.0 * k, mode);
+      CHECK(sameImage(res, rot));
+      ImageDestroy(&res);
+    }
+    res = ImageRotateAngle(img, -90.0, mode);
+    Image r3 = ImageRotate(img);
+    for (int k = 0; k < 2; k++) {
+      Image next = ImageRotate(r3);
+      ImageDestroy(&r3);
+      r3 = next;
+    }
+    CHECK(sameImage(res, r3));
+    ImageDestroy(&r3);
+    ImageDestroy(&res);
+    ImageDestroy(&rot);
+  }
+
+  // An empty source gives a black image
+  Image empty = ImageCreate(0, 0, 255);
+  double scale[6] = {0.5, 0, 0, 0, 0.5, 0};
+  Image res = ImageAffine(empty, scale, 5, 4, InterpBilinear);
+  uint8 min = 255, max = 0;
+  if (res != NULL) ImageStats(res, &min, &max);
+  CHECK(res != NULL && ImageWidth(res) == 5 && max == 0);
+  ImageDestroy(&res);
+  ImageDestroy(&empty);
+  ImageDestroy(&img);
+}
+
+// Image store: spill and reload over budget, and reuse of released handles.
+static void checkStore(void) {
+  enum { W = 64, H = 32, N = 4 };
+  ImageStore st = StoreCreate(2 * W * H);   // room for 2 images
+  CHECK(st != NULL);
+  if (st == NULL) return;
+  int h[N];
+  for (int i = 0; i < N; i++) {
+    h[i] = StoreAdd(st, pattern(W, H, i));
+    CHECK(h[i] >= 0);
+    StoreRef(st, h[i]);
+    StoreUnpin(st, h[i]);   // may be spilled now
+  }
+  int spills, reloads;
+  StoreGetCounts(st, &spills, &reloads);
+  CHECK(spills >= N - 2);
+  CHECK(reloads == 0);
+  for (int i = 0; i < N; i++) {
+    Image ref = pattern(W, H, i);
+    CHECK(sameImage(StoreGet(st, h[i]), ref));
+    ImageDestroy(&ref);
+  }
+  StoreGetCounts(st, &spills, &reloads);
+  CHECK(reloads >= N - 2);
+
+  // Keeping and releasing one image at a time reuses the same handle
+  StoreUnref(st, h[N - 1]);
+  for (int k = 0; k < 100; k++) {
+    int g = StoreAdd(st, pattern(W, H, k));
+    CHECK(g == h[N - 1]);
+    StoreUnpin(st, g);
+  }
+  CHECK(StoreCount(st) == N - 1);
+  StoreDestroy(&st);
+  CHECK(st == NULL);
+}
+
+// Connected components: a rectangle, a U (whose arms are united below) and
+// a diagonal pair (one blob with connectivity 8, two with 4).
+static void checkBlobs(void) {
+  enum { W = 40, H = 30 };
+  Image img = ImageCreate(W, H, 255);
+  CHECK(img != NULL);
+  if (img == NULL) return;
+  for (int y = 1; y < 3; y++) {
+    for (int x = 1; x < 4; x++) ImageSetPixel(img, x, y, 255);
+  }
+  for (int y = 2; y < 7; y++) {
+    ImageSetPixel(img, 20, y, 9);
+    ImageSetPixel(img, 24, y, 9);
+  }
+  for (int x = 21; x < 24; x++) ImageSetPixel(img, x, 6, 9);
+  ImageSetPixel(img, 10, 10, 1);
+  ImageSetPixel(img, 11, 11, 1);
+
+  int* labels = malloc(W * H * sizeof(int));
+  CHECK(labels != NULL);
+  if (labels == NULL) return;
+  BlobList list;
+  CHECK(ImageBlobs(img, 8, labels, &list));
+  CHECK(list.count == 3);
+  if (list.count == 3) {
+    Blob* b = list.blob;
+    CHECK(b[0].area == 6 && b[0].x == 1 && b[0].y == 1 && b[0].w == 3 &&
+          b[0].h == 2 && b[0].cx == 2.0 && b[0].cy == 1.5);
+    CHECK(b[1].area == 13 && b[1].x == 20 && b[1].y == 2 && b[1].w == 5 &&
+          b[1].h == 5 && b[1].cx == 22.0);
+    CHECK(b[2].area == 2 && b[2].x == 10 && b[2].y == 10 && b[2].w == 2 &&
+          b[2].h == 2);
+  }
+  CHECK(labels[0] == 0 && labels[1 * W + 1] == 1);
+  CHECK(labels[2 * W + 20] == 2 && labels[2 * W + 24] == 2);
+  CHECK(labels[11 * W + 11] == 3);
+  ImageBlobsFree(&list);
+  CHECK(list.count == 0 && list.blob == NULL);
+
+  CHECK(ImageBlobs(img, 4, NULL, &list));
+  CHECK(list.count == 4);
+  ImageBlobsFree(&list);
+  free(labels);
+  ImageDestroy(&img);
+}
+
+// Run all self-checks.  Returns the exit status.
+static int runChecks(void) {
+  checkLevels();
+  checkHistogram();
+  checkClone();
+  checkTiled();
+  checkCompressed();
+  checkFrames();
+  checkResize();
+  checkAffine();
+  checkStore();
+  checkBlobs();
+  if (failures > 0) {
+    fprintf(stderr, "%d checks failed\n", failures);
+    return 1;
+  }
+  printf("# All checks passed\n");
+  return 0;
+}
+
 int main(int argc, char* argv[]) {
   program_name = argv[0];
+  if (argc == 2 && strcmp(argv[1], "--check") == 0) {
+    ImageInit();
+    return runChecks();
+  }
   if (argc != 3) {
-    error(1, 0, "Usage: imageTest input.pgm output.pgm");
+    error(1, 0, "Usage: imageTest input.pgm output.pgm | imageTest --check");
   }
 
   ImageInit();
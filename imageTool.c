@@ -15,8 +15,17 @@
 #include <errno.h>
 #include "error.h"
 #include <assert.h>
+#include <dirent.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "image8bit.h"
+#include "imageStore.h"
 #include "instrumentation.h"
 
 static const char* USAGE =
@@ -26,29 +35,95 @@ static const char* USAGE =
     "  FILES, OPERATIONS, or OPERANDS to operations.\n"
     "  Some operations create images, which are appended to an internal buffer:\n"
     "      I0, I1, ..., PRED, CURR\n"
+    "  Images older than PRED are released as soon as they are no longer needed.\n"
     "  The last image in the buffer is called the current image CURR and its\n"
     "  predecessor is PRED.\n"
     "  Most operations apply to CURR and some also use PRED.\n"
+    "  Runs of consecutive point operations (neg, thr, bri, equalize, autothr,\n"
+    "  autocon) are fused and applied to CURR in a single pass (plus one pass\n"
+    "  to compute the histogram, if needed).\n"
+    "\n"
+    "OPTIONS:\n"
+    "  --no-fuse       Apply each point operation in a separate pass\n"
+    "  --lazy          Defer rotate, mirror and crop until their result is used\n"
+    "  --mem-budget MB Keep at most MB MiB of images older than PRED in memory,\n"
+    "                  spilling the others to temporary files\n"
+    "  --serve SOCKET  Serve requests (one pipeline per line) on Unix domain\n"
+    "                  socket SOCKET, or on stdin if SOCKET is -\n"
+    "  --stream IN     Run the rest of the pipeline once for each frame of the\n"
+    "                  stream of PGM images in file IN (- for stdin), with the\n"
+    "                  frame as I0.  The next frame is read while the current\n"
+    "                  one is processed.\n"
+    "  --batch INDIR OUTDIR\n"
+    "                  Run the rest of the pipeline once for each image file\n"
+    "                  in directory INDIR, with the image as I0, and save CURR\n"
+    "                  to a file with the same name in directory OUTDIR.\n"
+    "                  Images are loaded, processed and saved concurrently,\n"
+    "                  and the utilisation of each stage is printed.\n"
+    "  --tile SIDE     Save tiled files with SIDExSIDE tiles (default 256)\n"
+    "  --no-fsync      Do not wait for saved files to reach the disk (files\n"
+    "                  are still replaced atomically)\n"
+    "  --mem-limit MB  Fail to create images beyond MB MiB of memory in total\n"
+    "  --perf          Also count performance events (cycles, cache misses...)\n"
+    "                  between tic and toc, if the system permits\n"
+    "  --record FORMAT[:FD]\n"
+    "                  At each toc, write a record (in json or csv FORMAT) to\n"
+    "                  file descriptor FD (default 3) instead of the table.\n"
+    "                  Also set by environment variable IMAGETOOL_RECORD.\n"
     "\n"
     "FILES:\n"
-    "  Currently, only image files in 8-bit raw PGM format are accepted.\n"
+    "  Image files in 8-bit raw PGM format, or in tiled format if their\n"
+    "  name ends in .imt, or compressed (lossless) if it ends in .imz.\n"
+    "  (Load a PGM file and save it as FILE.imt or FILE.imz to convert.)\n"
+    "  FILE - is stdin (load) or stdout (save), for one PGM image (frame).\n"
     "  Input file names must be distinct from operation names.\n"
     "\n"
     "OPERATIONS:\n"
-    "  FILE            Load PGM image file, creating new image\n"
-    "  save FILE       Save CURR to PGM file\n"
+    "  FILE            Load image file, creating new image\n"
+    "  @NAME           Copy image kept as NAME, creating new image\n"
+    "  keep NAME       Keep a copy of CURR as NAME (persists between requests)\n"
+    "  forget NAME     Forget the image kept as NAME\n"
+    "  region X,Y,W,H FILE\n"
+    "                  Load rectangle of tiled image file, creating new image\n"
+    "  save FILE       Save CURR to image file\n"
     "  info            Show information on CURR (size and range)\n"
+    "  blobs MINAREA[,CONN]\n"
+    "                  Count the blobs (connected nonzero pixels) of CURR, and\n"
+    "                  show those with at least MINAREA pixels (bounding box\n"
+    "                  X,Y,W,H and centroid), with CONN 4 or 8 (default)\n"
     "  tic             Reset instrumentation counters and times.\n"
-    "  toc             Print instrumentation counters and times.\n"
+    "  toc             Print instrumentation counters, times and memory use.\n"
+    "  prof            Print time spent in each command and library function\n"
+    "                  (files as load, @NAME as copy, fused operations as levels).\n"
     "\n"              
     "  neg             Apply photo-negative effect to CURR\n"
     "  thr LEVEL       Apply thresholding to CURR\n"
     "  bri FACTOR      Scale brightness in CURR by FACTOR\n"
+    "  equalize        Equalize the histogram of CURR\n"
+    "  autothr         Apply thresholding to CURR at the level chosen by Otsu's\n"
+    "                  method\n"
+    "  autocon PCT     Stretch the contrast of CURR to the full range, ignoring\n"
+    "                  PCT% of the pixels at each end\n"
     "\n"              
     "  create W,H      Create new black image with WxH pixels\n"
     "  rotate          Rotate CURR 90º counter-clockwise, creating new image\n"
     "  mirror          Mirror CURR left-to-right, creating new image\n"
     "  crop X,Y,W,H    Crop a rectangle from CURR, creating new image\n"
+    "  resize W,H[,MODE]\n"
+    "                  Resize CURR to WxH pixels, creating new image, with\n"
+    "                  MODE nearest, bilinear or area (default: area when\n"
+    "                  reducing, bilinear otherwise)\n"
+    "  edges KERNEL[,NORM[,dir]]\n"
+    "                  Gradient magnitude of CURR, with KERNEL sobel or scharr\n"
+    "                  and NORM l1 or l2 (default), creating new image; with\n"
+    "                  dir, also the gradient direction (0 right, 64 up, ...)\n"
+    "  rotangle DEG[,MODE]\n"
+    "                  Rotate CURR DEG degrees counter-clockwise, creating new\n"
+    "                  image, with MODE nearest or bilinear (default)\n"
+    "  affine A,B,C,D,E,F,W,H[,MODE]\n"
+    "                  Warp CURR into a new WxH image, whose pixel (X,Y) comes\n"
+    "                  from (A*X+B*Y+C, D*X+E*Y+F) in CURR, with MODE nearest\n"
+    "                  or bilinear (default)\n"
     "\n"              
     "  paste X,Y       Paste PRED into CURR at position (X,Y)\n"
     "  blend X,Y,alpha Blend PRED into CURR at position (X,Y) with given alpha\n"
@@ -69,14 +144,393 @@ static char* errors[] = {
   "Success",
   "Insufficient operands",
   "Insufficient images",
-  "Image buffer is full",
+  "Image buffer allocation failed",
   "Image8bit failure: %s",
   "Invalid operand",
   "Invalid rect (overflow)",
   "Invalid alpha",
+  "Unknown image name",
+  "Server failure",
+  "Cannot write records",
+  "Stream failure",
+  "Batch failure",
 };
 
 
+// Is op a point operation chosen from the histogram of the image?
+static int isHistogramOp(const char* op) {
+  return strcmp(op, "equalize") == 0 || strcmp(op, "autothr") == 0 ||
+         strcmp(op, "autocon") == 0;
+}
+
+// Is op a point operation (which may be fused with the next ones)?
+static int isPointOp(const char* op) {
+  return strcmp(op, "neg") == 0 || strcmp(op, "thr") == 0 ||
+         strcmp(op, "bri") == 0 || isHistogramOp(op);
+}
+
+// Point operation fusion.
+//
+// neg, thr and bri are all level mappings (see ImageMapLevels), so a run of
+// consecutive point operations is composed into a single level map and then
+// applied to the image in a single pass, instead of one pass per operation.
+// equalize, autothr and autocon are level mappings chosen from a histogram:
+// the histogram of the image is computed once, in a first pass, and the
+// histogram of the levels produced by the map so far is derived from it.
+//
+// Applies the run of point operations starting at av[*pk] to img (which is
+// I<n>), and sets *pk to the index of the last argument consumed.
+// Returns 0 on success or an error code (index in errors[]).
+static int fusePointOps(Image img, int n, int* pk, int ac, char* av[]) {
+  uint8 map[NUMLEVELS];
+  ImageLevelsIdentity(map);
+  int maxval = ImageMaxval(img);
+  unsigned long base[NUMLEVELS];  // histogram of img
+  unsigned long hist[NUMLEVELS];  // histogram of the levels produced by map
+  int counted = 0;
+  int k = *pk;
+  int ops = 0;
+  while (k < ac) {
+    if (isHistogramOp(av[k])) {
+      if (!counted) {
+        ImageHistogram(img, base);
+        counted = 1;
+      }
+      memset(hist, 0, sizeof(hist));
+      for (int v = 0; v < NUMLEVELS; v++) hist[map[v]] += base[v];
+    }
+    if (strcmp(av[k], "neg") == 0) {
+      fprintf(stderr, "Negating I%d\n", n);
+      ImageLevelsNegative(map, maxval);
+    } else if (strcmp(av[k], "thr") == 0) {
+      if (++k >= ac) return 1;
+      uint8 thr;
+      if (sscanf(av[k], "%hhu", &thr) != 1) return 5;
+      fprintf(stderr, "Thresholding I%d at %d\n", n, thr);
+      ImageLevelsThreshold(map, maxval, thr);
+    } else if (strcmp(av[k], "bri") == 0) {
+      if (++k >= ac) return 1;
+      double factor;
+      if (sscanf(av[k], "%lf", &factor) != 1) return 5;
+      fprintf(stderr, "Brightening I%d by %lf\n", n, factor);
+      ImageLevelsBrighten(map, maxval, factor);
+    } else if (strcmp(av[k], "equalize") == 0) {
+      fprintf(stderr, "Equalizing I%d\n", n);
+      ImageLevelsEqualize(map, maxval, hist);
+    } else if (strcmp(av[k], "autothr") == 0) {
+      uint8 thr = ImageOtsuLevel(hist);
+      fprintf(stderr, "Thresholding I%d at %d (Otsu)\n", n, thr);
+      ImageLevelsThreshold(map, maxval, thr);
+    } else if (strcmp(av[k], "autocon") == 0) {
+      if (++k >= ac) return 1;
+      double pct;
+      if (sscanf(av[k], "%lf", &pct) != 1) return 5;
+      if (!(0.0 <= pct && pct < 50.0)) return 5;   // precondition check!
+      fprintf(stderr, "Stretching contrast of I%d (%g%%)\n", n, pct);
+      ImageLevelsStretch(map, maxval, hist, pct);
+    } else {
+      break;  // end of run
+    }
+    ops++;
+    k++;
+  }
+  assert(ops > 0);
+  fprintf(stderr, "Mapping levels of I%d (%d fused operations)\n", n, ops);
+  ImageMapLevels(img, map);
+  *pk = k - 1;
+  return 0;
+}
+
+// Lazy evaluation.
+//
+// With --lazy, rotate, mirror and crop do not create images immediately.
+// They record a view of an existing (materialized) base image instead:
+//   view = Rotate^rot( Mirror^mirror( Crop(base, x, y, w, h) ) )
+// Applying a geometric operation to a view composes a new view of the same
+// base, so the recorded operations form a DAG whose inner nodes are never
+// allocated.  Crops are pushed through rotations and mirrors: when a view is
+// finally needed (by save, info, locate, ...), the base is cropped first and
+// only the cropped region is mirrored and rotated.
+typedef struct {
+  int base;         // index of the base image in the buffer (-1 if no view)
+  int x, y, w, h;   // rectangle of base
+  int rot;          // number of 90º anti-clockwise rotations (0..3)
+  int mirror;       // mirrored left-right (before rotating)?
+} View;
+
+// The image buffer.
+//
+// Images I0, I1, ..., PRED, CURR are kept in a store (see imageStore.h),
+// where image Ii has handle handle[i] (the store reuses the handles of
+// released images).  Only PRED and CURR are pinned: older images
+// are released as soon as no lazy view refers to them, and, with a memory
+// budget, the ones still referred to may be spilled to disk until needed.
+typedef struct {
+  ImageStore store;   // the images
+  View* view;         // view[i]: lazy view for image i (view[i].base < 0 if none)
+  int* handle;        // handle[i]: handle of image i in store
+  int capacity;       // capacity of view and handle arrays
+  int n;              // number of images
+} Buffer;
+
+// Image i in buffer is no longer PRED or CURR: unpin it.
+// A lazy view is only referred to by its position, so it dies here.
+static void bufUnpin(Buffer* b, int i) {
+  View* v = &b->view[i];
+  if (v->base >= 0) {
+    StoreUnref(b->store, b->handle[v->base]);
+    v->base = -1;
+  }
+  StoreUnpin(b->store, b->handle[i]);
+}
+
+// Append image img (or lazy view v, if img is NULL) to buffer, as new CURR.
+// Returns nonzero on success, 0 on failure (img is destroyed).
+static int bufPush(Buffer* b, Image img, const View* v) {
+  if (b->n == b->capacity) {
+    int capacity = b->capacity == 0 ? 16 : 2 * b->capacity;
+    View* view = realloc(b->view, capacity * sizeof(View));
+    if (view != NULL) b->view = view;
+    int* handle = realloc(b->handle, capacity * sizeof(int));
+    if (handle != NULL) b->handle = handle;
+    if (view == NULL || handle == NULL) {
+      ImageDestroy(&img);
+      return 0;
+    }
+    b->capacity = capacity;
+  }
+  int i = b->n;
+  b->handle[i] = StoreAdd(b->store, img);
+  if (b->handle[i] < 0) {
+    ImageDestroy(&img);
+    return 0;
+  }
+  if (img == NULL) {
+    b->view[i] = *v;
+    StoreRef(b->store, b->handle[v->base]);
+  } else {
+    b->view[i].base = -1;
+  }
+  b->n++;
+  if (b->n >= 3) bufUnpin(b, b->n - 3);
+  return 1;
+}
+
+// Make sure image i in buffer is materialized (not a lazy view).
+// Returns nonzero on success, 0 on failure (with errno/errCause set).
+static int materialize(Buffer* b, int i) {
+  View* v = &b->view[i];
+  if (v->base < 0) return 1;
+  fprintf(stderr, "Materializing I%d (%d,%d,%d,%d of I%d, mirror=%d, rotate=%d)\n",
+          i, v->x, v->y, v->w, v->h, v->base, v->mirror, v->rot);
+  Image base = StoreGet(b->store, b->handle[v->base]);
+  if (base == NULL) return 0;
+  Image res = ImageCrop(base, v->x, v->y, v->w, v->h);
+  if (res != NULL && v->mirror) {
+    Image t = ImageMirror(res);
+    ImageDestroy(&res);
+    res = t;
+  }
+  for (int r = 0; res != NULL && r < v->rot; r++) {
+    Image t = ImageRotate(res);
+    ImageDestroy(&res);
+    res = t;
+  }
+  if (res == NULL) return 0;
+  StoreSet(b->store, b->handle[i], res);
+  StoreUnref(b->store, b->handle[v->base]);
+  v->base = -1;
+  return 1;
+}
+
+// Get image i in buffer, materializing it if necessary.
+// Returns NULL on failure (with errno/errCause set).
+static Image bufGet(Buffer* b, int i) {
+  if (!materialize(b, i)) return NULL;
+  return StoreGet(b->store, b->handle[i]);
+}
+
+// Get image i in buffer, to be modified in-place: materialize it, and give
+// it its own pixels, if they are shared with a clone (see ImageClone).
+// Returns NULL on failure (with errno/errCause set).
+static Image bufGetWritable(Buffer* b, int i) {
+  Image img = bufGet(b, i);
+  if (img == NULL || !ImageUnshare(img)) return NULL;
+  return img;
+}
+
+// Width of image i in buffer (PRED or CURR), materialized or not.
+static int width(Buffer* b, int i) {
+  View* v = &b->view[i];
+  if (v->base < 0) return ImageWidth(StoreGet(b->store, b->handle[i]));
+  return v->rot % 2 ? v->h : v->w;
+}
+
+// Height of image i in buffer (PRED or CURR), materialized or not.
+static int height(Buffer* b, int i) {
+  View* v = &b->view[i];
+  if (v->base < 0) return ImageHeight(StoreGet(b->store, b->handle[i]));
+  return v->rot % 2 ? v->w : v->h;
+}
+
+// Return a view equivalent to image i in buffer (PRED or CURR).
+static View viewOf(Buffer* b, int i) {
+  if (b->view[i].base >= 0) return b->view[i];
+  View v = {i, 0, 0, width(b, i), height(b, i), 0, 0};
+  return v;
+}
+
+// Compose a 90º anti-clockwise rotation after view v.
+static void viewRotate(View* v) {
+  v->rot = (v->rot + 1) % 4;
+}
+
+// Compose a left-right mirror after view v.
+// Mirror o Rotate^r == Rotate^(-r) o Mirror.
+static void viewMirror(View* v) {
+  v->rot = (4 - v->rot) % 4;
+  v->mirror = !v->mirror;
+}
+
+// Compose a crop of rectangle (x,y,w,h) after view v.
+// The rectangle is transformed back through each rotation (outermost first)
+// and the mirror, to the corresponding rectangle of the base.
+static void viewCrop(View* v, int x, int y, int w, int h) {
+  for (int r = v->rot; r > 0; r--) {
+    int uw = (r - 1) % 2 ? v->h : v->w;   // width before this rotation
+    int t = x;
+    x = uw - y - h;
+    y = t;
+    t = w;
+    w = h;
+    h = t;
+  }
+  if (v->mirror) x = v->w - x - w;
+  v->x += x;
+  v->y += y;
+  v->w = w;
+  v->h = h;
+}
+
+// Named images.
+//
+// Images may be kept under a name (keep NAME) and copied back into the
+// buffer later (@NAME).  This is mostly useful in server mode, where named
+// images stay resident between requests.  Named images live in their own
+// store, so they are also subject to the memory budget.
+typedef struct {
+  char* name;
+  int handle;       // handle of the image in the names store
+} Name;
+
+// The state of the image processor.
+// In server mode, everything but the buffer persists between requests.
+typedef struct {
+  Buffer buf;         // the image buffer
+  ImageStore names;   // the named images
+  Name* name;         // the names
+  int numNames;       // number of names
+  int capacityNames;  // capacity of name array
+  size_t budget;      // memory budget, in bytes (0 = unlimited)
+  int fuse;           // fuse runs of point operations?
+  int lazy;           // defer geometric operations?
+  int stats;          // print store statistics at the end?
+  int serving;        // in server mode?
+  int tile;           // side of the tiles of tiled files saved
+} Tool;
+
+// Initialize an empty buffer.
+// Returns nonzero on success, 0 on failure (with errno set).
+static int bufInit(Buffer* b, size_t budget) {
+  b->store = StoreCreate(budget);
+  b->view = NULL;
+  b->handle = NULL;
+  b->capacity = 0;
+  b->n = 0;
+  return b->store != NULL;
+}
+
+// Destroy all images in buffer.
+static void bufFree(Buffer* b) {
+  StoreDestroy(&b->store);
+  free(b->view);
+  b->view = NULL;
+  free(b->handle);
+  b->handle = NULL;
+}
+
+// Find name in tool.  Returns its index, or -1 if not found.
+static int findName(Tool* t, const char* name) {
+  for (int i = 0; i < t->numNames; i++) {
+    if (strcmp(t->name[i].name, name) == 0) return i;
+  }
+  return -1;
+}
+
+// Keep a copy (a clone) of img under name, replacing any previous image with
+// that name.
+// Returns 0 on success or an error code (index in errors[]).
+static int keepName(Tool* t, const char* name, Image img) {
+  int i = findName(t, name);
+  if (i < 0 && t->numNames == t->capacityNames) {
+    int capacity = t->capacityNames == 0 ? 8 : 2 * t->capacityNames;
+    Name* array = realloc(t->name, capacity * sizeof(Name));
+    if (array == NULL) return 3;
+    t->name = array;
+    t->capacityNames = capacity;
+  }
+  Image copy = ImageClone(img);
+  if (copy == NULL) return 4;
+  int h = StoreAdd(t->names, copy);
+  if (h < 0) {
+    ImageDestroy(&copy);
+    return 3;
+  }
+  // Referenced by the name, but not pinned: may be spilled
+  StoreRef(t->names, h);
+  StoreUnpin(t->names, h);
+  if (i < 0) {
+    char* dup = strdup(name);
+    if (dup == NULL) {
+      StoreUnref(t->names, h);
+      return 3;
+    }
+    i = t->numNames++;
+    t->name[i].name = dup;
+  } else {
+    StoreUnref(t->names, t->name[i].handle);
+  }
+  t->name[i].handle = h;
+  return 0;
+}
+
+// Forget the image with the given name.
+// Returns 0 on success or an error code (index in errors[]).
+static int forgetName(Tool* t, const char* name) {
+  int i = findName(t, name);
+  if (i < 0) return 8;
+  StoreUnref(t->names, t->name[i].handle);
+  free(t->name[i].name);
+  t->name[i] = t->name[--t->numNames];
+  return 0;
+}
+
+// Get a new copy (a clone) of the image with the given name into (*imgp).
+// Returns 0 on success or an error code (index in errors[]).
+static int getName(Tool* t, const char* name, Image* imgp) {
+  int i = findName(t, name);
+  if (i < 0) return 8;
+  Image img = StoreGet(t->names, t->name[i].handle);
+  if (img == NULL) return 4;
+  *imgp = ImageClone(img);
+  return *imgp == NULL ? 4 : 0;
+}
+
+static int serve(Tool* t, const char* path) ;
+static int stream(Tool* t, const char* path, int ac, char* av[]) ;
+static int batch(Tool* t, const char* indir, const char* outdir, int ac,
+                 char* av[]) ;
+
 // This program strives for correctness and robustness.
 // You may want to temporarily comment out operand validation, namely
 // precondition checks, so that you can force precondition violations, and
@@ -85,112 +539,446 @@ static char* errors[] = {
 // Also, the program does not test every module function, but you may easily
 // add new operations for that purpose.
 
-int main(int ac, char* av[]) {
-  program_name = av[0];
-  if (ac <= 1) {
-    error(5, 0, "\n%s", USAGE);
+// Join arguments av[first..last-1], separated by spaces, into a new string.
+// Returns NULL if allocation fails.
+static char* joinArgs(int first, int last, char* av[]) {
+  size_t len = 1;
+  for (int k = first; k < last; k++) len += strlen(av[k]) + 1;
+  char* str = malloc(len);
+  if (str == NULL) return NULL;
+  str[0] = '\0';
+  for (int k = first; k < last; k++) {
+    if (k > first) strcat(str, " ");
+    strcat(str, av[k]);
   }
+  return str;
+}
 
-  ImageInit();
+// Print memory statistics of the image8bit module, and the peak resident
+// set size of the process (since tic).
+static void printMemory(void) {
+  ImageMemInfo m;
+  ImageMemGet(&m);
+  printf("# Memory: %zu bytes allocated, %zu peak, %lu allocations, "
+         "%zu largest", m.current, m.peak, m.count, m.largest);
+  if (m.limit > 0) printf(", %zu limit", m.limit);
+  printf(", %lu peak RSS\n", InstrPeakRSS());
+  ImagePoolInfo p;
+  ImagePoolGet(&p);
+  printf("# Pool: %zu bytes free, %lu reused, %lu allocated\n",
+         p.bytes, p.hits, p.misses);
+}
 
+// Does file name end with extension ext?
+static int hasExtension(const char* name, const char* ext) {
+  size_t n = strlen(name), e = strlen(ext);
+  return n > e && strcmp(name + n - e, ext) == 0;
+}
+
+// Load image file: tiled (.imt), compressed (.imz) or PGM, or the next
+// frame from stdin, if name is "-".
+static Image loadFile(const char* name) {
+  if (strcmp(name, "-") == 0) {
+    Image img = NULL;
+    if (ImageReadFrame(stdin, &img) == 0) errno = ENODATA;  // no frame
+    return img;
+  }
+  if (hasExtension(name, ".imt")) return ImageLoadTiled(name);
+  if (hasExtension(name, ".imz")) return ImageLoadCompressed(name);
+  return ImageLoad(name);
+}
+
+// Save img to file: tiled (.imt), with tiles of the given side, compressed
+// (.imz) or PGM, or as the next frame to stdout, if name is "-".
+// Returns nonzero on success, 0 on failure (with errno/errCause set).
+static int saveFile(Image img, const char* name, int tile) {
+  if (strcmp(name, "-") == 0) return ImageWriteFrame(img, stdout);
+  if (hasExtension(name, ".imt")) return ImageSaveTiled(img, name, tile, 1);
+  if (hasExtension(name, ".imz")) return ImageSaveCompressed(img, name);
+  return ImageSave(img, name);
+}
+
+// Parse interpolation mode name into *mode (left unchanged if name is
+// empty).  Returns 0 if the name is invalid.
+static int parseInterp(const char* name, Interp* mode) {
+  if (strcmp(name, "nearest") == 0) {
+    *mode = InterpNearest;
+  } else if (strcmp(name, "bilinear") == 0) {
+    *mode = InterpBilinear;
+  } else if (strcmp(name, "area") == 0) {
+    *mode = InterpArea;
+  } else if (name[0] != '\0') {
+    return 0;
+  }
+  return 1;
+}
+
+// Name of the region that times the command starting at word (see prof):
+// the command itself, "levels" for a fused run of point operations, "copy"
+// for a named image, or "load" for an image file.  Only these fixed names
+// are used, so that file names and @NAMEs do not become regions.
+static const char* regionName(const char* word, int fuse) {
+  static const char* commands[] = {
+    "info", "blobs", "tic", "toc", "--record", "prof", "--no-fuse", "--lazy",
+    "--perf", "--no-fsync", "--tile", "--mem-limit", "--mem-budget",
+    "--serve", "--stream", "--batch", "keep", "forget", "neg", "thr", "bri",
+    "equalize", "autothr", "autocon", "create", "rotate", "mirror", "crop",
+    "resize", "rotangle", "affine", "edges", "paste", "blend", "locate",
+    "blur", "region", "save",
+  };
+  if (fuse && isPointOp(word)) return "levels";
+  if (word[0] == '@') return "copy";
+  for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+    if (strcmp(word, commands[i]) == 0) return commands[i];
+  }
+  return "load";
+}
+
+// Run a pipeline of operations given by arguments av[0..ac-1].
+// Returns 0 on success or an error code (index in errors[]).
+static int run(Tool* t, int ac, char* av[]) {
   int err = 0;
+  int tic = 0;        // index of last tic (for records)
   int x, y, w, h;
+  Buffer* b = &t->buf;
+  Image cur, pred;    // CURR and PRED, when needed
+  View v;
 
-  // The image buffer
-  const int N = 10;   // buffer capacity
-  Image img[N];     // the images
-  int n = 0;          // number of images created
-
-  int k = 1;
+  int k = 0;
   while (k < ac) {
+    int n = b->n;
+    InstrBegin(regionName(av[k], t->fuse));  // time each command
     if (strcmp(av[k], "info") == 0) {
       if (n < 1) { err = 2; break; }
+      if ((cur = bufGet(b, n-1)) == NULL) { err = 4; break; }
       fprintf(stderr, "Info on I%d\n", n-1);
       uint8 min, max;
-      w = ImageWidth(img[n-1]);
-      h = ImageHeight(img[n-1]);
-      uint8 maxval = ImageMaxval(img[n-1]);
-      ImageStats(img[n-1], &min, &max);
+      w = ImageWidth(cur);
+      h = ImageHeight(cur);
+      uint8 maxval = ImageMaxval(cur);
+      ImageStats(cur, &min, &max);
       printf("# Size: %dx%d\n# Maxval: %hhu\n", w, h, maxval);
       printf("# Gray level range: [%hhu, %hhu]\n", min, max);
+    } else if (strcmp(av[k], "blobs") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      long minarea;
+      int conn = 8;
+      if (sscanf(av[k], "%ld,%d", &minarea, &conn) < 1) { err = 5; break; }
+      if (conn != 4 && conn != 8) { err = 5; break; }   // precondition check!
+      if ((cur = bufGet(b, n-1)) == NULL) { err = 4; break; }
+      fprintf(stderr, "Blobs of I%d\n", n-1);
+      BlobList list;
+      if (!ImageBlobs(cur, conn, NULL, &list)) { err = 4; break; }
+      int shown = 0;
+      for (int i = 0; i < list.count; i++) shown += list.blob[i].area >= minarea;
+      printf("# Blobs: %d (%d-connected), %d with area >= %ld\n", list.count,
+             conn, shown, minarea);
+      for (int i = 0; i < list.count; i++) {
+        Blob* bl = &list.blob[i];
+        if (bl->area < minarea) continue;
+        printf("# Blob %d: area %ld, box %d,%d,%d,%d, centroid %.2f,%.2f\n",
+               i + 1, bl->area, bl->x, bl->y, bl->w, bl->h, bl->cx, bl->cy);
+      }
+      ImageBlobsFree(&list);
     } else if (strcmp(av[k], "tic") == 0) {
       InstrReset();
+      InstrRegionsReset();
+      ImageMemReset();
+      tic = k + 1;
     } else if (strcmp(av[k], "toc") == 0) {
-      InstrPrint();
+      if (InstrRecording()) {
+        // Record the operations since tic, and the size of CURR
+        char* op = joinArgs(tic, k, av);
+        if (op == NULL) { err = 3; break; }
+        ImageMemInfo m;
+        ImageMemGet(&m);
+        InstrRecordField("memcurrent", m.current);
+        InstrRecordField("mempeak", m.peak);
+        InstrRecordField("memallocs", m.count);
+        InstrRecordField("memlargest", m.largest);
+        InstrRecord(op, n > 0 ? width(b, n-1) : 0, n > 0 ? height(b, n-1) : 0);
+        free(op);
+      } else {
+        InstrPrint();
+        printMemory();
+      }
+    } else if (strcmp(av[k], "--record") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (!InstrRecordOpen(av[k])) { err = errno == EINVAL ? 5 : 10; break; }
+    } else if (strcmp(av[k], "prof") == 0) {
+      InstrRegionsPrint();
+    } else if (strcmp(av[k], "--no-fuse") == 0) {
+      t->fuse = 0;
+    } else if (strcmp(av[k], "--lazy") == 0) {
+      t->lazy = 1;
+    } else if (strcmp(av[k], "--perf") == 0) {
+      if (InstrPerfEnable() == 0) {
+        fprintf(stderr, "Performance events not permitted: ignoring --perf\n");
+      }
+    } else if (strcmp(av[k], "--no-fsync") == 0) {
+      ImageSetSync(0);
+    } else if (strcmp(av[k], "--tile") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (sscanf(av[k], "%d", &t->tile) != 1 || t->tile <= 0) { err = 5; break; }
+    } else if (strcmp(av[k], "--mem-limit") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      double mib;
+      if (sscanf(av[k], "%lf", &mib) != 1 || mib < 0.0) { err = 5; break; }
+      ImageMemSetLimit((size_t)(mib * 1024 * 1024));
+    } else if (strcmp(av[k], "--mem-budget") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      double mib;
+      if (sscanf(av[k], "%lf", &mib) != 1 || mib < 0.0) { err = 5; break; }
+      t->budget = (size_t)(mib * 1024 * 1024);
+      StoreSetBudget(b->store, t->budget);
+      StoreSetBudget(t->names, t->budget);
+      t->stats = 1;
+    } else if (strcmp(av[k], "--serve") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (t->serving) { err = 5; break; }
+      if ((err = serve(t, av[k])) != 0) break;
+    } else if (strcmp(av[k], "--stream") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      // The rest of the arguments are the pipeline for each frame
+      err = stream(t, av[k], ac - k - 1, av + k + 1);
+      InstrEnd();
+      return err;
+    } else if (strcmp(av[k], "--batch") == 0) {
+      if (k + 2 >= ac) { err = 1; break; }
+      // The rest of the arguments are the pipeline for each image
+      err = batch(t, av[k + 1], av[k + 2], ac - k - 3, av + k + 3);
+      InstrEnd();
+      return err;
+    } else if (strcmp(av[k], "keep") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      if ((cur = bufGet(b, n-1)) == NULL) { err = 4; break; }
+      fprintf(stderr, "Keeping I%d as %s\n", n-1, av[k]);
+      if ((err = keepName(t, av[k], cur)) != 0) break;
+    } else if (strcmp(av[k], "forget") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      fprintf(stderr, "Forgetting %s\n", av[k]);
+      if ((err = forgetName(t, av[k])) != 0) break;
+    } else if (av[k][0] == '@') {  // named image
+      fprintf(stderr, "Copying %s -> I%d\n", av[k], n);
+      Image img;
+      if ((err = getName(t, av[k] + 1, &img)) != 0) break;
+      if (!bufPush(b, img, NULL)) { err = 3; break; }
+    } else if (t->fuse && isPointOp(av[k])) {
+      if (n < 1) { err = 2; break; }
+      if ((cur = bufGetWritable(b, n-1)) == NULL) { err = 4; break; }
+      if ((err = fusePointOps(cur, n-1, &k, ac, av)) != 0) break;
     } else if (strcmp(av[k], "neg") == 0) {
       if (n < 1) { err = 2; break; }
+      if ((cur = bufGetWritable(b, n-1)) == NULL) { err = 4; break; }
       fprintf(stderr, "Negating I%d\n", n-1);
-      ImageNegative(img[n-1]);
+      ImageNegative(cur);
     } else if (strcmp(av[k], "thr") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
       uint8 thr;
       if (sscanf(av[k], "%hhu", &thr) != 1) { err = 5; break; }
+      if ((cur = bufGetWritable(b, n-1)) == NULL) { err = 4; break; }
       fprintf(stderr, "Thresholding I%d at %d\n", n-1, thr);
-      ImageThreshold(img[n-1], (uint8)thr);
+      ImageThreshold(cur, (uint8)thr);
     } else if (strcmp(av[k], "bri") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
       double factor;
       if (sscanf(av[k], "%lf", &factor) != 1) { err = 5; break; }
+      if ((cur = bufGetWritable(b, n-1)) == NULL) { err = 4; break; }
       fprintf(stderr, "Brightening I%d by %lf\n", n-1, factor);
-      ImageBrighten(img[n-1], factor);
+      ImageBrighten(cur, factor);
+    } else if (strcmp(av[k], "equalize") == 0) {
+      if (n < 1) { err = 2; break; }
+      if ((cur = bufGetWritable(b, n-1)) == NULL) { err = 4; break; }
+      fprintf(stderr, "Equalizing I%d\n", n-1);
+      ImageEqualize(cur);
+    } else if (strcmp(av[k], "autothr") == 0) {
+      if (n < 1) { err = 2; break; }
+      if ((cur = bufGetWritable(b, n-1)) == NULL) { err = 4; break; }
+      uint8 thr = ImageAutoThreshold(cur);
+      fprintf(stderr, "Thresholded I%d at %d (Otsu)\n", n-1, thr);
+    } else if (strcmp(av[k], "autocon") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      double pct;
+      if (sscanf(av[k], "%lf", &pct) != 1) { err = 5; break; }
+      if (!(0.0 <= pct && pct < 50.0)) { err = 5; break; }   // precondition check!
+      if ((cur = bufGetWritable(b, n-1)) == NULL) { err = 4; break; }
+      fprintf(stderr, "Stretching contrast of I%d (%g%%)\n", n-1, pct);
+      ImageAutoContrast(cur, pct);
     } else if (strcmp(av[k], "create") == 0) {
       if (++k >= ac) { err = 1; break; }
-      if (n >= N) { err = 3; break; }
       if (sscanf(av[k], "%d,%d", &w, &h) != 2) { err = 5; break; }
       if (w < 0 || h < 0) { err = 5; break; }   // precondition check!
       fprintf(stderr, "Creating black image (%d,%d) -> I%d\n", w, h, n);
-      img[n] = ImageCreate(w, h, PixMax);
-      if (img[n] == NULL) { err = 4; break; }
-      n++;
+      Image img = ImageCreate(w, h, PixMax);
+      if (img == NULL) { err = 4; break; }
+      if (!bufPush(b, img, NULL)) { err = 3; break; }
     } else if (strcmp(av[k], "rotate") == 0) {
       if (n < 1) { err = 2; break; }
-      if (n >= N) { err = 3; break; }
-      fprintf(stderr, "Rotating I%d -> I%d\n", n-1, n);
-      img[n] = ImageRotate(img[n-1]);
-      if (img[n] == NULL) { err = 4; break; }
-      n++;
+      if (t->lazy) {
+        fprintf(stderr, "Rotating I%d -> I%d (lazy)\n", n-1, n);
+        v = viewOf(b, n-1);
+        viewRotate(&v);
+        if (!bufPush(b, NULL, &v)) { err = 3; break; }
+      } else {
+        if ((cur = bufGet(b, n-1)) == NULL) { err = 4; break; }
+        fprintf(stderr, "Rotating I%d -> I%d\n", n-1, n);
+        Image img = ImageRotate(cur);
+        if (img == NULL) { err = 4; break; }
+        if (!bufPush(b, img, NULL)) { err = 3; break; }
+      }
     } else if (strcmp(av[k], "mirror") == 0) {
       if (n < 1) { err = 2; break; }
-      if (n >= N) { err = 3; break; }
-      fprintf(stderr, "Mirroring I%d -> I%d\n", n-1, n);
-      img[n] = ImageMirror(img[n-1]);
-      if (img[n] == NULL) { err = 4; break; }
-      n++;
+      if (t->lazy) {
+        fprintf(stderr, "Mirroring I%d -> I%d (lazy)\n", n-1, n);
+        v = viewOf(b, n-1);
+        viewMirror(&v);
+        if (!bufPush(b, NULL, &v)) { err = 3; break; }
+      } else {
+        if ((cur = bufGet(b, n-1)) == NULL) { err = 4; break; }
+        fprintf(stderr, "Mirroring I%d -> I%d\n", n-1, n);
+        Image img = ImageMirror(cur);
+        if (img == NULL) { err = 4; break; }
+        if (!bufPush(b, img, NULL)) { err = 3; break; }
+      }
     } else if (strcmp(av[k], "crop") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
-      if (n >= N) { err = 3; break; }
       if (sscanf(av[k], "%d,%d,%d,%d", &x, &y, &w, &h) != 4) { err = 5; break; }
-      if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 5; break; }   // precondition check!
-      fprintf(stderr, "Cropping I%d (%d,%d,%d,%d) -> I%d\n", n-1, x, y, w, h, n);
-      img[n] = ImageCrop(img[n-1], x, y, w, h);
-      if (img[n] == NULL) { err = 4; break; }
-      n++;
+      if (x < 0 || y < 0 || w < 0 || h < 0 ||
+          x + w > width(b, n-1) || y + h > height(b, n-1)) {
+        err = 5; break;   // precondition check!
+      }
+      if (t->lazy) {
+        fprintf(stderr, "Cropping I%d (%d,%d,%d,%d) -> I%d (lazy)\n", n-1, x, y, w, h, n);
+        v = viewOf(b, n-1);
+        viewCrop(&v, x, y, w, h);
+        if (!bufPush(b, NULL, &v)) { err = 3; break; }
+      } else {
+        if ((cur = bufGet(b, n-1)) == NULL) { err = 4; break; }
+        fprintf(stderr, "Cropping I%d (%d,%d,%d,%d) -> I%d\n", n-1, x, y, w, h, n);
+        Image img = ImageCrop(cur, x, y, w, h);
+        if (img == NULL) { err = 4; break; }
+        if (!bufPush(b, img, NULL)) { err = 3; break; }
+      }
+    } else if (strcmp(av[k], "resize") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      char name[16] = "";
+      if (sscanf(av[k], "%d,%d,%15s", &w, &h, name) < 2) { err = 5; break; }
+      if (w < 0 || h < 0) { err = 5; break; }   // precondition check!
+      if ((cur = bufGet(b, n-1)) == NULL) { err = 4; break; }
+      if ((w > 0 && h > 0) && (ImageWidth(cur) == 0 || ImageHeight(cur) == 0)) {
+        err = 5; break;   // precondition check!
+      }
+      int reduce = w <= ImageWidth(cur) && h <= ImageHeight(cur);
+      Interp mode = reduce ? InterpArea : InterpBilinear;
+      if (!parseInterp(name, &mode)) { err = 5; break; }
+      fprintf(stderr, "Resizing I%d to %dx%d -> I%d\n", n-1, w, h, n);
+      Image img = ImageResize(cur, w, h, mode);
+      if (img == NULL) { err = 4; break; }
+      if (!bufPush(b, img, NULL)) { err = 3; break; }
+    } else if (strcmp(av[k], "rotangle") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      double degrees;
+      char name[16] = "";
+      if (sscanf(av[k], "%lf,%15s", &degrees, name) < 1) { err = 5; break; }
+      Interp mode = InterpBilinear;
+      if (!parseInterp(name, &mode) || mode == InterpArea ||
+          !isfinite(degrees)) {
+        err = 5; break;   // precondition check!
+      }
+      if ((cur = bufGet(b, n-1)) == NULL) { err = 4; break; }
+      fprintf(stderr, "Rotating I%d by %g degrees -> I%d\n", n-1, degrees, n);
+      Image img = ImageRotateAngle(cur, degrees, mode);
+      if (img == NULL) { err = 4; break; }
+      if (!bufPush(b, img, NULL)) { err = 3; break; }
+    } else if (strcmp(av[k], "affine") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      double m[6];
+      char name[16] = "";
+      if (sscanf(av[k], "%lf,%lf,%lf,%lf,%lf,%lf,%d,%d,%15s", &m[0], &m[1],
+                 &m[2], &m[3], &m[4], &m[5], &w, &h, name) < 8) {
+        err = 5; break;
+      }
+      Interp mode = InterpBilinear;
+      if (w < 0 || h < 0 || !parseInterp(name, &mode) || mode == InterpArea) {
+        err = 5; break;   // precondition check!
+      }
+      // Source coordinates must fit the fixed-point range (see ImageAffine)
+      int c;
+      for (c = 0; c < 4; c++) {
+        double cx = c & 1 ? w : 0, cy = c & 2 ? h : 0;
+        if (!(fabs(m[0] * cx + m[1] * cy + m[2]) <= 1 << 30) ||
+            !(fabs(m[3] * cx + m[4] * cy + m[5]) <= 1 << 30)) break;
+      }
+      if (c < 4) { err = 5; break; }   // precondition check!
+      if ((cur = bufGet(b, n-1)) == NULL) { err = 4; break; }
+      fprintf(stderr, "Warping I%d to %dx%d -> I%d\n", n-1, w, h, n);
+      Image img = ImageAffine(cur, m, w, h, mode);
+      if (img == NULL) { err = 4; break; }
+      if (!bufPush(b, img, NULL)) { err = 3; break; }
+    } else if (strcmp(av[k], "edges") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      char kernel[16] = "", norm[16] = "l2", out[16] = "";
+      if (sscanf(av[k], "%15[^,],%15[^,],%15s", kernel, norm, out) < 1) {
+        err = 5; break;
+      }
+      int scharr = strcmp(kernel, "scharr") == 0;
+      int l2 = strcmp(norm, "l2") == 0;
+      int withDir = strcmp(out, "dir") == 0;
+      if ((!scharr && strcmp(kernel, "sobel") != 0) ||
+          (!l2 && strcmp(norm, "l1") != 0) || (!withDir && out[0] != '\0')) {
+        err = 5; break;
+      }
+      if ((cur = bufGet(b, n-1)) == NULL) { err = 4; break; }
+      fprintf(stderr, "Edges of I%d (%s, %s) -> I%d\n", n-1, kernel, norm, n);
+      if (withDir) fprintf(stderr, "Gradient direction -> I%d\n", n+1);
+      Image dir = NULL;
+      Image img = scharr ? ImageScharr(cur, l2, withDir ? &dir : NULL)
+                         : ImageSobel(cur, l2, withDir ? &dir : NULL);
+      if (img == NULL) { err = 4; break; }
+      if (!bufPush(b, img, NULL)) {
+        ImageDestroy(&dir);
+        err = 3; break;
+      }
+      if (dir != NULL && !bufPush(b, dir, NULL)) { err = 3; break; }
     } else if (strcmp(av[k], "paste") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 2) { err = 2; break; }
       if (sscanf(av[k], "%d,%d", &x, &y) != 2) { err = 5; break; }
-      w = ImageWidth(img[n-2]);
-      h = ImageHeight(img[n-2]);
-      if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 6; break; }
+      if ((pred = bufGet(b, n-2)) == NULL) { err = 4; break; }
+      if ((cur = bufGetWritable(b, n-1)) == NULL) { err = 4; break; }
+      w = ImageWidth(pred);
+      h = ImageHeight(pred);
+      if (!ImageValidRect(cur, x, y, w, h)) { err = 6; break; }
       fprintf(stderr, "Pasting I%d at I%d (%d,%d)\n", n-2, n-1, x, y);
-      ImagePaste(img[n-1], x, y, img[n-2]);
+      ImagePaste(cur, x, y, pred);
     } else if (strcmp(av[k], "blend") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 2) { err = 2; break; }
       double alpha;
       if (sscanf(av[k], "%d,%d,%lf", &x, &y, &alpha) != 3) { err = 5; break; }
-      w = ImageWidth(img[n-2]);
-      h = ImageHeight(img[n-2]);
-      if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 6; break; }
+      if ((pred = bufGet(b, n-2)) == NULL) { err = 4; break; }
+      if ((cur = bufGetWritable(b, n-1)) == NULL) { err = 4; break; }
+      w = ImageWidth(pred);
+      h = ImageHeight(pred);
+      if (!ImageValidRect(cur, x, y, w, h)) { err = 6; break; }
       fprintf(stderr, "Blending I%d with I%d@(%d,%d) with alpha=%.3f\n", n-2, n-1, x, y, alpha);
-      ImageBlend(img[n-1], x, y, img[n-2], alpha);
+      ImageBlend(cur, x, y, pred, alpha);
     } else if (strcmp(av[k], "locate") == 0) {
       if (n < 2) { err = 2; break; }
+      if ((pred = bufGet(b, n-2)) == NULL) { err = 4; break; }
+      if ((cur = bufGet(b, n-1)) == NULL) { err = 4; break; }
       fprintf(stderr, "Locating I%d in I%d\n", n-2, n-1);
-      if (ImageLocateSubImage(img[n-1], &x, &y, img[n-2])) {
+      if (ImageLocateSubImage(cur, &x, &y, pred)) {
         printf("# FOUND (%d,%d)\n", x, y);
       } else {
         printf("# NOTFOUND\n");
@@ -200,29 +988,691 @@ int main(int ac, char* av[]) {
       if (n < 1) { err = 2; break; }
       int dx; int dy;
       if (sscanf(av[k], "%d,%d", &dx, &dy) != 2) { err = 5; break; }
+      if ((cur = bufGetWritable(b, n-1)) == NULL) { err = 4; break; }
       fprintf(stderr, "Blur I%d with %dx%d mean filter\n", n-1, 2*dx+1, 2*dy+1);
-      ImageBlur(img[n-1], dx, dy);
+      ImageBlur(cur, dx, dy);
+    } else if (strcmp(av[k], "region") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (sscanf(av[k], "%d,%d,%d,%d", &x, &y, &w, &h) != 4) { err = 5; break; }
+      if (++k >= ac) { err = 1; break; }
+      fprintf(stderr, "Loading %s (%d,%d,%d,%d) -> I%d\n", av[k], x, y, w, h, n);
+      Image img = ImageLoadRegion(av[k], x, y, w, h);
+      if (img == NULL) { err = 4; break; }
+      if (!bufPush(b, img, NULL)) { err = 3; break; }
     } else if (strcmp(av[k], "save") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
+      if ((cur = bufGet(b, n-1)) == NULL) { err = 4; break; }
       fprintf(stderr, "Saving %s <- I%d\n", av[k], n-1);
-      if (ImageSave(img[n-1], av[k]) == 0) { err = 4; break; }
+      if (saveFile(cur, av[k], t->tile) == 0) { err = 4; break; }
     } else {  // image file
-      if (n >= N) { err = 3; break; }
       fprintf(stderr, "Loading %s -> I%d\n", av[k], n);
-      img[n] = ImageLoad(av[k]);
-      if (img[n] == NULL) { err = 4; break; }
-      n++;
+      Image img = loadFile(av[k]);
+      if (img == NULL) { err = 4; break; }
+      if (!bufPush(b, img, NULL)) { err = 3; break; }
     }
+    InstrEnd();
     k++;
   }
-  
+  if (err != 0) InstrEnd();  // end timing the command that failed
+
+  return err;
+}
+
+// Wall clock time in seconds
+static double wallTime(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + 1.0e-9 * (double)ts.tv_nsec;
+}
+
+// Bounded queues.
+//
+// A queue of at most capacity items, to pass work from one thread to
+// another: queuePut waits while the queue is full, and queueGet waits while
+// it is empty.  After queueClose, queuePut fails and queueGet returns NULL
+// once the queue is empty.
+typedef struct {
+  void** item;          // circular array of items
+  int capacity;         // maximum number of items
+  int head;             // index of first item
+  int count;            // number of items
+  int closed;           // no more items?
+  pthread_mutex_t lock;
+  pthread_cond_t notEmpty;
+  pthread_cond_t notFull;
+} Queue;
+
+// Initialize an empty queue with the given capacity.
+// Returns nonzero on success, 0 on failure (with errno set).
+static int queueInit(Queue* q, int capacity) {
+  assert(capacity > 0);
+  q->item = malloc(capacity * sizeof(void*));
+  if (q->item == NULL) return 0;
+  q->capacity = capacity;
+  q->head = 0;
+  q->count = 0;
+  q->closed = 0;
+  pthread_mutex_init(&q->lock, NULL);
+  pthread_cond_init(&q->notEmpty, NULL);
+  pthread_cond_init(&q->notFull, NULL);
+  return 1;
+}
+
+// Free queue q (which must be empty, and no longer used by other threads).
+static void queueFree(Queue* q) {
+  assert(q->count == 0);
+  pthread_cond_destroy(&q->notFull);
+  pthread_cond_destroy(&q->notEmpty);
+  pthread_mutex_destroy(&q->lock);
+  free(q->item);
+  q->item = NULL;
+}
+
+// Append item to queue q, waiting while it is full.
+// Returns nonzero on success, 0 if the queue was closed (item not added).
+static int queuePut(Queue* q, void* item) {
+  pthread_mutex_lock(&q->lock);
+  while (q->count == q->capacity && !q->closed) {
+    pthread_cond_wait(&q->notFull, &q->lock);
+  }
+  int ok = !q->closed;
+  if (ok) {
+    q->item[(q->head + q->count) % q->capacity] = item;
+    q->count++;
+    pthread_cond_signal(&q->notEmpty);
+  }
+  pthread_mutex_unlock(&q->lock);
+  return ok;
+}
+
+// Wait while queue q is full.
+// Returns nonzero when there is room for an item, 0 if the queue was closed.
+static int queueWaitRoom(Queue* q) {
+  pthread_mutex_lock(&q->lock);
+  while (q->count == q->capacity && !q->closed) {
+    pthread_cond_wait(&q->notFull, &q->lock);
+  }
+  int ok = !q->closed;
+  pthread_mutex_unlock(&q->lock);
+  return ok;
+}
+
+// Remove the first item of queue q, waiting while it is empty.
+// Returns NULL if the queue is empty and closed.
+static void* queueGet(Queue* q) {
+  pthread_mutex_lock(&q->lock);
+  while (q->count == 0 && !q->closed) {
+    pthread_cond_wait(&q->notEmpty, &q->lock);
+  }
+  void* item = NULL;
+  if (q->count > 0) {
+    item = q->item[q->head];
+    q->head = (q->head + 1) % q->capacity;
+    q->count--;
+    pthread_cond_signal(&q->notFull);
+  }
+  pthread_mutex_unlock(&q->lock);
+  return item;
+}
+
+// Close queue q: wake up all threads waiting on it.
+static void queueClose(Queue* q) {
+  pthread_mutex_lock(&q->lock);
+  q->closed = 1;
+  pthread_cond_broadcast(&q->notEmpty);
+  pthread_cond_broadcast(&q->notFull);
+  pthread_mutex_unlock(&q->lock);
+}
+
+// Stream mode.
+//
+// With --stream IN, the rest of the pipeline is run once per frame of a
+// stream of PGM images (see ImageReadFrame), each time with an empty buffer
+// where the frame is I0; "save -" writes CURR as a frame to stdout.
+// Frames are read by a reader thread, through a queue of one frame, so the
+// next frame is read while the current one is processed (double buffering).
+// The reader waits for room in the queue before reading, so at most two
+// frames are in memory.  Frames of equal size reuse the same pixels: each
+// frame is destroyed after its pipeline, and its block returns to the
+// raster pool, to be taken by the frame after the next.
+
+// The reader thread
+typedef struct {
+  FILE* in;             // the stream
+  Queue queue;          // frames read, not yet processed
+  int failed;           // did reading fail?
+  int errnum;           // errno of the failure
+  const char* cause;    // errCause of the failure
+} Reader;
+
+// Read the frames of the stream into the queue, until the end of the
+// stream, a failure, or the queue is closed.
+static void* readFrames(void* arg) {
+  Reader* r = arg;
+  InstrThreadInit();
+  while (queueWaitRoom(&r->queue)) {
+    Image frame = NULL;
+    int res = ImageReadFrame(r->in, &frame);
+    if (res < 0) {
+      r->errnum = errno;
+      r->cause = ImageErrMsg();
+      r->failed = 1;
+    }
+    if (res <= 0) break;
+    if (!queuePut(&r->queue, frame)) {  // closed: processing stopped
+      ImageDestroy(&frame);
+      break;
+    }
+  }
+  queueClose(&r->queue);
+  InstrThreadExit();
+  return NULL;
+}
+
+// Run pipeline av[0..ac-1] for each frame of the stream in file path ("-"
+// for stdin).
+// Returns 0 on success or an error code (index in errors[]).
+static int stream(Tool* t, const char* path, int ac, char* av[]) {
+  Reader r = {.failed = 0};
+  r.in = strcmp(path, "-") == 0 ? stdin : fopen(path, "rb");
+  if (r.in == NULL) return 11;
+  if (!queueInit(&r.queue, 1)) {
+    if (r.in != stdin) fclose(r.in);
+    return 3;
+  }
+  pthread_t reader;
+  if (pthread_create(&reader, NULL, readFrames, &r) != 0) {
+    queueFree(&r.queue);
+    if (r.in != stdin) fclose(r.in);
+    return 11;
+  }
+
+  // The buffer of the enclosing pipeline is not used while streaming
+  Buffer saved = t->buf;
+  int err = 0;
+  int frames = 0;
+  Image frame;
+  while (err == 0 && (frame = queueGet(&r.queue)) != NULL) {
+    fprintf(stderr, "Frame %d -> I0\n", frames);
+    if (!bufInit(&t->buf, t->budget)) {
+      ImageDestroy(&frame);
+      err = 3;
+      break;
+    }
+    if (!bufPush(&t->buf, frame, NULL)) {
+      err = 3;
+    } else {
+      err = run(t, ac, av);
+    }
+    bufFree(&t->buf);
+    if (fflush(stdout) != 0) err = 11;
+    frames++;
+  }
+  t->buf = saved;
+
+  // Stop the reader (if processing failed), and drop the frames left
+  queueClose(&r.queue);
+  while ((frame = queueGet(&r.queue)) != NULL) ImageDestroy(&frame);
+  pthread_join(reader, NULL);
+  queueFree(&r.queue);
+  if (r.in != stdin) fclose(r.in);
+
+  if (err == 0 && r.failed) {
+    fprintf(stderr, "Reading frame %d failed: %s\n", frames, r.cause);
+    errno = r.errnum;
+    err = 11;
+  }
+  fprintf(stderr, "%d frames processed\n", frames);
+  return err;
+}
+
+// Batch mode.
+//
+// With --batch INDIR OUTDIR, the rest of the pipeline is run once for each
+// image file in INDIR (.pgm, .imt or .imz, in name order), each time with
+// an empty buffer where the image is I0, and CURR is then saved to a file
+// with the same name in OUTDIR.
+// This is done in three stages, that run concurrently: a reader thread
+// loads the images, the main thread runs the pipelines, and a writer thread
+// saves the results, with bounded queues between them, so that the disks
+// and the CPU are kept busy at the same time.  At the end, the time each
+// stage was busy is printed, as a percentage of the total time: the stage
+// closest to 100% is the bottleneck.
+
+// Capacity of the queues between stages
+#define BATCHQUEUE 2
+
+// An image file going through the stages
+typedef struct {
+  const char* name;     // file name (in INDIR and OUTDIR)
+  Image img;            // the image loaded, then the result
+} Job;
+
+// The failure of a stage
+typedef struct {
+  const char* name;     // file that failed (NULL if none)
+  int errnum;           // errno of the failure
+  const char* cause;    // errCause of the failure
+} Failure;
+
+// The state shared by the stages
+typedef struct {
+  const char* indir;
+  const char* outdir;
+  char** names;         // the files to process
+  int count;            // number of files
+  int tile;             // side of the tiles of tiled files saved
+  Queue loaded;         // jobs loaded, to be processed
+  Queue processed;      // jobs processed, to be saved
+  double busy[3];       // time each stage (read, compute, write) was busy
+  int saved;            // number of images saved (by the writer)
+  Failure readFailure;
+  Failure writeFailure;
+} Batch;
+
+// Record failure f on file name.
+static void fail(Failure* f, const char* name) {
+  f->name = name;
+  f->errnum = errno;
+  f->cause = ImageErrMsg();
+}
+
+// Join directory dir and file name into a new string.
+// Returns NULL if allocation fails.
+static char* joinPath(const char* dir, const char* name) {
+  size_t len = strlen(dir) + strlen(name) + 2;
+  char* path = malloc(len);
+  if (path != NULL) snprintf(path, len, "%s/%s", dir, name);
+  return path;
+}
+
+// Compare file names (for qsort).
+static int compareNames(const void* a, const void* b) {
+  return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// List the image files in directory dir, sorted by name, into (*names).
+// Returns the number of files, or -1 on failure (with errno set).
+static int listImages(const char* dir, char*** names) {
+  DIR* d = opendir(dir);
+  if (d == NULL) return -1;
+  int count = 0, capacity = 0;
+  char** array = NULL;
+  struct dirent* e;
+  while ((e = readdir(d)) != NULL) {
+    if (e->d_name[0] == '.' ||
+        !(hasExtension(e->d_name, ".pgm") || hasExtension(e->d_name, ".imt") ||
+          hasExtension(e->d_name, ".imz"))) {
+      continue;
+    }
+    if (count == capacity) {
+      capacity = capacity == 0 ? 64 : 2 * capacity;
+      char** more = realloc(array, capacity * sizeof(char*));
+      if (more == NULL) break;
+      array = more;
+    }
+    if ((array[count] = strdup(e->d_name)) == NULL) break;
+    count++;
+  }
+  int ok = e == NULL;  // listed all files?
+  closedir(d);
+  if (!ok) {
+    while (count > 0) free(array[--count]);
+    free(array);
+    errno = ENOMEM;
+    return -1;
+  }
+  qsort(array, count, sizeof(char*), compareNames);
+  *names = array;
+  return count;
+}
+
+// Reader stage: load the images into the loaded queue.
+static void* batchRead(void* arg) {
+  Batch* bt = arg;
+  InstrThreadInit();
+  for (int i = 0; i < bt->count; i++) {
+    char* path = joinPath(bt->indir, bt->names[i]);
+    double start = wallTime();
+    Image img = path == NULL ? NULL : loadFile(path);
+    bt->busy[0] += wallTime() - start;
+    free(path);
+    Job* job = img == NULL ? NULL : malloc(sizeof(Job));
+    if (job == NULL) {
+      ImageDestroy(&img);
+      fail(&bt->readFailure, bt->names[i]);
+      break;
+    }
+    job->name = bt->names[i];
+    job->img = img;
+    if (!queuePut(&bt->loaded, job)) {  // closed: processing stopped
+      ImageDestroy(&job->img);
+      free(job);
+      break;
+    }
+  }
+  queueClose(&bt->loaded);
+  InstrThreadExit();
+  return NULL;
+}
+
+// Writer stage: save the images in the processed queue.
+// After a failure, the remaining images are discarded.
+static void* batchWrite(void* arg) {
+  Batch* bt = arg;
+  InstrThreadInit();
+  Job* job;
+  while ((job = queueGet(&bt->processed)) != NULL) {
+    if (bt->writeFailure.name == NULL) {
+      char* path = joinPath(bt->outdir, job->name);
+      double start = wallTime();
+      int ok = path != NULL && saveFile(job->img, path, bt->tile);
+      bt->busy[2] += wallTime() - start;
+      free(path);
+      if (ok) {
+        bt->saved++;
+      } else {
+        fail(&bt->writeFailure, job->name);
+        queueClose(&bt->processed);  // stop processing
+      }
+    }
+    ImageDestroy(&job->img);
+    free(job);
+  }
+  InstrThreadExit();
+  return NULL;
+}
+
+// Discard the jobs left in queue q (which must be closed).
+static void discardJobs(Queue* q) {
+  Job* job;
+  while ((job = queueGet(q)) != NULL) {
+    ImageDestroy(&job->img);
+    free(job);
+  }
+}
+
+// Run pipeline av[0..ac-1] for each image file in directory indir, and save
+// the results in directory outdir.
+// Returns 0 on success or an error code (index in errors[]).
+static int batch(Tool* t, const char* indir, const char* outdir, int ac,
+                 char* av[]) {
+  Batch bt = {.indir = indir, .outdir = outdir, .tile = t->tile};
+  bt.names = NULL;
+  if ((bt.count = listImages(indir, &bt.names)) < 0) return 12;
+  int err = 0;
+  if (!queueInit(&bt.loaded, BATCHQUEUE)) {
+    err = 3;
+  } else if (!queueInit(&bt.processed, BATCHQUEUE)) {
+    queueFree(&bt.loaded);
+    err = 3;
+  }
+  if (err != 0) {
+    for (int i = 0; i < bt.count; i++) free(bt.names[i]);
+    free(bt.names);
+    return err;
+  }
+  double start = wallTime();
+  pthread_t reader, writer;
+  int readerStarted = pthread_create(&reader, NULL, batchRead, &bt) == 0;
+  int writerStarted = readerStarted &&
+                      pthread_create(&writer, NULL, batchWrite, &bt) == 0;
+  if (!writerStarted) err = 12;
+
+  // Compute stage (in this thread)
+  // The buffer of the enclosing pipeline is not used meanwhile
+  Buffer saved = t->buf;
+  Job* job;
+  while (err == 0 && (job = queueGet(&bt.loaded)) != NULL) {
+    double begin = wallTime();
+    fprintf(stderr, "Image %s -> I0\n", job->name);
+    Image img = job->img;
+    job->img = NULL;
+    if (!bufInit(&t->buf, t->budget)) {
+      ImageDestroy(&img);
+      err = 3;
+    } else {
+      if (!bufPush(&t->buf, img, NULL)) {
+        err = 3;
+      } else if ((err = run(t, ac, av)) == 0) {
+        // The result (CURR) outlives the buffer, as a clone
+        int n = t->buf.n;
+        Image cur;
+        if (n < 1) {
+          err = 2;
+        } else if ((cur = bufGet(&t->buf, n-1)) == NULL ||
+                   (job->img = ImageClone(cur)) == NULL) {
+          err = 4;
+        }
+      }
+      bufFree(&t->buf);
+    }
+    bt.busy[1] += wallTime() - begin;
+    if (err == 0 && !queuePut(&bt.processed, job)) err = 12;  // writer failed
+    if (err != 0) {
+      ImageDestroy(&job->img);
+      free(job);
+    }
+  }
+  t->buf = saved;
+
+  // Stop the reader (if processing failed), and let the writer finish
+  queueClose(&bt.loaded);
+  discardJobs(&bt.loaded);
+  queueClose(&bt.processed);
+  if (readerStarted) pthread_join(reader, NULL);
+  if (writerStarted) pthread_join(writer, NULL);
+  double elapsed = wallTime() - start;
+  queueFree(&bt.processed);
+  queueFree(&bt.loaded);
+
+  // Failures of the other stages
+  Failure* f[2] = {&bt.readFailure, &bt.writeFailure};
+  for (int i = 0; i < 2; i++) {
+    if (f[i]->name != NULL) {
+      fprintf(stderr, "%s %s failed: %s\n", i == 0 ? "Loading" : "Saving",
+              f[i]->name, f[i]->cause);
+      if (err == 0 || err == 12) {
+        errno = f[i]->errnum;
+        err = 12;
+      }
+    }
+  }
+
+  if (writerStarted) {
+    // (Only the images saved: not those that failed or were discarded)
+    printf("# Batch: %d images in %.3f s (%.1f images/s)\n", bt.saved,
+           elapsed, elapsed > 0.0 ? bt.saved / elapsed : 0.0);
+    printf("# Stage utilisation: read %.1f%%, compute %.1f%%, write %.1f%%\n",
+           100.0 * bt.busy[0] / elapsed, 100.0 * bt.busy[1] / elapsed,
+           100.0 * bt.busy[2] / elapsed);
+  }
+  for (int i = 0; i < bt.count; i++) free(bt.names[i]);
+  free(bt.names);
+  return err;
+}
+
+// Server mode.
+//
+// With --serve, imageTool keeps running and executes requests, one per line,
+// read from stdin (--serve -) or from clients connected to a Unix domain
+// socket (--serve PATH).  Each request is a pipeline, as on the command line,
+// that starts with an empty buffer.  Library initialization (calibration),
+// options and named images persist between requests.
+// The reply to a request is the output of its operations followed by a line
+// "OK <latency> ms" or "ERR <message>".  Requests longer than MAXREQUEST
+// bytes are rejected with ERR, without being executed.
+// The request "quit" closes the connection (or ends stdin mode) and the
+// request "shutdown" stops the server.
+
+// Maximum length of a request line (longer ones are rejected)
+#define MAXREQUEST 4096
+
+// Execute one request line, writing the reply to stdout.
+static void serveRequest(Tool* t, char* line) {
+  assert(strlen(line) <= MAXREQUEST + 1);
+  // Split line into words (bounded by MAXREQUEST)
+  int ac = 0;
+  char* av[strlen(line) / 2 + 1];
+  for (char* word = strtok(line, " \t\r\n"); word != NULL;
+       word = strtok(NULL, " \t\r\n")) {
+    av[ac++] = word;
+  }
+  if (ac == 0) return;
+
+  double start = wallTime();
+  int err = 3;
+  errno = 0;
+  if (bufInit(&t->buf, t->budget)) {
+    err = run(t, ac, av);
+    bufFree(&t->buf);
+  }
+  double latency = wallTime() - start;
+
+  if (err == 0) {
+    printf("OK %.3f ms\n", latency * 1000.0);
+  } else {
+    printf("ERR ");
+    printf(errors[err], ImageErrMsg());
+    if (errno != 0) printf(": %s", strerror(errno));
+    printf("\n");
+  }
+  fflush(stdout);
+  fprintf(stderr, "Request %s in %.3f ms\n", err ? "failed" : "done", latency * 1000.0);
+}
+
+// Serve requests read from file in, until EOF, quit, shutdown or a failure
+// to write the replies.
+// Returns nonzero if shutdown was requested.
+static int serveStream(Tool* t, FILE* in) {
+  char line[MAXREQUEST + 2];  // with the newline and the '\0'
+  int shutdown = 0;
+  while (fgets(line, sizeof(line), in) != NULL) {
+    size_t n = strlen(line);
+    if (n == sizeof(line) - 1 && line[n - 1] != '\n') {
+      // Too long: reject it, and skip the rest of the line
+      int c;
+      while ((c = getc(in)) != EOF && c != '\n') {}
+      printf("ERR Request too long (max %d bytes)\n", MAXREQUEST);
+      fflush(stdout);
+      fprintf(stderr, "Request rejected: longer than %d bytes\n", MAXREQUEST);
+      if (ferror(stdout)) break;
+      continue;
+    }
+    char word[16];
+    if (sscanf(line, "%15s", word) == 1) {
+      if (strcmp(word, "quit") == 0) break;
+      if (strcmp(word, "shutdown") == 0) { shutdown = 1; break; }
+    }
+    serveRequest(t, line);
+    if (ferror(stdout)) break;  // the client is gone (EPIPE)
+  }
+  return shutdown;
+}
+
+// Run in server mode, on stdin (path "-") or on a Unix domain socket.
+// Returns 0 on success or an error code (index in errors[]).
+static int serve(Tool* t, const char* path) {
+  // The buffer of the current pipeline is not used while serving
+  Buffer saved = t->buf;
+  t->serving = 1;
+  int err = 0;
+  // A client that disconnects must end its connection, not the server
+  void (*sigpipe)(int) = signal(SIGPIPE, SIG_IGN);
+
+  if (strcmp(path, "-") == 0) {
+    fprintf(stderr, "Serving requests from stdin\n");
+    serveStream(t, stdin);
+  } else {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+      errno = ENAMETOOLONG;
+      t->buf = saved;
+      t->serving = 0;
+      signal(SIGPIPE, sigpipe);
+      return 9;
+    }
+    strcpy(addr.sun_path, path);
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path);  // remove stale socket
+    if (sock < 0 ||
+        bind(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+        listen(sock, 8) != 0) {
+      err = 9;
+    } else {
+      fprintf(stderr, "Serving requests on %s\n", path);
+      int out = dup(STDOUT_FILENO);   // to restore stdout after each client
+      int shutdown = 0;
+      while (!shutdown) {
+        int conn = accept(sock, NULL, NULL);
+        if (conn < 0) {
+          if (errno == EINTR) continue;
+          err = 9;
+          break;
+        }
+        FILE* in = fdopen(conn, "r");
+        if (in == NULL) {
+          close(conn);
+          continue;
+        }
+        // Replies (and operation output) go to the client
+        fflush(stdout);
+        dup2(conn, STDOUT_FILENO);
+        shutdown = serveStream(t, in);
+        fflush(stdout);
+        clearerr(stdout);
+        dup2(out, STDOUT_FILENO);
+        fclose(in);
+      }
+      close(out);
+      unlink(path);
+    }
+    if (sock >= 0) close(sock);
+  }
+
+  t->buf = saved;
+  t->serving = 0;
+  signal(SIGPIPE, sigpipe);
+  return err;
+}
+
+int main(int ac, char* av[]) {
+  program_name = av[0];
+  if (ac <= 1) {
+    error(5, 0, "\n%s", USAGE);
+  }
+
+  ImageInit();
+
+  Tool tool = {.fuse = 1, .tile = 256};
+  if (!bufInit(&tool.buf, 0) || (tool.names = StoreCreate(0)) == NULL) {
+    error(3, errno, errors[3]);
+  }
+
+  int err = 0;
+  char* record = getenv("IMAGETOOL_RECORD");
+  if (record != NULL && !InstrRecordOpen(record)) {
+    err = errno == EINVAL ? 5 : 10;
+  }
+  if (err == 0) err = run(&tool, ac - 1, av + 1);
+
+  if (tool.stats) {
+    StorePrintStats(tool.buf.store, "buffer");
+    StorePrintStats(tool.names, "names");
+  }
+
   // Destroy remaining images
-  while (n > 0) {
-    ImageDestroy(&img[--n]);
+  bufFree(&tool.buf);
+  StoreDestroy(&tool.names);
+  for (int i = 0; i < tool.numNames; i++) {
+    free(tool.name[i].name);
   }
+  free(tool.name);
+  InstrRecordClose();
 
   error(err, errno, errors[err], ImageErrMsg());
   return 0;
 }
-
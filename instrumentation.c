@@ -18,10 +18,25 @@
 ///   a[k] = a[i] + a[j];
 /// }
 /// InstrPrint();  // to show time and counters
+///
+/// (INSTR_ADD(0, 3) may be used instead of InstrCount[0] += 3, so that the
+/// counting is removed when compiling with -DNO_INSTR.)
+///
+/// Counters are kept per thread (see InstrThreadInit), and aggregated
+/// when printed, so threads may count without any synchronization.
 
 #include "instrumentation.h"
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
 
 /// Cpu time in seconds
 double cpu_time(void) ; ///
@@ -42,6 +57,23 @@ double cpu_time(void) {
   return (double)current_time.tv_sec + 1.0e-9 * (double)current_time.tv_nsec;
 }
 
+double wall_time(void) {
+  struct timespec current_time;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &current_time) != 0)
+    return -1.0;
+  return (double)current_time.tv_sec + 1.0e-9 * (double)current_time.tv_nsec;
+}
+
+// Cpu time of the calling thread in seconds
+static double thread_time(void) {
+  struct timespec current_time;
+
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &current_time) != 0)
+    return -1.0;
+  return (double)current_time.tv_sec + 1.0e-9 * (double)current_time.tv_nsec;
+}
+
 #endif
 
 
@@ -66,10 +98,18 @@ double cpu_time(void) {
   return (double)current_time.QuadPart / (double)frequency.QuadPart;
 }
 
+double wall_time(void) {
+  return cpu_time();  // already measures elapsed time
+}
+
+static double thread_time(void) {
+  return cpu_time();
+}
+
 #endif
 
-/// Array of operation counters:
-unsigned long InstrCount[NUMCOUNTERS];  ///extern
+/// Array of operation counters (of the calling thread):
+_Thread_local unsigned long InstrCount[NUMCOUNTERS];  ///extern
 
 /// Array of names for the counters:
 char* InstrName[NUMCOUNTERS] = {NULL};  ///extern
@@ -82,6 +122,87 @@ double InstrTime;  ///extern
 /// Calibrated Time Unit (in seconds, initially 1s)
 double InstrCTU = 1.0;  ///extern
 
+// Threads
+
+// A registered thread
+typedef struct thread {
+  unsigned long* count;     // its InstrCount array
+  struct thread* next;
+} Thread;
+
+// Registered threads, protected by lock
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static Thread* threads = NULL;
+// Sum of counts of threads that have exited
+static unsigned long retired[NUMCOUNTERS];
+// Totals at previous reset
+static unsigned long baseline[NUMCOUNTERS];
+
+// The calling thread, and whether it is registered
+static _Thread_local Thread self;
+static _Thread_local int registered = 0;
+
+static void regionsExit(void) ;
+
+/// Register the calling thread, so its counts are included in totals.
+void InstrThreadInit(void) { ///
+  if (registered) return;
+  self.count = InstrCount;
+  pthread_mutex_lock(&lock);
+  self.next = threads;
+  threads = &self;
+  pthread_mutex_unlock(&lock);
+  registered = 1;
+}
+
+/// Unregister the calling thread, keeping its counts and regions.
+void InstrThreadExit(void) { ///
+  if (!registered) return;
+  pthread_mutex_lock(&lock);
+  Thread** p = &threads;
+  while (*p != &self) p = &(*p)->next;
+  *p = self.next;
+  for (int i = 0; i < NUMCOUNTERS; i++)
+    retired[i] += InstrCount[i];
+  regionsExit();
+  pthread_mutex_unlock(&lock);
+  registered = 0;
+}
+
+// Sum of counter i in all threads (lock must be held)
+static unsigned long total(int i) {
+  unsigned long sum = retired[i];
+  for (Thread* t = threads; t != NULL; t = t->next)
+    sum += t->count[i];
+  return sum;
+}
+
+/// Total count of counter i, in all threads, since the last reset.
+unsigned long InstrTotal(int i) { ///
+  assert(0 <= i && i < NUMCOUNTERS);
+  InstrThreadInit();
+  pthread_mutex_lock(&lock);
+  unsigned long sum = total(i) - baseline[i];
+  pthread_mutex_unlock(&lock);
+  return sum;
+}
+
+/// Register a new counter with the given name.
+int InstrRegister(char* name) { ///
+  assert(name != NULL);
+  InstrThreadInit();
+  pthread_mutex_lock(&lock);
+  int i = 0;
+  while (i < NUMCOUNTERS && InstrName[i] != NULL) i++;
+  if (i < NUMCOUNTERS) {
+    InstrName[i] = name;
+  } else {
+    i = -1;
+  }
+  pthread_mutex_unlock(&lock);
+  return i;
+}
+
 /// Find the Calibrated Time Unit (CTU).
 /// Run and time a loop of basic memory and arithmetic operations to set
 /// a reasonably cpu-independent time unit.
@@ -89,6 +210,7 @@ void InstrCalibrate(void) { ///
   const int size = 4*1024;     // 2^12!
   const int mask = size - 1;
   int array[size];  // alloc array in stack, not initialized on purpose
+  InstrThreadInit();
   double time = cpu_time();
   srand((unsigned int)(time*1e9));
   for (int n = 0; n < 40000000; n++) {
@@ -101,10 +223,227 @@ void InstrCalibrate(void) { ///
   InstrCTU = cpu_time() - time;
 }
 
-/// Reset counters to zero and store cpu_time.
+// Performance events
+
+#if defined(__linux__)
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+
+// A performance event
+typedef struct {
+  char* name;
+  unsigned int type;
+  unsigned long long config;
+} Event;
+
+#define HWCACHE(cache, result) \
+  ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | ((result) << 16))
+
+static const Event hardware[] = {
+  {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+  {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+  {"L1d-misses", PERF_TYPE_HW_CACHE,
+      HWCACHE(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_RESULT_MISS)},
+  {"LLC-misses", PERF_TYPE_HW_CACHE,
+      HWCACHE(PERF_COUNT_HW_CACHE_LL, PERF_COUNT_HW_CACHE_RESULT_MISS)},
+  {"branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+};
+
+static const Event software[] = {
+  {"task-clock(ns)", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+  {"page-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+  {"ctx-switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+};
+
+#define NUMEVENTS 5
+
+// Value read from an event (with PERF_FORMAT_TOTAL_TIME_*)
+typedef struct {
+  unsigned long long value;
+  unsigned long long enabled;   // time enabled
+  unsigned long long running;   // time actually counting
+} Sample;
+
+// Enabled events, their file descriptors and samples at previous reset
+static int numEvents = 0;
+static const Event* event[NUMEVENTS];
+static int eventFd[NUMEVENTS];
+static Sample eventBase[NUMEVENTS];
+
+// Open event e for the calling thread, and the threads it creates later
+// (pid=0, inherit=1; their counts are added when they exit).
+// Returns file descriptor, or -1 on failure.
+static int perfOpen(const Event* e) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = e->type;
+  attr.config = e->config;
+  attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+                     PERF_FORMAT_TOTAL_TIME_RUNNING;
+  attr.inherit = 1;
+  attr.exclude_kernel = 1;  // usually required by perf_event_paranoid
+  attr.exclude_hv = 1;
+  return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void perfRead(int i, Sample* smp) {
+  if (read(eventFd[i], smp, sizeof(*smp)) != sizeof(*smp)) {
+    smp->value = smp->enabled = smp->running = 0;
+  }
+}
+
+// Try to enable the n events in list.
+static void perfEnableList(const Event list[], int n) {
+  for (int i = 0; i < n && numEvents < NUMEVENTS; i++) {
+    int fd = perfOpen(&list[i]);
+    if (fd >= 0) {
+      event[numEvents] = &list[i];
+      eventFd[numEvents] = fd;
+      perfRead(numEvents, &eventBase[numEvents]);
+      numEvents++;
+    }
+  }
+}
+
+/// Enable counting performance events of the process.
+int InstrPerfEnable(void) { ///
+  if (numEvents > 0) return numEvents;
+  int errsave = errno;  // failures here are not errors of the caller
+  perfEnableList(hardware, sizeof(hardware) / sizeof(hardware[0]));
+  if (numEvents == 0) {
+    // Eventos de hardware não permitidos (ou não virtualizados)
+    perfEnableList(software, sizeof(software) / sizeof(software[0]));
+  }
+  errno = errsave;
+  return numEvents;
+}
+
+/// Stop counting performance events.
+void InstrPerfDisable(void) { ///
+  for (int i = 0; i < numEvents; i++) close(eventFd[i]);
+  numEvents = 0;
+}
+
+static void perfReset(void) {
+  for (int i = 0; i < numEvents; i++) perfRead(i, &eventBase[i]);
+}
+
+// Get names and counts (since previous reset) of the enabled events.
+// Returns the number of events.
+static int perfCounts(const char* name[], unsigned long long count[]) {
+  for (int i = 0; i < numEvents; i++) {
+    Sample smp;
+    perfRead(i, &smp);
+    double value = (double)(smp.value - eventBase[i].value);
+    double enabled = (double)(smp.enabled - eventBase[i].enabled);
+    double running = (double)(smp.running - eventBase[i].running);
+    // Escalar se o evento foi multiplexado com outros
+    if (running > 0.0 && running < enabled) value *= enabled / running;
+    count[i] = (unsigned long long)value;
+    name[i] = event[i]->name;
+  }
+  return numEvents;
+}
+
+static void perfPrint(void) {
+  if (numEvents == 0) return;
+  const char* name[NUMEVENTS];
+  unsigned long long count[NUMEVENTS];
+  perfCounts(name, count);
+  int ipc = numEvents >= 2 && event[0] == &hardware[0] &&
+            event[1] == &hardware[1];
+  printf("#");
+  for (int i = 0; i < numEvents; i++)
+    printf("%s%15.15s", i == 0 ? "" : "\t", name[i]);
+  if (ipc) printf("\t%15s", "IPC");
+  puts("");
+  for (int i = 0; i < numEvents; i++)
+    printf("%s%*llu", i == 0 ? "" : "\t", i == 0 ? 16 : 15, count[i]);
+  if (ipc) printf("\t%15.3f", count[0] > 0 ? (double)count[1] / count[0] : 0.0);
+  puts("");
+}
+
+#else
+
+int InstrPerfEnable(void) { ///
+  return 0;
+}
+
+void InstrPerfDisable(void) { ///
+}
+
+static void perfReset(void) {
+}
+
+static int perfCounts(const char* name[], unsigned long long count[]) {
+  (void)name;
+  (void)count;
+  return 0;
+}
+
+static void perfPrint(void) {
+}
+
+#define NUMEVENTS 1
+
+#endif
+
+// Peak resident set size
+
+// Reset the peak resident set size to the current one (Linux only; best
+// effort: it needs a kernel with /proc/PID/clear_refs).
+static void peakRSSReset(void) {
+#ifdef __linux__
+  int fd = open("/proc/self/clear_refs", O_WRONLY);
+  if (fd >= 0) {
+    if (write(fd, "5", 1) != 1) {
+      // não suportado: o pico fica o do processo inteiro
+    }
+    close(fd);
+  }
+#endif
+}
+
+/// Peak resident set size of the process since the last reset.
+unsigned long InstrPeakRSS(void) { ///
+#ifdef __linux__
+  // VmHWM segue a reposição feita por peakRSSReset (ru_maxrss não)
+  FILE* f = fopen("/proc/self/status", "r");
+  if (f != NULL) {
+    char line[128];
+    unsigned long kb = 0;
+    int found = 0;
+    while (!found && fgets(line, sizeof(line), f) != NULL) {
+      found = sscanf(line, "VmHWM: %lu kB", &kb) == 1;
+    }
+    fclose(f);
+    if (found) return kb * 1024;
+  }
+#endif
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#ifdef __APPLE__
+  return (unsigned long)usage.ru_maxrss;  // em bytes
+#else
+  return (unsigned long)usage.ru_maxrss * 1024;  // em KiB
+#endif
+}
+
+/// Reset counters (of all threads) to zero and store cpu_time.
 void InstrReset(void) { ///
+  InstrThreadInit();
+  // Só o próprio fio de execução escreve no seu array: para os outros,
+  // guarda-se o total atual, que é descontado ao imprimir
   for (int i = 0; i < NUMCOUNTERS; i++)
     InstrCount[i] = 0ul;
+  pthread_mutex_lock(&lock);
+  for (int i = 0; i < NUMCOUNTERS; i++)
+    baseline[i] = total(i);
+  pthread_mutex_unlock(&lock);
+  perfReset();
+  peakRSSReset();
   InstrTime = cpu_time();
 }
 
@@ -116,14 +455,322 @@ void InstrPrint(void) { ///
   double caltime = time / InstrCTU;
 
   printf("#%14.15s\t%15.15s", "time", "caltime");
+#ifndef NO_INSTR  // (counters are not counted)
   for (int i = 0; i < NUMCOUNTERS; i++)
     if (InstrName[i] != NULL)
       printf("\t%15.15s", InstrName[i]);
+#endif
   puts("");
   printf("%15.6f\t%15.6f", time, caltime);
+#ifndef NO_INSTR
   for (int i = 0; i < NUMCOUNTERS; i++)
     if (InstrName[i] != NULL)
-      printf("\t%15lu", InstrCount[i]);  
+      printf("\t%15lu", InstrTotal(i));
+#endif
   puts("");
+  perfPrint();
 }
 
+
+// Structured output
+
+// Format and file of records (NULL if disabled), and whether any was written
+static enum { JSON, CSV } recordFormat;
+static FILE* recordFile = NULL;
+static int recordCount = 0;
+
+// Fields added to the next record by InstrRecordField
+#define NUMFIELDS 16
+static const char* fieldName[NUMFIELDS];
+static unsigned long long fieldValue[NUMFIELDS];
+static int numFields = 0;
+
+/// Set the format and destination of records.
+int InstrRecordOpen(const char* spec) { ///
+  assert(spec != NULL);
+  const char* colon = strchr(spec, ':');
+  size_t len = colon != NULL ? (size_t)(colon - spec) : strlen(spec);
+  int format;
+  if (len == 4 && strncmp(spec, "json", 4) == 0) {
+    format = JSON;
+  } else if (len == 3 && strncmp(spec, "csv", 3) == 0) {
+    format = CSV;
+  } else {
+    errno = EINVAL;
+    return 0;
+  }
+  int fd = 3;
+  if (colon != NULL) {
+    char* end;
+    long n = strtol(colon + 1, &end, 10);
+    if (end == colon + 1 || *end != '\0' || n < 0 || n > INT_MAX) {
+      errno = EINVAL;
+      return 0;
+    }
+    fd = (int)n;
+  }
+  // Usar uma cópia do descritor, para o poder fechar sem afetar o original
+  int dupfd = dup(fd);
+  if (dupfd < 0) return 0;
+  FILE* f = fdopen(dupfd, "w");
+  if (f == NULL) {
+    close(dupfd);
+    return 0;
+  }
+  InstrRecordClose();
+  recordFile = f;
+  recordFormat = format;
+  recordCount = 0;
+  return 1;
+}
+
+/// Stop writing records (and close their file).
+void InstrRecordClose(void) { ///
+  if (recordFile != NULL) fclose(recordFile);
+  recordFile = NULL;
+}
+
+/// Are records being written?
+int InstrRecording(void) { ///
+  return recordFile != NULL;
+}
+
+// Write string str to f, quoted for the record format.
+static void putQuoted(FILE* f, const char* str) {
+  putc('"', f);
+  for (const unsigned char* p = (const unsigned char*)str; *p != '\0'; p++) {
+    if (recordFormat == CSV) {
+      if (*p == '"') putc('"', f);  // "" dentro de aspas
+      putc(*p, f);
+    } else if (*p == '"' || *p == '\\') {
+      fprintf(f, "\\%c", *p);
+    } else if (*p < 0x20) {
+      fprintf(f, "\\u%04x", *p);
+    } else {
+      putc(*p, f);
+    }
+  }
+  putc('"', f);
+}
+
+/// Add a field to the next record.
+void InstrRecordField(const char* name, unsigned long long value) { ///
+  assert(name != NULL);
+  if (numFields < NUMFIELDS) {
+    fieldName[numFields] = name;
+    fieldValue[numFields++] = value;
+  }
+}
+
+/// Write a record with the times and counters since the last reset.
+void InstrRecord(const char* op, int width, int height) { ///
+  assert(op != NULL);
+  if (recordFile == NULL) return;
+  double time = cpu_time() - InstrTime;
+  double caltime = time / InstrCTU;
+  const char* name[NUMCOUNTERS + NUMEVENTS + 1 + NUMFIELDS];
+  unsigned long long count[NUMCOUNTERS + NUMEVENTS + 1 + NUMFIELDS];
+  int n = 0;
+#ifndef NO_INSTR
+  for (int i = 0; i < NUMCOUNTERS; i++) {
+    if (InstrName[i] != NULL) {
+      name[n] = InstrName[i];
+      count[n++] = InstrTotal(i);
+    }
+  }
+#endif
+  n += perfCounts(name + n, count + n);
+  name[n] = "peakrss";
+  count[n++] = InstrPeakRSS();
+  for (int i = 0; i < numFields; i++) {
+    name[n] = fieldName[i];
+    count[n++] = fieldValue[i];
+  }
+  numFields = 0;
+
+  char stamp[32];
+  struct timespec now;
+  struct tm tm;
+  clock_gettime(CLOCK_REALTIME, &now);
+  gmtime_r(&now.tv_sec, &tm);
+  size_t len = strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+  snprintf(stamp + len, sizeof(stamp) - len, ".%03ldZ", now.tv_nsec / 1000000);
+
+  FILE* f = recordFile;
+  if (recordFormat == JSON) {
+    fprintf(f, "{\"timestamp\": \"%s\", \"op\": ", stamp);
+    putQuoted(f, op);
+    fprintf(f, ", \"width\": %d, \"height\": %d, \"time\": %.9f, "
+            "\"caltime\": %.9f", width, height, time, caltime);
+    for (int i = 0; i < n; i++) {
+      fprintf(f, ", ");
+      putQuoted(f, name[i]);
+      fprintf(f, ": %llu", count[i]);
+    }
+    fprintf(f, "}\n");
+  } else {
+    if (recordCount == 0) {
+      fprintf(f, "timestamp,op,width,height,time,caltime");
+      for (int i = 0; i < n; i++) {
+        putc(',', f);
+        putQuoted(f, name[i]);
+      }
+      putc('\n', f);
+    }
+    fprintf(f, "%s,", stamp);
+    putQuoted(f, op);
+    fprintf(f, ",%d,%d,%.9f,%.9f", width, height, time, caltime);
+    for (int i = 0; i < n; i++)
+      fprintf(f, ",%llu", count[i]);
+    putc('\n', f);
+  }
+  fflush(f);
+  recordCount++;
+}
+
+
+// Timing regions
+
+// A node in the tree of regions
+typedef struct region {
+  char* name;
+  struct region* parent;
+  struct region* child;     // first child
+  struct region* next;      // next sibling
+  unsigned long calls;      // number of calls (completed)
+  double wall;              // total wall time
+  double min;               // minimum wall time of a call
+  double max;               // maximum wall time of a call
+  double cpu;               // total cpu time
+  double wallStart;         // wall time at begin of current call
+  double cpuStart;          // cpu time at begin of current call
+} Region;
+
+// Root of the tree of each thread (never timed), and innermost open region
+// (NULL for the root, as a thread-local address is not a constant)
+static _Thread_local Region root;
+static _Thread_local Region* current = NULL;
+
+// Root of the merged trees of threads that have exited (protected by lock)
+static Region finished;
+
+// Find the child of parent with the given name, or add it (at the end).
+static Region* child(Region* parent, const char* name) {
+  Region** p = &parent->child;
+  while (*p != NULL && strcmp((*p)->name, name) != 0) {
+    p = &(*p)->next;
+  }
+  if (*p == NULL) {
+    Region* r = calloc(1, sizeof(Region));
+    if (r == NULL || (r->name = strdup(name)) == NULL) {
+      abort();  // out of memory while instrumenting: give up
+    }
+    r->parent = parent;
+    *p = r;
+  }
+  return *p;
+}
+
+// Add the statistics of region r to region into.
+static void addRegion(Region* into, const Region* r) {
+  if (r->calls == 0) return;
+  if (into->calls == 0 || r->min < into->min) into->min = r->min;
+  if (into->calls == 0 || r->max > into->max) into->max = r->max;
+  into->calls += r->calls;
+  into->wall += r->wall;
+  into->cpu += r->cpu;
+}
+
+// Merge the children of r (recursively) into those of into, freeing them.
+static void mergeInto(Region* into, Region* r) {
+  Region* c = r->child;
+  while (c != NULL) {
+    Region* next = c->next;
+    Region* m = child(into, c->name);
+    addRegion(m, c);
+    mergeInto(m, c);
+    free(c->name);
+    free(c);
+    c = next;
+  }
+  r->child = NULL;
+}
+
+// Merge the tree of the exiting thread into the finished tree.
+// (lock must be held)
+static void regionsExit(void) {
+  assert(current == NULL || current == &root);  // region left open
+  mergeInto(&finished, &root);
+  current = NULL;
+}
+
+/// Begin timing region name (as a child of the innermost open region).
+void InstrBegin(const char* name) { ///
+  if (current == NULL) {
+    InstrThreadInit();
+    current = &root;
+  }
+  current = child(current, name);
+  current->cpuStart = thread_time();
+  current->wallStart = wall_time();
+}
+
+/// End timing the innermost open region.
+void InstrEnd(void) { ///
+  assert(current != NULL && current != &root);  // unbalanced InstrEnd
+  double wall = wall_time() - current->wallStart;
+  double cpu = thread_time() - current->cpuStart;
+  if (current->calls == 0 || wall < current->min) current->min = wall;
+  if (current->calls == 0 || wall > current->max) current->max = wall;
+  current->calls++;
+  current->wall += wall;
+  current->cpu += cpu;
+  current = current->parent;
+}
+
+/// Used by INSTR_SCOPE, to end the region when leaving the block.
+void InstrEndScope(int* scope) { ///
+  (void)scope;
+  InstrEnd();
+}
+
+static void resetRegion(Region* r) {
+  for (; r != NULL; r = r->next) {
+    r->calls = 0;
+    r->wall = r->cpu = r->min = r->max = 0.0;
+    resetRegion(r->child);
+  }
+}
+
+/// Reset the statistics of all regions to zero.
+void InstrRegionsReset(void) { ///
+  resetRegion(root.child);
+  pthread_mutex_lock(&lock);
+  resetRegion(finished.child);
+  pthread_mutex_unlock(&lock);
+}
+
+static void printRegion(Region* r, int depth) {
+  for (; r != NULL; r = r->next) {
+    if (r->calls > 0) {
+      printf("%*s%-*.*s\t%10lu\t%12.6f\t%12.6f\t%12.6f\t%12.6f\t%12.6f\n",
+             2 * depth, "", 30 - 2 * depth, 30 - 2 * depth, r->name, r->calls,
+             r->wall, 1e3 * r->wall / r->calls, 1e3 * r->min, 1e3 * r->max,
+             r->cpu);
+    }
+    printRegion(r->child, depth + 1);
+  }
+}
+
+/// Print the statistics of all regions, as a tree.
+void InstrRegionsPrint(void) { ///
+  printf("#%-29s\t%10s\t%12s\t%12s\t%12s\t%12s\t%12s\n", "region", "calls",
+         "wall(s)", "mean(ms)", "min(ms)", "max(ms)", "cpu(s)");
+  printRegion(root.child, 0);
+  pthread_mutex_lock(&lock);
+  if (finished.child != NULL) {
+    printf("# other threads\n");
+    printRegion(finished.child, 0);
+  }
+  pthread_mutex_unlock(&lock);
+}
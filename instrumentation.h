@@ -25,15 +25,50 @@
 /// Cpu time in seconds
 double cpu_time(void) ; ///
 
-/// Ten counters should be more than enough
-#define NUMCOUNTERS 10
+/// Maximum number of counters.
+/// The table is fixed (not grown as counters are registered), so that
+/// counting stays a plain increment of a thread-local array, with no
+/// indirection, and no reallocation while other threads count.
+#define NUMCOUNTERS 64
 
-/// Array of operation counters:
-extern unsigned long InstrCount[NUMCOUNTERS];  ///extern
+/// Array of operation counters (of the calling thread):
+/// Each thread counts in its own array, so counting is as cheap as
+/// incrementing a global variable, and threads never race or share cache
+/// lines.  InstrPrint and InstrTotal aggregate the counts of all threads.
+extern _Thread_local unsigned long InstrCount[NUMCOUNTERS];  ///extern
 
 /// Array of names for the counters:
+/// Only named counters are printed.
 extern char* InstrName[NUMCOUNTERS];  ///extern
 
+/// Add n to counter i, as in: INSTR_ADD(0, 3);
+/// Compiling with -DNO_INSTR removes all counting (and INSTR_SCOPE regions)
+/// from the hot paths: INSTR_ADD compiles to nothing and n is not evaluated.
+/// Times are still measured by InstrReset and InstrPrint.
+#ifndef NO_INSTR
+#define INSTR_ADD(i, n) ((void)(InstrCount[i] += (n)))
+#else
+#define INSTR_ADD(i, n) ((void)0)
+#endif
+
+/// Register a new counter with the given name (which must stay valid).
+/// Returns its index in InstrCount, or -1 if all NUMCOUNTERS counters are
+/// in use.
+int InstrRegister(char* name) ;
+
+/// Total count of counter i, in all threads, since the last reset.
+unsigned long InstrTotal(int i) ;
+
+/// Threads.
+/// A thread is registered automatically when it calls any Instr* function,
+/// but threads that only increment counters must call InstrThreadInit()
+/// before counting.  Any thread other than the main thread must call
+/// InstrThreadExit() before terminating: its counts are then kept, and its
+/// timing regions are merged into a common tree.
+void InstrThreadInit(void) ;
+
+void InstrThreadExit(void) ;
+
 /// Cpu_time read on previous reset (~seconds)
 extern double InstrTime;  ///extern
 
@@ -45,10 +80,117 @@ extern double InstrCTU;  ///extern
 /// a reasonably cpu-independent time unit.
 void InstrCalibrate(void) ;
 
-/// Reset counters to zero and store cpu_time.
+/// Reset counters (of all threads) to zero and store cpu_time.
+/// Also resets the peak resident set size, where the system permits.
 void InstrReset(void) ;
 
+/// Peak resident set size (physical memory used) of the process, in bytes,
+/// since the last InstrReset, where the system permits resetting it
+/// (Linux); otherwise, since the process started.  0 if unknown.
+unsigned long InstrPeakRSS(void) ;
+
+/// Print times and all named counter totals.
+/// If performance events are enabled, they are printed in a second line.
 void InstrPrint(void) ;
 
+/// Structured output
+///
+/// Besides the table printed by InstrPrint, the times and counters since the
+/// last reset may be written as records to a separate file, one per line,
+/// in JSON (one object per line) or CSV (with a header line) format, for
+/// regression tracking.  Each record has a timestamp (UTC, ISO 8601), the
+/// operation measured, image width and height, time, caltime and the total
+/// of every named counter (and enabled performance event), the peak
+/// resident set size (peakrss, see InstrPeakRSS), and the fields added
+/// with InstrRecordField.
+
+/// Set the format and destination of records from spec "FORMAT[:FD]":
+/// FORMAT is json or csv, and FD is an open file descriptor (default 3).
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno is set (records are left as they were).
+int InstrRecordOpen(const char* spec) ;
+
+/// Stop writing records (and close their file).
+void InstrRecordClose(void) ;
+
+/// Are records being written?
+int InstrRecording(void) ;
+
+/// Add a field with the given name and value to the next record (e.g. the
+/// memory use measured by another module).  At most 16 fields are kept
+/// per record, and name must stay valid until the record is written.
+/// In CSV, every record must have the same fields (the header is written
+/// with the first one).
+void InstrRecordField(const char* name, unsigned long long value) ;
+
+/// Write a record with the times and counters since the last reset.
+///   op : name of the operation(s) measured.
+///   width, height : image dimensions (0 if not applicable).
+/// Does nothing if records are not being written.
+void InstrRecord(const char* op, int width, int height) ;
+
+/// Performance events (Linux only)
+///
+/// Enable counting performance events of the calling thread, and of the
+/// threads it creates after this call (their counts are only added when
+/// they exit), with perf_event_open.  Threads already running, or started
+/// by other threads, are not counted: call it before starting any.
+/// Counts hardware events (cycles, instructions, L1 data and
+/// last level cache misses, branch misses) if the system permits them, or
+/// else software events (task clock, page faults, context switches).
+/// Events that cannot be counted are left out.
+/// The events are then reset by InstrReset and printed by InstrPrint.
+/// Returns the number of events enabled (0 if none are permitted).
+int InstrPerfEnable(void) ;
+
+/// Stop counting performance events.
+void InstrPerfDisable(void) ;
+
+/// Timing regions
+///
+/// Named regions of code may be timed, with either:
+///   InstrBegin("load");
+///   ...
+///   InstrEnd();
+/// or, to time the rest of the enclosing block (until any return):
+///   INSTR_SCOPE("load");
+///
+/// Regions nest: a region begun while another one is open (in the same
+/// thread) is a child of that region, so the same name may appear under
+/// different parents.
+/// For each region, the number of calls, the total, minimum and maximum
+/// elapsed (monotonic wall clock) time and the total cpu time of the
+/// calling thread are accumulated.
+/// InstrRegionsPrint() shows them as a tree.
+
+/// Wall clock (monotonic) time in seconds
+double wall_time(void) ; ///
+
+/// Begin timing region name (as a child of the innermost open region).
+void InstrBegin(const char* name) ;
+
+/// End timing the innermost open region.
+void InstrEnd(void) ;
+
+/// Reset the statistics of all regions to zero.
+/// Open regions stay open.
+void InstrRegionsReset(void) ;
+
+/// Print the statistics of all regions, as a tree: first the regions of
+/// the calling thread, then the merged regions of threads that have exited.
+void InstrRegionsPrint(void) ;
+
+/// Used by INSTR_SCOPE, to end the region when leaving the block.
+void InstrEndScope(int* scope) ;
+
+#if defined(NO_INSTR)
+#define INSTR_SCOPE(name)  // removed: no timing
+#elif defined(__GNUC__)
+#define INSTR_SCOPE(name) \
+  int InstrScope_ __attribute__((cleanup(InstrEndScope))) = (InstrBegin(name), 0)
+#else
+#define INSTR_SCOPE(name)  // not supported: no timing
+#endif
+
 #endif
 